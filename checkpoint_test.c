@@ -0,0 +1,190 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Crash test of the checkpoint file (see -S). Over and over, a child starts
+// up with network_diagnosis.c's own openCheckpoint(), checks the state it
+// restored, and then writes checkpoints as fast as it can until we kill it
+// with SIGKILL, nearly always in the middle of a writeCheckpoint(). Every
+// tick the child moves all tests' state forward together, so a restore that
+// mixed slots, or took a torn one, breaks the relation between them. Every
+// other start lists the tests in reverse order, so that they're matched by
+// hash instead of by index. Run with "make test".
+
+#define main networkDiagnosisMain
+#include "network_diagnosis.c"
+#undef main
+
+// Number of tests, and of restarts.
+#define CHECKPOINT_TEST_TESTS 2000
+#define CHECKPOINT_TEST_RESTARTS 100
+
+// Result character of tick "t".
+char getTickChar(uint64_t t) {
+    return 'A' + t % 26;
+}
+
+// Check the state restored into "tests", all at "tick", returning an error
+// message or NULL.
+char const *checkRestoredTests(struct Test tests[], int count, uint64_t tick) {
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        if (test->mSuccessCount != tick || test->mFailureCount != 2*tick) {
+            return "counts from different checkpoints";
+        }
+
+        int length = getHistoryLength(&test->mResults);
+        int expected = tick < CHECKPOINT_HISTORY ? tick : CHECKPOINT_HISTORY;
+        if (length != expected) {
+            return "wrong history length";
+        }
+        for (int k = 0; k < length; k++) {
+            if (getHistoryChar(&test->mResults, k) != getTickChar(tick - 1 - k)) {
+                return "wrong history";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Restore from "path", check, report the restored tick on "reportFd", then
+// write checkpoints until killed.
+void runCheckpointWriter(char const *path, int reversed, int reportFd) {
+    struct Test *tests = (struct Test *) calloc(CHECKPOINT_TEST_TESTS, sizeof(struct Test));
+
+    for (int i = 0; i < CHECKPOINT_TEST_TESTS; i++) {
+        struct Test *test = &tests[reversed ? CHECKPOINT_TEST_TESTS - 1 - i : i];
+
+        test->mTestType = DNS;
+        asprintf(&test->mAddress, "10.0.%d.%d", i >> 8, i & 0xFF);
+        test->mGroupIndex = -1;
+    }
+    initializeTests(tests, CHECKPOINT_TEST_TESTS);
+    openCheckpoint(path, tests, CHECKPOINT_TEST_TESTS);
+
+    uint64_t tick = tests[0].mSuccessCount;
+    char const *error = checkRestoredTests(tests, CHECKPOINT_TEST_TESTS, tick);
+    if (error != NULL) {
+        fprintf(stderr, "Restored tick %llu: %s\n", (unsigned long long) tick, error);
+        _exit(1);
+    }
+    if (write(reportFd, &tick, sizeof(tick)) != sizeof(tick)) {
+        _exit(1);
+    }
+
+    while (1) {
+        for (int i = 0; i < CHECKPOINT_TEST_TESTS; i++) {
+            struct Test *test = &tests[i];
+
+            test->mSuccessCount = tick + 1;
+            test->mFailureCount = 2*(tick + 1);
+            addToHistory(&test->mResults, getTickChar(tick));
+        }
+        tick++;
+        writeCheckpoint(CHECKPOINT, tests, CHECKPOINT_TEST_TESTS);
+    }
+}
+
+// Whether one of the slots of the checkpoint file at "path" is torn.
+int isCheckpointTorn(char const *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    struct CheckpointHeader *header = (struct CheckpointHeader *) mmap(NULL, st.st_size,
+            PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    size_t slotSize = getCheckpointSlotSize(header->mRecordCount);
+    int torn = 0;
+    for (int i = 0; i < 2; i++) {
+        struct CheckpointSlot *slot = getCheckpointSlot(header, slotSize, i);
+
+        torn |= slot->mGeneration > 0 &&
+            slot->mChecksum != getCheckpointChecksum(slot, header->mRecordCount);
+    }
+    munmap(header, st.st_size);
+
+    return torn;
+}
+
+int main(int argc, char *argv[]) {
+    char path[64];
+    uint64_t lastTick = 0;
+    int tornCount = 0;
+
+    snprintf(path, sizeof(path), "/tmp/network_diagnosis_checkpoint_test.%d", (int) getpid());
+    unlink(path);
+    srand(getpid());
+
+    for (int restart = 0; restart < CHECKPOINT_TEST_RESTARTS; restart++) {
+        int fds[2];
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            runCheckpointWriter(path, restart % 2, fds[1]);
+        }
+        close(fds[1]);
+
+        uint64_t tick;
+        int ok = read(fds[0], &tick, sizeof(tick)) == sizeof(tick);
+        close(fds[0]);
+        if (ok && tick < lastTick) {
+            fprintf(stderr, "Restored tick %llu after %llu\n",
+                    (unsigned long long) tick, (unsigned long long) lastTick);
+            ok = 0;
+        }
+        if (!ok) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            unlink(path);
+            fprintf(stderr, "FAIL\n");
+            exit(1);
+        }
+        lastTick = tick;
+
+        // Let it write a few checkpoints, then kill it wherever it is.
+        usleep(5000 + rand() % 20000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        tornCount += isCheckpointTorn(path);
+    }
+
+    unlink(path);
+    printf("%d restarts, %d with a torn slot, last restored tick %llu\n",
+            CHECKPOINT_TEST_RESTARTS, tornCount, (unsigned long long) lastTick);
+    if (lastTick == 0) {
+        fprintf(stderr, "FAIL\n");
+        exit(1);
+    }
+    printf("PASS\n");
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the routines that run every tick, printing the time and
+// number of heap allocations per operation. Run with "make bench" before and
+// after changing any of them. The routines are the ones in network_diagnosis.c
+// itself, which we include with its main() renamed.
+
+#define main networkDiagnosisMain
+#include "network_diagnosis.c"
+#undef main
+
+// Minimum time to run each benchmark, in seconds.
+#define BENCH_MIN_TIME 0.2
+
+// Number of heap allocations so far. With glibc we count them by replacing
+// malloc() and friends with wrappers around its own; elsewhere we can't.
+static uint64_t ALLOCATION_COUNT = 0;
+#if __GLIBC__
+#  define COUNTING_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    ALLOCATION_COUNT++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    ALLOCATION_COUNT++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) {
+    ALLOCATION_COUNT++;
+    return __libc_realloc(p, size);
+}
+#else
+#  define COUNTING_ALLOCATIONS 0
+#endif
+
+// Keeps results from being optimized away.
+static volatile uintptr_t SINK;
+
+// Operation to benchmark, run "count" times on "data".
+typedef void (*BenchOperation)(void *data, int64_t count);
+
+// Print one benchmark's results.
+void printBenchResult(char const *name, double seconds, uint64_t allocations, int64_t count) {
+    printf("%-40s %12.1f ns/op", name, seconds*1e9/count);
+    if (COUNTING_ALLOCATIONS) {
+        printf(" %10.2f allocs/op", (double) allocations/count);
+    }
+    printf("\n");
+}
+
+// Run "operation" in doubling batches until a batch takes at least
+// BENCH_MIN_TIME, and print the rate of that batch.
+void runBenchmark(char const *name, BenchOperation operation, void *data) {
+    int64_t count = 1;
+
+    while (1) {
+        uint64_t allocations = ALLOCATION_COUNT;
+        double start = getMonotonicTime();
+        operation(data, count);
+        double seconds = getMonotonicTime() - start;
+        allocations = ALLOCATION_COUNT - allocations;
+
+        if (seconds >= BENCH_MIN_TIME) {
+            printBenchResult(name, seconds, allocations, count);
+            return;
+        }
+        count *= 2;
+    }
+}
+
+// Add "length" ticks of results to a history, mostly successes with some
+// failures and waits, like that of a flaky target.
+void fillHistory(struct History *history, int length) {
+    for (int i = 0; i < length; i++) {
+        addToHistory(history, i % 17 == 0 ? FAIL_CHAR : i % 23 == 0 ? WAITING_CHAR : SUCCESS_CHAR);
+    }
+}
+
+// Make "count" tests with "historyLength" ticks of results each. They're DNS
+// tests so that initializeTests() doesn't open sockets.
+struct Test *makeTests(int count, int historyLength) {
+    struct Test *tests = (struct Test *) calloc(count, sizeof(struct Test));
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        test->mTestType = DNS;
+        asprintf(&test->mAddress, "10.%d.%d.%d", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+        test->mGroupIndex = -1;
+    }
+    initializeTests(tests, count);
+    for (int i = 0; i < count; i++) {
+        fillHistory(&tests[i].mResults, historyLength);
+    }
+
+    return tests;
+}
+
+void benchAddToHistory(void *data, int64_t count) {
+    struct History *history = (struct History *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        addToHistory(history, SUCCESS_CHAR);
+    }
+}
+
+// Gets a row of the history, as displayTests() does.
+void benchGetHistoryString(void *data, int64_t count) {
+    struct History *history = (struct History *) data;
+    char row[TERMINAL_WIDTH + 1];
+
+    for (int64_t i = 0; i < count; i++) {
+        SINK += (uintptr_t) getHistoryString(history, row, TERMINAL_WIDTH)[0];
+    }
+}
+
+// The per-test work of a tick that checkResults() does for "mCount" tests
+// with full histories, without any children to reap.
+struct TickTests {
+    struct Test *mTests;
+    int mCount;
+};
+
+void benchCheckResultsTick(void *data, int64_t count) {
+    struct TickTests *tick = (struct TickTests *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        checkResults(tick->mTests, tick->mCount);
+    }
+}
+
+// A table to draw into a memory stream, as the renderer does.
+struct TableSink {
+    FILE *mOut;
+    char *mData;
+    size_t mSize;
+    struct Test *mTests;
+    int mCount;
+    int mMaxWidth;
+    char *mRow;
+};
+
+void benchDisplayTests(void *data, int64_t count) {
+    struct TableSink *sink = (struct TableSink *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        rewind(sink->mOut);
+        displayTests(sink->mOut, sink->mTests, sink->mCount, sink->mMaxWidth);
+        fflush(sink->mOut);
+    }
+}
+
+// Draw every row's latency history "mMaxWidth" ticks wide, as -L does.
+void benchPrintRttHistory(void *data, int64_t count) {
+    struct TableSink *sink = (struct TableSink *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        rewind(sink->mOut);
+        for (int t = 0; t < sink->mCount; t++) {
+            printRttHistory(sink->mOut, &sink->mTests[t], sink->mMaxWidth);
+        }
+        fflush(sink->mOut);
+    }
+}
+
+void benchPrintColoredString(void *data, int64_t count) {
+    struct TableSink *sink = (struct TableSink *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        rewind(sink->mOut);
+        printColoredString(sink->mOut, sink->mRow);
+        fflush(sink->mOut);
+    }
+}
+
+void benchGetMaxWidth(void *data, int64_t count) {
+    struct TableSink *sink = (struct TableSink *) data;
+
+    for (int64_t i = 0; i < count; i++) {
+        SINK += getMaxWidth(sink->mTests, sink->mCount);
+    }
+}
+
+// Time checkResults() reaping "children" exited children, one per test, over
+// enough rounds for about 5,000 children in all. Forking and waiting for the
+// children to exit isn't timed.
+void benchCheckResults(int children) {
+    struct Test *tests = makeTests(children, 0);
+    int rounds = 5000/children > 0 ? 5000/children : 1;
+    double seconds = 0;
+    uint64_t allocations = 0;
+
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < children; i++) {
+            struct Test *test = &tests[i];
+
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                exit(1);
+            }
+            if (pid == 0) {
+                _exit(0);
+            }
+            test->mPid = pid;
+            test->mFailureExitCode = 1;
+            test->mSendTime = getMonotonicTime();
+        }
+
+        // Wait for all of them to exit without reaping them.
+        for (int i = 0; i < children; i++) {
+            siginfo_t info;
+
+            if (waitid(P_PID, tests[i].mPid, &info, WEXITED | WNOWAIT) == -1) {
+                perror("waitid");
+                exit(1);
+            }
+        }
+
+        uint64_t startAllocations = ALLOCATION_COUNT;
+        double start = getMonotonicTime();
+        checkResults(tests, children);
+        seconds += getMonotonicTime() - start;
+        allocations += ALLOCATION_COUNT - startAllocations;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "checkResults (%d children)", children);
+    printBenchResult(name, seconds, allocations, rounds);
+    snprintf(name, sizeof(name), "checkResults (%d children) per child", children);
+    printBenchResult(name, seconds, allocations, (int64_t) rounds*children);
+}
+
+int main(int argc, char *argv[]) {
+    // A minute of history, and more than is kept, so that a row wraps around
+    // the end of the ring.
+    static int const HISTORY_LENGTHS[] = { 60, RESULTS_HISTORY + TERMINAL_WIDTH/2 };
+    char name[64];
+
+    for (int i = 0; i < sizeof(HISTORY_LENGTHS)/sizeof(HISTORY_LENGTHS[0]); i++) {
+        int length = HISTORY_LENGTHS[i];
+        struct History history;
+
+        startHistory(&history);
+        fillHistory(&history, length);
+        snprintf(name, sizeof(name), "getHistoryString (%d ticks)", length);
+        runBenchmark(name, benchGetHistoryString, &history);
+        free(history.mData);
+    }
+
+    struct History history;
+    startHistory(&history);
+    runBenchmark("addToHistory", benchAddToHistory, &history);
+    free(history.mData);
+
+    struct TickTests tick;
+    tick.mCount = 1000;
+    tick.mTests = makeTests(tick.mCount, RESULTS_HISTORY);
+    runBenchmark("checkResults (1000 full histories)", benchCheckResultsTick, &tick);
+
+    for (int children = 10; children <= 1000; children *= 10) {
+        benchCheckResults(children);
+    }
+
+    struct TableSink sink;
+    sink.mOut = open_memstream(&sink.mData, &sink.mSize);
+    sink.mCount = 100;
+    sink.mTests = makeTests(sink.mCount, 3600);
+    sink.mMaxWidth = getMaxWidth(sink.mTests, sink.mCount);
+    char row[TERMINAL_WIDTH + 1];
+    sink.mRow = getHistoryString(&sink.mTests[0].mResults, row, TERMINAL_WIDTH - sink.mMaxWidth);
+    runBenchmark("printColoredString (one row)", benchPrintColoredString, &sink);
+    runBenchmark("displayTests (100 rows)", benchDisplayTests, &sink);
+    runBenchmark("getMaxWidth (100 tests)", benchGetMaxWidth, &sink);
+
+    // A frame of -L spark: 1,000 rows of 200 ticks, with round-trip times all
+    // over the histogram and some failures, so the color changes often.
+    struct TableSink latency;
+    latency.mOut = open_memstream(&latency.mData, &latency.mSize);
+    latency.mCount = 1000;
+    latency.mTests = makeTests(latency.mCount, 0);
+    startLatencyView(LATENCY_SPARK, latency.mTests, latency.mCount);
+    for (int i = 0; i < latency.mCount; i++) {
+        struct Test *test = &latency.mTests[i];
+
+        for (int t = 0; t < RTT_HISTORY; t++) {
+            test->mRttHistory[t] = (i + t) % 19 == 0 ? RTT_CODE_FAILED :
+                RTT_CODE_BUCKET + (i*7 + t*t) % (RTT_BUCKET_COUNT + 1);
+        }
+        test->mRttTickCount = RTT_HISTORY;
+    }
+    latency.mMaxWidth = 200;
+    runBenchmark("printRttHistory (1000 rows x 200 ticks)", benchPrintRttHistory, &latency);
+    latency.mMaxWidth = getMaxWidth(latency.mTests, latency.mCount);
+    runBenchmark("displayTests -L spark (1000 rows)", benchDisplayTests, &latency);
+
+    return 0;
+}
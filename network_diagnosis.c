@@ -16,21 +16,258 @@
 // Performs various network tests in parallel to see what might be going wrong with
 // the network.
 
+// For vasprintf().
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <dirent.h>
+#include <zlib.h>
+#if __linux__
+#  include <ifaddrs.h>
+#  include <linux/errqueue.h>
+#  include <sys/epoll.h>
+#endif
+
+#include "results_shm.h"
+
+// USDT tracepoints for bpftrace, perf, and SystemTap (see bpftrace/). Each is a
+// single nop in the binary after its arguments are computed, and without
+// <sys/sdt.h> (or with -DNO_USDT) they compile to nothing and their arguments
+// are never evaluated, so a clock read only for a tracepoint goes in its
+// arguments as TRACE_NOW(). Test ids are indices into TESTS and times are
+// monotonic nanoseconds:
+//
+//     probe_send(id, time)            native probe sent
+//     probe_reply(id, time, rtt)      native probe answered
+//     probe_timeout(id, time)         native probe given up on
+//     spawn(id, time, pid, forkTime)  check program started
+//     reap(id, time, pid, status)     check program finished
+//     result(id, time, char)          result of the tick recorded
+//     frame(time, bytes, drawTime)    table drawn
+#if !defined(NO_USDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#  endif
+#endif
+#ifdef STAP_PROBE4
+#  define TRACE2(name, a, b) STAP_PROBE2(network_diagnosis, name, a, b)
+#  define TRACE3(name, a, b, c) STAP_PROBE3(network_diagnosis, name, a, b, c)
+#  define TRACE4(name, a, b, c, d) STAP_PROBE4(network_diagnosis, name, a, b, c, d)
+#else
+#  define TRACE_UNUSED(x) (void) (x)
+#  define TRACE2(name, a, b) \
+    do { if (0) { TRACE_UNUSED(a); TRACE_UNUSED(b); } } while (0)
+#  define TRACE3(name, a, b, c) \
+    do { if (0) { TRACE_UNUSED(a); TRACE_UNUSED(b); TRACE_UNUSED(c); } } while (0)
+#  define TRACE4(name, a, b, c, d) \
+    do { if (0) { TRACE_UNUSED(a); TRACE_UNUSED(b); TRACE_UNUSED(c); TRACE_UNUSED(d); } } while (0)
+#endif
+#define TRACE_NOW() getTraceTime(getMonotonicTime())
 
 #define MAX_ARGS 128
 #define TERMINAL_WIDTH 75
 
+// Seconds to wait for a ping reply, same as the "-W"/"-t" flag we give ping(8).
+#define PING_TIMEOUT 5
+
+// NTP server port, and seconds between the NTP epoch (1900) and the Unix epoch.
+#define NTP_PORT 123
+#define NTP_UNIX_OFFSET 2208988800u
+
+// Clock offset in seconds beyond which we flag the local clock as wrong.
+#define NTP_MAX_OFFSET 1.0
+
+// Number of ticks over which we compute packet loss.
+#define LOSS_WINDOW 60
+
+// Largest HTTP request we accept.
+#define HTTP_REQUEST_MAX 4096
+
+// Seconds an HTTP client may go without sending or receiving anything.
+#define HTTP_IDLE_TIMEOUT 10
+
+// Size of buffered output (e.g., NDJSON records).
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Longest single record we write to an output buffer.
+#define MAX_RECORD_LENGTH 1024
+
+// Number of past results of each test that we send to a new viewer.
+#define SNAPSHOT_HISTORY 256
+
+// Ticks of round-trip times kept per test for the -L row modes.
+#define RTT_HISTORY 256
+
+// How late a tick may finish before we count it as an overrun.
+#define TICK_OVERRUN_SLACK 0.01
+
+// Resolution and range (one second) of the simulated network's histogram of
+// how late replies were handled, and ticks between its reports.
+#define SIM_LATENCY_STEP 0.00001
+#define SIM_LATENCY_BUCKETS 100000
+#define SIM_REPORT_INTERVAL 10
+
+// With a virtual clock: ticks between reports, and wall-clock time in
+// milliseconds since the Unix epoch at which the simulation starts
+// (2024-01-01), so that records are the same in every run.
+#define SIM_VIRTUAL_REPORT_INTERVAL 3600
+#define SIM_VIRTUAL_EPOCH 1704067200000ll
+
+// Shortest time between frames of the table (10 per second).
+#define FRAME_INTERVAL 0.1
+
+// Bytes a viewer may fall behind before we disconnect it.
+#define MAX_VIEWER_BACKLOG (4*1024*1024)
+
+// Number of past results of each test that we send to a new dashboard, and
+// the relative change in round-trip time worth telling it about.
+#define DASHBOARD_HISTORY 120
+#define DASHBOARD_RTT_CHANGE 0.1
+
+// Most buffers we hand writev() at once.
+#define EVENT_IOV_MAX 64
+
+// Largest control request we accept, and how many bytes of responses we
+// queue for a control client before we stop reading its requests.
+#define CONTROL_REQUEST_MAX 1024
+#define CONTROL_OUTPUT_MAX 65536
+
+// Most tests in the response to a query, about CONTROL_OUTPUT_MAX bytes.
+#define CONTROL_QUERY_MAX 1000
+
+// Number of queries the "bench" control command makes.
+#define CONTROL_BENCH_QUERIES 10000
+
+// Version of the agent-to-collector protocol.
+#define AGENT_PROTOCOL_VERSION 3
+
+// Ticks of results an agent keeps for the collector while disconnected
+// (an hour), and seconds between its attempts to reconnect.
+#define AGENT_MAX_PENDING 3600
+#define AGENT_RECONNECT_DELAY 5
+
+// Largest message we accept from an agent.
+#define AGENT_MESSAGE_MAX (1024*1024)
+
+// Shards of the collector's store, and the number and size of chunks of
+// records each can have (so up to 64M records).
+#define STORE_SHARD_COUNT 64
+#define STORE_MAX_CHUNKS 256
+#define STORE_CHUNK_SIZE 4096
+
+// Seconds between throughput reports of a collector without a terminal.
+#define COLLECTOR_REPORT_INTERVAL 10
+
+// Batches a simulated agent of the load generator can have waiting for
+// acknowledgement. It skips sending when it has this many.
+#define LOAD_MAX_OUTSTANDING 1024
+
+// Bytes buffered for each log being merged, which also limits the length of
+// a record we can merge.
+#define MERGE_BUFFER_SIZE 32768
+
+// Size of the blocks of records handed to the disk writer, the number that
+// can wait for it, and seconds between its fdatasync() calls.
+#define WRITER_BLOCK_SIZE (4*OUTPUT_BUFFER_SIZE)
+#define WRITER_QUEUE_LENGTH 16
+#define WRITER_SYNC_INTERVAL 5
+
+// Uncompressed bytes in each gzip member of a compressed log segment, so a
+// reader can start at any member.
+#define SEGMENT_FRAME_SIZE (1024*1024)
+
+// "NDCK", and the version of the checkpoint file's layout.
+#define CHECKPOINT_MAGIC 0x4E44434B
+#define CHECKPOINT_VERSION 3
+
+// Results of each test kept across restarts, and ticks between checkpoints.
+#define CHECKPOINT_HISTORY 1024
+#define CHECKPOINT_INTERVAL 10
+
+// Most results kept in a history (e.g., a test's mResults), as many as
+// anything looks at.
+#define RESULTS_HISTORY CHECKPOINT_HISTORY
+
+// The last RESULTS_HISTORY result characters of a test or group, in a ring
+// allocated once, so that adding a tick's result doesn't allocate or copy.
+struct History {
+    char *mData;
+
+    // Characters ever added. The latest is at (mCount - 1) % RESULTS_HISTORY.
+    uint64_t mCount;
+};
+
 // What kind of test this is.
 enum TestType {
     PING,
     DNS,
+    NTP,
+
+    // Answered by the simulated network (-N).
+    SIMULATED,
+};
+
+// Upper bounds in seconds of the round-trip time histogram buckets. There's
+// an implicit +Inf bucket at the end.
+static double const RTT_BUCKETS[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+};
+#define RTT_BUCKET_COUNT ((int) (sizeof(RTT_BUCKETS)/sizeof(RTT_BUCKETS[0])))
+
+// What the tick of a test came to in its mRttHistory: nothing, a failure, or
+// a reply whose round-trip time fell in histogram bucket (code -
+// RTT_CODE_BUCKET), with RTT_BUCKET_COUNT for +Inf.
+enum RttCode {
+    RTT_CODE_NONE,
+    RTT_CODE_FAILED,
+    RTT_CODE_BUCKET,
+};
+#define RTT_CODE_COUNT (RTT_CODE_BUCKET + RTT_BUCKET_COUNT + 1)
+
+// How rows show round-trip times with -L.
+enum LatencyView {
+    LATENCY_NONE,
+    LATENCY_SPARK,
+    LATENCY_HEAT,
+};
+
+// Metric families we export, each serialized separately for each test
+// because OpenMetrics wants all samples of a family together.
+enum MetricFamily {
+    METRIC_UP,
+    METRIC_PROBES,
+    METRIC_LOSS,
+    METRIC_RTT,
+    METRIC_FAMILY_COUNT,
 };
 
 // Information about each test.
@@ -38,304 +275,8573 @@ struct Test {
     // Type of test.
     enum TestType mTestType;
 
-    // IP address of ping target or DNS server.
+    // IP address of ping target, DNS server, or NTP server.
     char *mAddress;
 
+    // Group the test is shown in (tests of a group must be adjacent), or NULL.
+    char const *mGroup;
+
     // PID of spawned task, or 0 if not currently spawned.
     pid_t mPid;
 
     // Exit code that indicates failure to perform network test.
     int mFailureExitCode;
 
-    // String displaying test history.
-    char *mResults;
+    // Result characters of the ticks so far.
+    struct History mResults;
+
+    // Socket for native pings and NTP queries, or -1 if we spawn a program instead.
+    int mSocket;
+
+    // Whether "mSocket" is a raw socket (replies include the IP header).
+    int mRawSocket;
+
+    // Where "mSocket" sends to.
+    struct sockaddr_in mSocketAddress;
+
+    // ICMP identifier and sequence number of the outstanding echo request.
+    uint16_t mIdentifier;
+    uint16_t mSequence;
+
+    // NTP transmit timestamp of the outstanding query, to match the reply.
+    uint64_t mNtpTransmit;
+
+    // Round-trip delay and clock offset (server minus local) in seconds from
+    // the most recent NTP reply.
+    double mNtpDelay;
+    double mNtpOffset;
+    int mHaveNtpResult;
+
+    // Whether a native probe is outstanding, and when it was sent (or the
+    // program was spawned).
+    int mInFlight;
+    double mSendTime;
+
+    // Whether we've been asked to stop probing this test.
+    int mPaused;
+
+    // Result recorded during this tick, or 0 if none yet, and when it came in.
+    char mPendingResult;
+    double mResultTime;
+
+    // Number of probes that got a reply and that failed, since startup.
+    uint64_t mSuccessCount;
+    uint64_t mFailureCount;
+
+    // Round-trip times of replies, non-cumulative per bucket of RTT_BUCKETS
+    // (spawned programs are only reaped once per tick, so theirs are coarse).
+    uint64_t mRttBuckets[RTT_BUCKET_COUNT];
+    double mRttSum;
+
+    // Round-trip time of the most recent reply.
+    double mLastRtt;
+
+    // Replies and failures among the last LOSS_WINDOW ticks, and how many of
+    // those replies fell in each bucket of RTT_BUCKETS (RTT_BUCKET_COUNT for
+    // +Inf).
+    int mWindowSuccesses;
+    int mWindowFailures;
+    int mWindowRttCounts[RTT_BUCKET_COUNT + 1];
+
+    // Bucket of the reply of each of the last LOSS_WINDOW ticks, or -1 for
+    // none, oldest at mWindowPosition.
+    int8_t mWindowRttBuckets[LOSS_WINDOW];
+    int mWindowPosition;
+
+    // Ticks since the first failure after the last reply, or 0 if the last
+    // result was a reply.
+    int mOutageTicks;
+
+    // Pre-serialized OpenMetrics samples, one string per metric family.
+    char *mMetrics[METRIC_FAMILY_COUNT];
+
+    // Router that reported the most recent ICMP error, or empty.
+    char mErrorFrom[INET_ADDRSTRLEN];
+
+    // Result, packet loss percentage and round-trip time last sent to the
+    // dashboards, to send only what changed.
+    char mSentResult;
+    int mSentLoss;
+    double mSentRtt;
+
+    // Index of the test's group in GROUPS, and the histogram bucket of its
+    // most recent round-trip time, or -1 if it has none or is failing.
+    int mGroupIndex;
+    int mRttBucket;
+
+    // For the -L row modes, one RttCode per tick for the last RTT_HISTORY
+    // ticks (tick "t" is at t % RTT_HISTORY), or NULL.
+    uint8_t *mRttHistory;
+    uint64_t mRttTickCount;
 };
 
-// List of tests to perform.
-static struct Test TESTS[] = {
+// List of tests to perform, and the group each is shown in with -g.
+static struct Test DEFAULT_TESTS[] = {
     // Broadcast to see if anyone can reply.
-    { PING, "192.168.1.0" },
+    { PING, "192.168.1.0", "Broadcast" },
 
     // Our own router:
-    { PING, "192.168.1.1" },
+    { PING, "192.168.1.1", "Home router" },
 
     // DNS from Comcast:
-    { PING, "75.75.75.75" },
-    { PING, "75.75.76.76" },
+    { PING, "75.75.75.75", "Comcast" },
+    { PING, "75.75.76.76", "Comcast" },
 
     // DNS from Sonic:
-    { PING, "50.0.1.1" },
-    { PING, "50.0.2.2" },
+    { PING, "50.0.1.1", "Sonic" },
+    { PING, "50.0.2.2", "Sonic" },
 
     // DNS from Google:
-    { PING, "8.8.8.8" },
-    { PING, "8.8.4.4" },
+    { PING, "8.8.8.8", "Google" },
+    { PING, "8.8.4.4", "Google" },
 
     // Plunk:
-    { PING, "209.123.234.146" },
+    { PING, "209.123.234.146", "Plunk" },
 
     // Hitch:
-    { PING, "23.239.4.235" },
+    { PING, "23.239.4.235", "Hitch" },
+
+    // Time servers, since a wrong clock breaks TLS:
+    { NTP, "216.239.35.0", "Time servers" }, // time.google.com
+    { NTP, "162.159.200.1", "Time servers" }, // time.cloudflare.com
 
     // Various DNS lookups using explicit servers.
-    // { DNS, "75.75.75.75" }, // Comcast
-    // { DNS, "75.75.76.76" },
-    { DNS, "50.0.1.1" }, // Sonic
-    { DNS, "50.0.2.2" },
-    { DNS, "8.8.8.8" }, // Google
-    { DNS, "8.8.4.4" },
-    { DNS, "192.168.1.1" }, // Home router
+    // { DNS, "75.75.75.75", "DNS lookups" }, // Comcast
+    // { DNS, "75.75.76.76", "DNS lookups" },
+    { DNS, "50.0.1.1", "DNS lookups" }, // Sonic
+    { DNS, "50.0.2.2", "DNS lookups" },
+    { DNS, "8.8.8.8", "DNS lookups" }, // Google
+    { DNS, "8.8.4.4", "DNS lookups" },
+    { DNS, "192.168.1.1", "DNS lookups" }, // Home router
 };
-static int TEST_COUNT = sizeof(TESTS)/sizeof(TESTS[0]);
+
+// Tests we're performing: DEFAULT_TESTS, or simulated ones with -N.
+static struct Test *TESTS = DEFAULT_TESTS;
+static int TEST_COUNT = sizeof(DEFAULT_TESTS)/sizeof(DEFAULT_TESTS[0]);
 
 // Various characters we display to indicate status.
 static char const SUCCESS_CHAR = '*';
 static char const FAIL_CHAR = 'X';
 static char const UNKNOWN_CHAR = '?';
 static char const WAITING_CHAR = '.';
+static char const PAUSED_CHAR = '-';
+static char const HOST_UNREACHABLE_CHAR = 'H';
+static char const NET_UNREACHABLE_CHAR = 'N';
+static char const PROHIBITED_CHAR = 'P';
+static char const TIME_EXCEEDED_CHAR = 'T';
+static char const CLOCK_OFF_CHAR = 'C';
+static char const SOME_FAILED_CHAR = '!';
+static char const NO_DATA_CHAR = ' ';
 
-// Append "more" to "*base", freeing and allocating in-place.
-void append(char **base, char more) {
-    int newLength = strlen(*base) + 1;
+// Callback for a file descriptor that the main loop watches.
+typedef void (*WatchHandler)(int fd, short revents, void *data);
 
-    char *newBase = (char *) malloc(newLength + 1);
-    strcpy(newBase, *base);
-    newBase[newLength - 1] = more;
-    newBase[newLength] = '\0';
+// A file descriptor that the main loop watches, other than the probe sockets.
+struct Watch {
+    int mFd;
+    short mEvents;
+    WatchHandler mHandler;
+    void *mData;
+};
+static struct Watch *WATCHES = NULL;
+static int WATCH_COUNT = 0;
 
-    free(*base);
-    *base = newBase;
-}
+// An HTTP connection being read from or written to.
+struct HttpClient {
+    int mFd;
 
-// Return the "width" right part of the string.
-char *rightString(char *s, int width) {
-    int start = (int) strlen(s) - width;
-    return &s[start >= 0 ? start : 0];
-}
+    // When we give up on it if nothing happens, from getMonotonicTime().
+    double mDeadline;
 
-// Get the label for the kind of test.
-char *getLabelForType(enum TestType testType) {
-    switch (testType) {
-        case PING:
-            return "Ping";
+    char mRequest[HTTP_REQUEST_MAX];
+    int mRequestLength;
 
-        case DNS:
-            return "DNS";
+    // Entire response including headers, or NULL if still reading the request.
+    char *mResponse;
+    size_t mResponseLength;
+    size_t mResponseSent;
 
-        default:
-            return "Unknown";
-    }
-}
+    // Whether it asked for the event stream, which takes over the connection.
+    int mEventStream;
+};
 
-// Get the widest label we'll have for our tests.
-int getMaxWidth(struct Test tests[], int count) {
-    int maxWidth = 0;
+// Growable buffer of bytes, used to build binary messages and to queue them
+// for a non-blocking file descriptor.
+struct SendQueue {
+    char *mData;
+    size_t mLength;
+    size_t mCapacity;
 
-    for (int i = 0; i < count; i++) {
-        struct Test *test = &tests[i];
-        char *label = getLabelForType(test->mTestType);
+    // Bytes at the start of mData already written.
+    size_t mSent;
+};
 
-        // Label and address with space in between.
-        int width = strlen(label) + 1 + strlen(test->mAddress);
-        if (width > maxWidth) {
-            maxWidth = width;
-        }
-    }
+// Cursor over a received binary message. Reading past the end sets mError
+// and returns zeros, so callers can check once at the end.
+struct MessageReader {
+    uint8_t const *mData;
+    size_t mLength;
+    size_t mOffset;
+    int mError;
+};
 
-    // Add colon and extra space.
-    maxWidth += 2;
+// Messages from the daemon to viewers. Each is framed as a 32-bit length (of
+// the type and payload) followed by the type byte and the payload.
+enum ViewerMessage {
+    // All tests and their recent history.
+    VIEWER_SNAPSHOT = 1,
 
-    return maxWidth;
-}
+    // One result character per test for the tick just finished, plus the
+    // details of the tests that finished.
+    VIEWER_TICK = 2,
+};
 
-// Spawn a program. Args are the same as execl().
-void spawnCheck(struct Test *test, int failureExitCode, ...) {
-    char *args[MAX_ARGS];
-    va_list ap;
+// Requests of the control protocol. Each is framed like viewer messages, and
+// has a pattern as its payload: a target address, a type of test ("ping",
+// "dns", "ntp"), a group ("google"), or "*" for all tests. Each gets one response, framed the same
+// way, whose type is one of enum ControlStatus.
+enum ControlRequest {
+    // Respond with the state of matching tests: a 32-bit count, then the
+    // 32-bit number of them included, the first CONTROL_QUERY_MAX at most,
+    // then for each test its type, address, latest result, whether it's
+    // paused, success and failure counts, latest round-trip time, recent loss
+    // and reporting router.
+    CONTROL_QUERY = 1,
 
-    // Extract arguments.
-    va_start(ap, failureExitCode);
-    for (int i = 0; i < MAX_ARGS; i++) {
-        args[i] = va_arg(ap, char *);
-        if (args[i] == NULL) {
-            break;
-        }
-    }
-    va_end(ap);
+    // Probe matching tests now (those that aren't already running).
+    CONTROL_PROBE = 2,
 
-    // Spawn child.
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child.
+    // Stop and restart probing matching tests.
+    CONTROL_PAUSE = 3,
+    CONTROL_RESUME = 4,
 
-        // Close all file descriptors, we don't want to see anything or have it
-        // control our tty input.
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
+    // Show only the summary of, or all members of, the groups of matching
+    // tests in the -g table.
+    CONTROL_COLLAPSE = 5,
+    CONTROL_EXPAND = 6,
+};
 
-        // Run program.
-        int result = execv(args[0], args);
-        if (result == -1) {
-            perror("execv");
-            exit(1);
-        }
-    } else {
-        // Parent.
-        test->mPid = pid;
-        test->mFailureExitCode = failureExitCode;
-    }
-}
+// Status of control responses. Responses other than to queries carry the
+// number of matching tests as a 32-bit integer.
+enum ControlStatus {
+    CONTROL_OK = 0,
+    CONTROL_NOT_FOUND = 1,
+    CONTROL_BAD_REQUEST = 2,
+};
 
-// Initialize the Test structures.
-void initializeTests(struct Test tests[], int count) {
-    for (int i = 0; i < count; i++) {
-        struct Test *test = &tests[i];
+// A connection to the control socket.
+struct ControlClient {
+    int mFd;
+    struct SendQueue mInput;
+    struct SendQueue mOutput;
+};
 
-        test->mPid = 0;
-        test->mResults = strdup("");
-    }
-}
+// Messages between agents and the collector, framed like viewer messages.
+// Integers in them are variable-length (LEB128), signed ones zigzag-encoded.
+enum AgentMessage {
+    // Agent to collector, first on each connection: protocol version, agent
+    // name, session (start time of the agent, so that the collector notices
+    // restarts), number of tests, and the type and address of each.
+    AGENT_HELLO = 1,
 
-// See if any processes have finished and record their results.
-void checkResults(struct Test tests[], int count) {
-    // Array of booleans recording which test got a result.
-    int *found = (int *) calloc(count, sizeof(int));
+    // Agent to collector, one per tick: sequence number (from 1 in each
+    // session), time of the tick in milliseconds since the Unix epoch as a
+    // difference from the previous batch on this connection (or from 0 for
+    // the first), number of results, then for each result the difference of
+    // its test index from the previous one in the batch, the result
+    // character, and for replies the round-trip time in microseconds. Tests
+    // without a result were still waiting.
+    AGENT_BATCH = 2,
 
-    while (1) {
-        // See if any children finished.
-        int status;
-        pid_t pid = wait4(-1, &status, WNOHANG, NULL);
-        if (pid == -1) {
-            if (errno == ECHILD) {
-                // No finished child processes, we're done.
-                break;
-            } else {
-                perror("wait4");
-                exit(1);
-            }
-        }
-        if (pid == 0) {
-            // No finished child processes, we're done.
-            break;
-        }
+    // Collector to agent: sequence number of the last batch it has, so the
+    // agent can forget it and all earlier ones.
+    AGENT_ACK = 3,
+};
 
-        // Sanity check.
-        if (!WIFEXITED(status)) {
-            printf("Process did not terminate normally.\n");
-            exit(1);
-        }
-        status = WEXITSTATUS(status);
+// Results of one tick that an agent hasn't heard the collector acknowledge.
+struct AgentBatch {
+    uint64_t mSequence;
+    int64_t mTime;
 
-        // Find the test that finished.
-        for (int i = 0; i < count; i++) {
-            struct Test *test = &tests[i];
+    // Everything after the time in the AGENT_BATCH message.
+    struct SendQueue mResults;
+};
 
-            if (test->mPid == pid) {
-                found[i] = 1;
-                test->mPid = 0;
+// The connection of an agent to its collector.
+struct AgentLink {
+    // Collector's addresses, resolved once at startup so that the probe loop
+    // never waits for DNS, and the one to try next.
+    struct addrinfo *mAddresses;
+    struct addrinfo *mNextAddress;
 
-                // Update results.
-                char c = status == 0 ? SUCCESS_CHAR :
-                    status == test->mFailureExitCode ? FAIL_CHAR : UNKNOWN_CHAR;
-                append(&test->mResults, c);
-                break;
-            }
-        }
-    }
+    // Name we give the collector, and start time identifying this session.
+    char *mName;
+    int64_t mSession;
 
-    // Write a dot for all the ones that didn't exit this round.
-    for (int i = 0; i < count; i++) {
-        struct Test *test = &tests[i];
+    // Socket, or -1 when disconnected, and whether it's still connecting.
+    int mFd;
+    int mConnecting;
 
-        if (!found[i]) {
-            append(&test->mResults, WAITING_CHAR);
-        }
-    }
+    // When to try connecting again if disconnected.
+    double mReconnectTime;
 
-    free(found);
-}
+    struct SendQueue mInput;
+    struct SendQueue mOutput;
 
-// Spawn new tests.
-void spawnTests(struct Test tests[], int count) {
-    for (int i = 0; i < count; i++) {
-        struct Test *test = &tests[i];
+    // Time of the last batch queued on this connection.
+    int64_t mLastSentTime;
 
-        if (test->mPid == 0) {
-            switch (test->mTestType) {
-                case PING: {
-                    spawnCheck(test,
-#if __APPLE__
-                            2,
-                            "/sbin/ping", "-n", "-c", "1", "-q", "-t", "5",
-#elif __linux__
-                            1,
-                            "/bin/ping", "-n", "-c", "1", "-q", "-W", "5",
-#else
-#  error "Unknown platform"
-#endif
-                            test->mAddress,
-                            (char *) NULL);
-                    break;
-                }
+    // Batches not yet acknowledged, oldest first.
+    struct AgentBatch *mPending;
+    int mPendingCount;
+    uint64_t mNextSequence;
 
-                case DNS:
-                    spawnCheck(test, 1,
-                            "/usr/bin/host", "-t", "a", "plunk.org", test->mAddress,
-                            (char *) NULL);
-                    break;
-            }
-        }
-    }
-}
+    // Batches we had to drop because the collector was away too long.
+    uint64_t mDroppedCount;
+};
+static struct AgentLink *AGENT_LINK = NULL;
 
-// Display a string, coloring the various characters we use.
-void printColoredString(char const *s) {
-    while (*s != '\0') {
-        if (*s == SUCCESS_CHAR) {
-            printf("\033[32m"); // Green
-        } else if (*s == FAIL_CHAR || *s == UNKNOWN_CHAR) {
-            printf("\033[31m"); // Red
-        } else if (*s == WAITING_CHAR) {
-            printf("\033[90m"); // Bright black (!)
-        } else {
-            printf("\033[0m"); // Reset
-        }
-        putchar(*s);
-        s++;
-    }
-    printf("\033[0m"); // Reset
-}
+// A test of an agent in the collector's store. Records never move once
+// created, so readers can hold on to them.
+struct StoreRecord {
+    // What readers see, protected by its sequence lock. Only the thread
+    // holding the agent's lock writes it.
+    struct ResultsShmRecord mShared;
 
-// Display all tests and their results as a table.
-void displayTests(struct Test tests[], int count, int maxWidth) {
-    for (int i = 0; i < count; i++) {
-        struct Test *test = &tests[i];
-        char *label = getLabelForType(test->mTestType);
+    // Key, for writers looking it up.
+    uint64_t mHash;
+    struct Agent *mAgent;
+    enum TestType mTestType;
+    char *mAddress;
+};
 
-        int width = printf("%s %s: ", label, test->mAddress);
-        printf("%*s", maxWidth - width, "");
-        printColoredString(rightString(test->mResults, TERMINAL_WIDTH - maxWidth));
-        putchar('\n');
-    }
-}
+// One shard of the collector's store. Writers lock the shard to look up and
+// add records. Readers walk the records without locking: they're in chunks
+// that never move, and only the first mCount of them are complete.
+struct StoreShard {
+    pthread_mutex_t mLock;
 
-// Move up "count" rows.
-void backupCursor(int count) {
-    printf("\033[%dA", count);
-}
+    // Open-addressing hash table of the records, for writers.
+    struct StoreRecord **mIndex;
+    size_t mIndexCapacity;
 
-int main() {
-    int maxWidth = getMaxWidth(TESTS, TEST_COUNT);
+    struct StoreRecord *_Atomic mChunks[STORE_MAX_CHUNKS];
+    _Atomic size_t mCount;
+};
+static struct StoreShard STORE[STORE_SHARD_COUNT];
 
-    initializeTests(TESTS, TEST_COUNT);
+// What the collector knows about an agent. Survives reconnections.
+struct Agent {
+    char *mName;
+    int64_t mSession;
 
-    while (1) {
-        displayTests(TESTS, TEST_COUNT, maxWidth);
-        spawnTests(TESTS, TEST_COUNT);
-        sleep(1);
-        checkResults(TESTS, TEST_COUNT);
-        backupCursor(TEST_COUNT);
+    // Last batch applied, to ignore the ones resent after reconnecting.
+    uint64_t mLastSequence;
+
+    // Time of the last batch applied, to leave a gap in the history for
+    // ticks the agent never sent or had to drop.
+    int64_t mLastTime;
+
+    // Serializes the agent's messages, in case the connection it had before
+    // reconnecting (maybe handled by another thread) isn't closed yet.
+    pthread_mutex_t mLock;
+
+    // Records of its tests, in the order of its hello.
+    struct StoreRecord **mRecords;
+    int mTestCount;
+};
+static struct Agent **AGENTS = NULL;
+static int AGENT_COUNT = 0;
+static pthread_mutex_t AGENTS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// A connection from an agent to the collector.
+struct AgentConnection {
+    int mFd;
+    struct SendQueue mInput;
+    struct SendQueue mOutput;
+
+    // Agent that said hello on this connection, or NULL if it hasn't yet.
+    struct Agent *mAgent;
+
+    // Time of the previous batch on this connection.
+    int64_t mLastTime;
+
+    // Whether we've asked epoll for POLLOUT.
+    int mWaitingToWrite;
+};
+
+// A result decoded from an AGENT_BATCH message.
+struct AgentResult {
+    int mIndex;
+    char mChar;
+    double mRtt;
+};
+
+// A collector thread reading from agents.
+struct IngestThread {
+    pthread_t mThread;
+    int mListenFd;
+
+    // Batches and results applied, for reporting throughput.
+    _Atomic uint64_t mBatchCount;
+    _Atomic uint64_t mResultCount;
+
+    // Batches ignored because we already had them, and batches never seen
+    // between two that we applied.
+    _Atomic uint64_t mResentCount;
+    _Atomic uint64_t mMissingCount;
+
+    // Where a batch is decoded before any of it is applied.
+    struct AgentResult *mResults;
+    int mResultCapacity;
+};
+
+// A viewer attached to the daemon.
+struct Viewer {
+    int mFd;
+    struct SendQueue mQueue;
+};
+static struct Viewer **VIEWERS = NULL;
+static int VIEWER_COUNT = 0;
+
+// Tests drawn as a table, one per row as by displayTests(), or by group.
+// With mRows, only the tests at those indices into mTests, in that order.
+struct TestTable {
+    struct Test *mTests;
+    int mCount;
+    int mMaxWidth;
+    int mGrouped;
+    int *mRows;
+};
+
+// The part of the table that fits on the terminal, scrolled with the keyboard.
+struct Viewport {
+    // First row shown, and rows (including the status line) drawn by the
+    // last frame, which the next one moves back over.
+    int mTop;
+    int mShown;
+
+    // Rows of tests the last frame had room for.
+    int mRows;
+
+    // Whether we changed the terminal's settings, and what they were.
+    int mKeyboard;
+    struct termios mSavedTermios;
+};
+static struct Viewport VIEWPORT;
+
+// Draws the table on the terminal, at most once every FRAME_INTERVAL and only
+// when something changed, without ever making the caller wait for the
+// terminal. A frame that comes due while the terminal is still taking the
+// previous one is dropped.
+struct Renderer {
+    struct Viewport *mViewport;
+    struct TestTable *mTable;
+
+    // The terminal, opened separately in non-blocking mode so that standard
+    // output, which we share with the shell, stays blocking.
+    int mFd;
+
+    // Memory stream the frame is formatted into (and the size it reports),
+    // the length of the frame, and how much of it the terminal has taken.
+    FILE *mFrame;
+    char *mFrameData;
+    size_t mFrameSize;
+    size_t mFrameLength;
+    size_t mFrameSent;
+
+    // Whether the table changed since the last frame (also set by SIGWINCH),
+    // and when the next frame may be drawn.
+    volatile sig_atomic_t mDirty;
+    double mNextFrameTime;
+
+    // Frames written, and frames dropped because the terminal was busy.
+    uint64_t mFrameCount;
+    uint64_t mDroppedCount;
+};
+static struct Renderer *RENDERER = NULL;
+
+// Cheap timings and counters of the program itself, to tell an overloaded
+// tool from a bad network. Times are in seconds from getMonotonicTime().
+struct SelfStats {
+    // Duration of the last tick (nominally a second), and ticks that ran
+    // late by more than TICK_OVERRUN_SLACK and how late in total.
+    double mTickTime;
+    uint64_t mTickCount;
+    uint64_t mOverrunCount;
+    double mOverrunTime;
+
+    // Time spent in fork() for spawned probes, and in reaping them (see
+    // checkResults()), during the last tick and in total.
+    double mSpawnTime;
+    double mTotalSpawnTime;
+    uint64_t mSpawnCount;
+    double mReapTime;
+    double mTotalReapTime;
+
+    // Time spent formatting the last frame of the table, and in total.
+    double mRenderTime;
+    double mTotalRenderTime;
+
+    // Bytes of frames written to the terminal.
+    uint64_t mTerminalBytes;
+
+    // Probes outstanding at the end of the last tick.
+    int mInFlight;
+
+    // Whether the table has a status line showing these.
+    int mShown;
+};
+static struct SelfStats SELF_STATS;
+
+// Reply of the simulated network to the probe "mSequence" of test "mIndex",
+// due at "mTime".
+struct SimReply {
+    double mTime;
+    int mIndex;
+    uint16_t mSequence;
+};
+
+// In-process network that answers SIMULATED tests (-N), for finding out how
+// many targets the loop can keep up with. Times are from getMonotonicTime().
+struct SimNetwork {
+    // Median round-trip time of the targets in seconds (each target's own
+    // median is log-normally distributed around it), and the sigma of the
+    // log-normal distribution of a target's round-trip times.
+    double mRttMedian;
+    double mRttSigma;
+
+    // Chance that a probe is lost, chance that a probe finds its target
+    // newly down, and mean length of such an outage in seconds.
+    double mLoss;
+    double mOutageRate;
+    double mOutageLength;
+
+    // Ticks to run before exiting, or 0 to run forever.
+    uint64_t mTickLimit;
+
+    // Whether time is virtual: it only passes when the loop waits, and then
+    // jumps straight to the next event. It's "mNow", counted from a start at
+    // SIM_VIRTUAL_EPOCH.
+    int mVirtualClock;
+    double mNow;
+
+    // FNV-1a hash of every tick's results, to compare runs.
+    uint64_t mDigest;
+
+    // State of the random number generator, seeded from the spec.
+    uint64_t mRandom;
+
+    // Per test, the factor of mRttMedian of its median and the end of its
+    // current outage.
+    double *mRttScales;
+    double *mOutageEnds;
+
+    // Replies on their way, a min-heap by mTime.
+    struct SimReply *mReplies;
+    int mReplyCount;
+    int mReplyCapacity;
+
+    // Since the last report: probes sent, how late we handled replies, in
+    // SIM_LATENCY_STEP buckets (the last for a second or more) and at
+    // worst, and the process's CPU time and ticks at the time.
+    uint64_t mProbeCount;
+    uint64_t mLatencyCounts[SIM_LATENCY_BUCKETS];
+    double mMaxLatency;
+    double mReportCpuTime;
+    uint64_t mReportTickCount;
+    uint64_t mReportOverrunCount;
+};
+static struct SimNetwork *SIM_NETWORK = NULL;
+
+// What to print for each RttCode: the escape sequence to switch to its color
+// (only printed when the code differs from the previous tick's) and its glyph.
+struct RttGlyph {
+    char mEscape[24];
+    char mGlyph[8];
+    int mEscapeLength;
+    int mGlyphLength;
+};
+static struct RttGlyph RTT_GLYPHS[RTT_CODE_COUNT];
+
+// Adjacent tests with the same mGroup, summarized in a row of their own. The
+// summary is kept up to date as member results come in, so drawing it doesn't
+// depend on the number of members.
+struct Group {
+    char const *mName;
+    int mFirst;
+    int mCount;
+
+    // Members that are failing (see mOutageTicks), and members by histogram
+    // bucket of their most recent round-trip time.
+    int mFailingCount;
+    int mRttCounts[RTT_BUCKET_COUNT + 1];
+
+    // Summary of each tick, like a test's mResults.
+    struct History mResults;
+
+    // Whether only the summary is shown.
+    int mCollapsed;
+};
+static struct Group *GROUPS = NULL;
+static int GROUP_COUNT = 0;
+
+// What the worst-N view ranks tests by.
+enum RankMetric {
+    RANK_LOSS,
+    RANK_RTT,
+    RANK_OUTAGE,
+};
+
+// Tests ranked worst first by a metric, in a binary max-heap that's updated
+// only where scores changed, so that each tick costs O(changed log n) and
+// finding the worst N costs O(N log N) however many tests there are.
+struct Ranking {
+    enum RankMetric mMetric;
+
+    // Test indices in heap order, where each test is in the heap, and the
+    // score of each test.
+    int *mHeap;
+    int *mPositions;
+    double *mScores;
+    int mCount;
+
+    // Heap positions still to consider while finding the worst.
+    int *mCandidates;
+
+    // Indices of the worst tests, worst first, for drawing.
+    int *mWorst;
+    int mWorstCapacity;
+    int mWorstCount;
+};
+static struct Ranking *RANKING = NULL;
+
+// Reference-counted bytes queued for several clients, so that each tick's
+// events are built once no matter how many dashboards are open.
+struct SharedBuffer {
+    int mRefCount;
+    char *mData;
+    size_t mLength;
+    size_t mCapacity;
+};
+
+// A dashboard following the Server-Sent Events stream.
+struct EventClient {
+    int mFd;
+
+    // Buffers still to send, and bytes of the first one already sent.
+    struct SharedBuffer **mPending;
+    int mPendingCount;
+    int mPendingCapacity;
+    size_t mSent;
+
+    // Total bytes still to send.
+    size_t mBacklog;
+};
+
+// HTTP clients that haven't been answered yet (or taken over by the event
+// stream).
+static struct HttpClient **HTTP_CLIENTS = NULL;
+static int HTTP_CLIENT_COUNT = 0;
+
+static struct EventClient **EVENT_CLIENTS = NULL;
+static int EVENT_CLIENT_COUNT = 0;
+
+// Snapshot for new dashboards, built at most once per tick, or NULL.
+static struct SharedBuffer *DASHBOARD_SNAPSHOT = NULL;
+static uint64_t DASHBOARD_TICK = 0;
+
+// Whether we serve metrics (-m), and so keep each test's samples serialized.
+static int SERVING_METRICS = 0;
+
+// When to start a new log file, and how many old ones to keep.
+struct Rotation {
+    // Bytes and seconds, 0 for no limit.
+    int64_t mMaxSize;
+    double mMaxAge;
+
+    // Compressed segments to keep, 0 for all.
+    int mKeep;
+};
+
+// Records on their way to disk.
+struct WriterBlock {
+    int mLength;
+    int mRecordCount;
+    char mData[WRITER_BLOCK_SIZE];
+};
+
+// A thread writing an output's records to disk, so that a slow disk can't
+// stall the probes. The probe loop fills blocks and queues them, and the
+// thread writes all queued blocks at once and syncs every
+// WRITER_SYNC_INTERVAL seconds.
+struct DiskWriter {
+    int mFd;
+
+    // Whether the probe loop waits when the queue is full, rather than
+    // dropping the oldest block.
+    int mBlockWhenFull;
+
+    pthread_t mThread;
+
+    // Queue of full blocks. Only the probe loop adds (at mTail), and both the
+    // thread (to write it) and the probe loop (to drop it) take the oldest
+    // block by advancing mHead with compare-and-swap.
+    struct WriterBlock *_Atomic mQueue[WRITER_QUEUE_LENGTH];
+    _Atomic uint32_t mHead;
+    _Atomic uint32_t mTail;
+
+    // Written blocks on their way back to the probe loop. Only the thread
+    // adds and only the probe loop takes.
+    struct WriterBlock *_Atomic mFree[WRITER_QUEUE_LENGTH + 1];
+    _Atomic uint32_t mFreeHead;
+    _Atomic uint32_t mFreeTail;
+
+    // Owned by the probe loop: the block being filled, one taken back from
+    // the queue by dropping it, and the number of blocks allocated.
+    struct WriterBlock *mPending;
+    struct WriterBlock *mSpare;
+    int mBlockCount;
+
+    // Only for waking the thread when it has nothing to do.
+    pthread_mutex_t mLock;
+    pthread_cond_t mWakeUp;
+    _Atomic int mIdle;
+
+    // Rotation of the file at mPath, if mRotating. Closed segments wait in
+    // mSegments for the compression thread.
+    int mRotating;
+    struct Rotation mRotation;
+    char *mPath;
+    int64_t mSegmentSize;
+    double mSegmentStart;
+    pthread_t mCompressor;
+    pthread_mutex_t mSegmentLock;
+    pthread_cond_t mSegmentReady;
+    char **mSegments;
+    int mSegmentCount;
+
+    // Statistics, for the metrics.
+    _Atomic uint64_t mWrittenRecords;
+    _Atomic uint64_t mDroppedRecords;
+    _Atomic uint64_t mSyncCount;
+    _Atomic uint64_t mStallMicroseconds;
+};
+
+// Buffered output to a file descriptor. Formatting into it never allocates.
+struct OutputBuffer {
+    int mFd;
+    int mLength;
+
+    // Records in mData, and the thread to hand them to instead of writing
+    // them ourselves, if any.
+    int mRecordCount;
+    struct DiskWriter *mWriter;
+
+    char mData[OUTPUT_BUFFER_SIZE];
+};
+
+// Where to write NDJSON result records, or NULL to not write them.
+static struct OutputBuffer *RESULTS_OUTPUT = NULL;
+
+// Shared memory segment we publish results in, or NULL if not publishing.
+static struct ResultsShmHeader *RESULTS_SHM = NULL;
+
+// Name of that segment, to remove it when we exit.
+static char const *RESULTS_SHM_NAME = NULL;
+
+// State of a test in the checkpoint file.
+struct CheckpointRecord {
+    // Identity of the test, to match it after a restart.
+    uint8_t mType;
+    char mAddress[48];
+
+    uint8_t mPaused;
+    uint64_t mSuccessCount;
+    uint64_t mFailureCount;
+    uint64_t mRttBuckets[RTT_BUCKET_COUNT];
+    double mRttSum;
+    double mLastRtt;
+    int32_t mWindowSuccesses;
+    int32_t mWindowFailures;
+    int32_t mOutageTicks;
+    int8_t mWindowRttBuckets[LOSS_WINDOW];
+    int32_t mWindowPosition;
+
+    // Most recent results, oldest first.
+    uint32_t mHistoryLength;
+    char mHistory[CHECKPOINT_HISTORY];
+};
+
+// A complete checkpoint. It's only valid if the checksum (CRC-32 of
+// everything after it) matches, so a checkpoint torn by a crash is ignored.
+struct CheckpointSlot {
+    uint32_t mChecksum;
+    uint32_t mRecordCount;
+    uint64_t mGeneration;
+    int64_t mTime;
+    struct CheckpointRecord mRecords[];
+};
+
+// Start of the checkpoint file. Two slots follow, each at a multiple of
+// CHECKPOINT_SLOT_ALIGN, and we write the older one each time so the newer
+// one survives a crash in the middle.
+struct CheckpointHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mRecordSize;
+    uint32_t mRecordCount;
+};
+#define CHECKPOINT_SLOT_ALIGN 4096
+
+// Mapping of the checkpoint file.
+struct Checkpoint {
+    struct CheckpointHeader *mHeader;
+    size_t mSize;
+    size_t mSlotSize;
+
+    // Generation of the last checkpoint written, and its slot.
+    uint64_t mGeneration;
+    int mSlot;
+};
+
+// Checkpoint file we write, or NULL if not checkpointing.
+static struct Checkpoint *CHECKPOINT = NULL;
+
+// Get the current time in seconds from an arbitrary fixed point.
+double getMonotonicTime() {
+    if (SIM_NETWORK != NULL && SIM_NETWORK->mVirtualClock) {
+        return SIM_NETWORK->mNow;
+    }
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Convert a time from getMonotonicTime() to nanoseconds for a tracepoint.
+int64_t getTraceTime(double t) {
+    return (int64_t) (t*1e9);
+}
+
+// Make an empty history.
+void startHistory(struct History *history) {
+    history->mData = (char *) malloc(RESULTS_HISTORY);
+    history->mCount = 0;
+}
+
+// Add "c" to the history, dropping the oldest beyond RESULTS_HISTORY.
+void addToHistory(struct History *history, char c) {
+    history->mData[history->mCount++ % RESULTS_HISTORY] = c;
+}
+
+// Number of characters in the history.
+int getHistoryLength(struct History *history) {
+    return history->mCount < RESULTS_HISTORY ? (int) history->mCount : RESULTS_HISTORY;
+}
+
+// The character "back" before the latest (0 for the latest), or 0 if the
+// history doesn't go back that far.
+char getHistoryChar(struct History *history, int back) {
+    return back < getHistoryLength(history) ?
+        history->mData[(history->mCount - 1 - back) % RESULTS_HISTORY] : 0;
+}
+
+// Copy the last "width" (at most) characters of the history to "dest",
+// oldest first. Returns the number copied.
+int copyHistory(struct History *history, char *dest, int width) {
+    int length = getHistoryLength(history);
+    if (width < length) {
+        length = width > 0 ? width : 0;
+    }
+
+    // The copy may wrap around the end of the ring.
+    int start = (history->mCount - length) % RESULTS_HISTORY;
+    int first = RESULTS_HISTORY - start < length ? RESULTS_HISTORY - start : length;
+    memcpy(dest, history->mData + start, first);
+    memcpy(dest + first, history->mData, length - first);
+
+    return length;
+}
+
+// The last "width" (at most) characters of the history as a string in
+// "dest", which has room for "width" + 1.
+char *getHistoryString(struct History *history, char *dest, int width) {
+    dest[copyHistory(history, dest, width)] = '\0';
+
+    return dest;
+}
+
+// Return the "width" right part of the string.
+char *rightString(char *s, int width) {
+    int start = (int) strlen(s) - width;
+    return &s[start >= 0 ? start : 0];
+}
+
+// Get the label for the kind of test.
+char *getLabelForType(enum TestType testType) {
+    switch (testType) {
+        case PING:
+            return "Ping";
+
+        case DNS:
+            return "DNS";
+
+        case NTP:
+            return "NTP";
+
+        case SIMULATED:
+            return "Sim";
+
+        default:
+            return "Unknown";
+    }
+}
+
+// Get the widest label we'll have for our tests.
+int getMaxWidth(struct Test tests[], int count) {
+    int maxWidth = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        char *label = getLabelForType(test->mTestType);
+
+        // Label and address with space in between.
+        int width = strlen(label) + 1 + strlen(test->mAddress);
+        if (width > maxWidth) {
+            maxWidth = width;
+        }
+    }
+
+    // Add colon and extra space.
+    maxWidth += 2;
+
+    return maxWidth;
+}
+
+// Spawn a program. Args are the same as execl().
+void spawnCheck(struct Test *test, int failureExitCode, ...) {
+    char *args[MAX_ARGS];
+    va_list ap;
+
+    // Extract arguments.
+    va_start(ap, failureExitCode);
+    for (int i = 0; i < MAX_ARGS; i++) {
+        args[i] = va_arg(ap, char *);
+        if (args[i] == NULL) {
+            break;
+        }
+    }
+    va_end(ap);
+
+    // Spawn child.
+    double start = getMonotonicTime();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child.
+
+        // Close all file descriptors, we don't want to see anything or have it
+        // control our tty input.
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+
+        // Run program.
+        int result = execv(args[0], args);
+        if (result == -1) {
+            perror("execv");
+            // Not exit(), which would flush the parent's stdio buffers a second time.
+            _exit(1);
+        }
+    } else {
+        // Parent.
+        test->mPid = pid;
+        test->mFailureExitCode = failureExitCode;
+        test->mSendTime = getMonotonicTime();
+        SELF_STATS.mSpawnTime += test->mSendTime - start;
+        SELF_STATS.mSpawnCount++;
+        TRACE4(spawn, (int) (test - TESTS), getTraceTime(test->mSendTime), pid,
+                getTraceTime(test->mSendTime - start));
+    }
+}
+
+// Record the result of a test for this tick. The first result wins.
+void recordResult(struct Test *test, char c) {
+    if (test->mPendingResult == 0) {
+        test->mPendingResult = c;
+        test->mResultTime = getMonotonicTime();
+    }
+}
+
+// Internet checksum (RFC 1071).
+uint16_t computeChecksum(void const *data, int length) {
+    uint8_t const *p = (uint8_t const *) data;
+    uint32_t sum = 0;
+
+    for (int i = 0; i + 1 < length; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (length % 2 == 1) {
+        sum += p[length - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return htons(~sum);
+}
+
+// Map an errno from send() or the error queue to a result character.
+char getCharForErrno(int err) {
+    switch (err) {
+        case ENETUNREACH:
+            return NET_UNREACHABLE_CHAR;
+
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+            return HOST_UNREACHABLE_CHAR;
+
+        case EACCES:
+        case EPERM:
+            return PROHIBITED_CHAR;
+
+        default:
+            return UNKNOWN_CHAR;
+    }
+}
+
+// Map an ICMP error type and code to a result character.
+char getCharForIcmpError(int type, int code) {
+    if (type == ICMP_TIME_EXCEEDED) {
+        return TIME_EXCEEDED_CHAR;
+    }
+    if (type != ICMP_DEST_UNREACH) {
+        return UNKNOWN_CHAR;
+    }
+
+    switch (code) {
+        case ICMP_NET_UNREACH:
+        case ICMP_NET_UNKNOWN:
+        case ICMP_NET_UNR_TOS:
+            return NET_UNREACHABLE_CHAR;
+
+        case ICMP_HOST_UNREACH:
+        case ICMP_HOST_UNKNOWN:
+        case ICMP_HOST_UNR_TOS:
+            return HOST_UNREACHABLE_CHAR;
+
+        case ICMP_NET_ANO:
+        case ICMP_HOST_ANO:
+        case ICMP_PKT_FILTERED:
+            return PROHIBITED_CHAR;
+
+        default:
+            return UNKNOWN_CHAR;
+    }
+}
+
+// Get the current wall-clock time in NTP format (32.32 fixed point seconds
+// since 1900).
+uint64_t getNtpTime() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ((uint64_t) (ts.tv_sec + NTP_UNIX_OFFSET) << 32) |
+        (uint64_t) (((uint64_t) ts.tv_nsec << 32)/1000000000);
+}
+
+// Convert an NTP timestamp to seconds.
+double ntpToSeconds(uint64_t t) {
+    return (t >> 32) + (t & 0xFFFFFFFF)/4294967296.0;
+}
+
+// Read a big-endian 64-bit NTP timestamp.
+uint64_t readNtpTimestamp(uint8_t const *p) {
+    uint64_t t = 0;
+
+    for (int i = 0; i < 8; i++) {
+        t = (t << 8) | p[i];
+    }
+
+    return t;
+}
+
+// Write a big-endian 64-bit NTP timestamp.
+void writeNtpTimestamp(uint8_t *p, uint64_t t) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = t & 0xFF;
+        t >>= 8;
+    }
+}
+
+#if __linux__
+// Whether "address" is a broadcast address, or the network address of a
+// subnet (which some hosts also answer for): the limited broadcast address,
+// that or the network address of one of our interfaces, or an address ending
+// in .0 or .255.
+int isBroadcastAddress(struct in_addr address) {
+    uint32_t a = ntohl(address.s_addr);
+
+    if (a == INADDR_BROADCAST || (a & 0xFF) == 0 || (a & 0xFF) == 0xFF) {
+        return 1;
+    }
+
+    struct ifaddrs *interfaces;
+    if (getifaddrs(&interfaces) == -1) {
+        return 0;
+    }
+
+    int broadcast = 0;
+    for (struct ifaddrs *i = interfaces; i != NULL && !broadcast; i = i->ifa_next) {
+        if (i->ifa_addr == NULL || i->ifa_netmask == NULL || i->ifa_addr->sa_family != AF_INET) {
+            continue;
+        }
+        uint32_t local = ntohl(((struct sockaddr_in *) i->ifa_addr)->sin_addr.s_addr);
+        uint32_t mask = ntohl(((struct sockaddr_in *) i->ifa_netmask)->sin_addr.s_addr);
+
+        broadcast = mask != 0xFFFFFFFF && (a & mask) == (local & mask) &&
+            ((a & ~mask) == 0 || (a & ~mask) == ~mask);
+    }
+    freeifaddrs(interfaces);
+
+    return broadcast;
+}
+#endif
+
+// Set up "fd" to send to the test's address on "port", in network order. Takes
+// ownership of "fd". Returns whether successful.
+int setUpProbeSocket(struct Test *test, int fd, uint16_t port) {
+#if __linux__
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = port;
+    if (inet_pton(AF_INET, test->mAddress, &addr.sin_addr) != 1) {
+        close(fd);
+        return 0;
+    }
+
+    // Broadcast addresses need permission, ignore failure.
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+    // Queue ICMP errors for us to read, including who sent them.
+    if (setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    // Only receive from the target. This fails if there's no route, but
+    // we'll find out why when we send. Replies to a broadcast come from the
+    // hosts that answer it, so then we leave the socket unconnected and tell
+    // our replies apart by ICMP identifier (the kernel does it for ping
+    // sockets) or NTP transmit timestamp alone.
+    if (!isBroadcastAddress(addr.sin_addr)) {
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    }
+
+    test->mSocket = fd;
+    test->mSocketAddress = addr;
+
+    return 1;
+#else
+    close(fd);
+    return 0;
+#endif
+}
+
+// Open a socket to ping the test's address ourselves, so that we see ICMP
+// errors as they arrive. Leaves mSocket at -1 if we can't, in which case we
+// fall back to spawning ping(8).
+void openPingSocket(struct Test *test, int index) {
+#if __linux__
+    // Unprivileged ICMP sockets if allowed by net.ipv4.ping_group_range,
+    // otherwise raw sockets if we're root.
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    test->mRawSocket = 0;
+    if (fd == -1) {
+        fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+        test->mRawSocket = 1;
+    }
+    if (fd == -1) {
+        return;
+    }
+
+    if (setUpProbeSocket(test, fd, 0)) {
+        test->mIdentifier = (getpid() + index) & 0xFFFF;
+    }
+#else
+    (void) index;
+#endif
+}
+
+// Open a UDP socket to query the test's NTP server.
+void openNtpSocket(struct Test *test) {
+#if __linux__
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    test->mRawSocket = 0;
+    setUpProbeSocket(test, fd, htons(NTP_PORT));
+#endif
+}
+
+// Send a packet on the test's socket and mark it in flight.
+void sendProbe(struct Test *test, void const *data, int length) {
+    test->mSendTime = getMonotonicTime();
+    if (sendto(test->mSocket, data, length, 0,
+                (struct sockaddr *) &test->mSocketAddress,
+                sizeof(test->mSocketAddress)) == -1) {
+
+        // Local routing knows already (e.g., no route, or prohibit route).
+        recordResult(test, getCharForErrno(errno));
+    } else {
+        test->mInFlight = 1;
+        TRACE2(probe_send, (int) (test - TESTS), getTraceTime(test->mSendTime));
+    }
+}
+
+// Trace the reply to the native probe of the test, after recordResult() so
+// that the RTT is the one we record.
+void traceReply(struct Test *test) {
+    TRACE3(probe_reply, (int) (test - TESTS), getTraceTime(test->mResultTime),
+            getTraceTime(test->mResultTime) - getTraceTime(test->mSendTime));
+}
+
+// Send an echo request on the test's socket.
+void sendPing(struct Test *test) {
+    struct icmphdr icmp;
+
+    test->mSequence++;
+
+    memset(&icmp, 0, sizeof(icmp));
+    icmp.type = ICMP_ECHO;
+    icmp.un.echo.id = htons(test->mIdentifier);
+    icmp.un.echo.sequence = htons(test->mSequence);
+    icmp.checksum = computeChecksum(&icmp, sizeof(icmp));
+
+    sendProbe(test, &icmp, sizeof(icmp));
+}
+
+// Send an SNTP (RFC 4330) client request on the test's socket.
+void sendNtpRequest(struct Test *test) {
+    uint8_t packet[48];
+
+    memset(packet, 0, sizeof(packet));
+
+    // No leap indicator, version 4, client mode.
+    packet[0] = (0 << 6) | (4 << 3) | 3;
+
+    // The server echoes our transmit timestamp back as its originate
+    // timestamp, which is how we match the reply.
+    test->mNtpTransmit = getNtpTime();
+    writeNtpTimestamp(&packet[40], test->mNtpTransmit);
+
+    sendProbe(test, packet, sizeof(packet));
+}
+
+// Whether "payload" is the outstanding request of the test, either an echo
+// request or an NTP query. Raw sockets see everyone's errors, so we must check.
+int isOutstandingRequest(struct Test *test, uint8_t const *payload, ssize_t length) {
+    if (test->mTestType == NTP) {
+        return length >= 48 && readNtpTimestamp(&payload[40]) == test->mNtpTransmit;
+    }
+
+    struct icmphdr const *icmp = (struct icmphdr const *) payload;
+    return length >= (ssize_t) sizeof(struct icmphdr) &&
+        icmp->type == ICMP_ECHO &&
+        ntohs(icmp->un.echo.sequence) == test->mSequence &&
+        (!test->mRawSocket || ntohs(icmp->un.echo.id) == test->mIdentifier);
+}
+
+// Handle a packet received on a ping socket.
+void handlePingReply(struct Test *test, uint8_t *buffer, ssize_t length) {
+    // Raw sockets include the IP header.
+    int offset = 0;
+    if (test->mRawSocket) {
+        if (length < (ssize_t) sizeof(struct iphdr)) {
+            return;
+        }
+        offset = ((struct iphdr *) buffer)->ihl*4;
+    }
+    if (length - offset < (ssize_t) sizeof(struct icmphdr)) {
+        return;
+    }
+
+    struct icmphdr *icmp = (struct icmphdr *) &buffer[offset];
+    if (icmp->type != ICMP_ECHOREPLY ||
+            ntohs(icmp->un.echo.sequence) != test->mSequence ||
+            (test->mRawSocket && ntohs(icmp->un.echo.id) != test->mIdentifier)) {
+
+        // Someone else's, or a late reply.
+        return;
+    }
+
+    test->mInFlight = 0;
+    test->mErrorFrom[0] = '\0';
+    recordResult(test, SUCCESS_CHAR);
+    traceReply(test);
+}
+
+// Handle a packet received on an NTP socket.
+void handleNtpReply(struct Test *test, uint8_t *buffer, ssize_t length) {
+    uint64_t destination = getNtpTime();
+
+    if (length < 48 || readNtpTimestamp(&buffer[24]) != test->mNtpTransmit) {
+        // Garbage, or a late reply.
+        return;
+    }
+
+    test->mInFlight = 0;
+    test->mErrorFrom[0] = '\0';
+
+    // Must be server mode, and stratum 0 is a "kiss-o'-death" refusal.
+    int mode = buffer[0] & 0x07;
+    int stratum = buffer[1];
+    if (mode != 4 || stratum == 0) {
+        recordResult(test, UNKNOWN_CHAR);
+        traceReply(test);
+        return;
+    }
+
+    // Standard on-wire calculation, relative to our transmit time to keep
+    // the precision of the doubles.
+    double t1 = 0;
+    double t2 = ntpToSeconds(readNtpTimestamp(&buffer[32]) - test->mNtpTransmit);
+    double t3 = ntpToSeconds(readNtpTimestamp(&buffer[40]) - test->mNtpTransmit);
+    double t4 = ntpToSeconds(destination - test->mNtpTransmit);
+
+    // The differences above are unsigned, so undo wrap-around for servers
+    // that are behind us.
+    if (t2 >= 2147483648.0) {
+        t2 -= 4294967296.0;
+    }
+    if (t3 >= 2147483648.0) {
+        t3 -= 4294967296.0;
+    }
+
+    test->mNtpDelay = (t4 - t1) - (t3 - t2);
+    test->mNtpOffset = ((t2 - t1) + (t3 - t4))/2;
+    test->mHaveNtpResult = 1;
+
+    recordResult(test, fabs(test->mNtpOffset) > NTP_MAX_OFFSET ? CLOCK_OFF_CHAR : SUCCESS_CHAR);
+    traceReply(test);
+}
+
+// Read replies from the test's socket.
+void readProbeReplies(struct Test *test) {
+    uint8_t buffer[1500];
+
+    while (1) {
+        ssize_t length = recv(test->mSocket, buffer, sizeof(buffer), 0);
+        if (length == -1) {
+            // Nothing left, or a pending error whose details are in the
+            // error queue.
+            break;
+        }
+
+        if (!test->mInFlight) {
+            continue;
+        }
+
+        if (test->mTestType == NTP) {
+            handleNtpReply(test, buffer, length);
+        } else {
+            handlePingReply(test, buffer, length);
+        }
+    }
+}
+
+// Read ICMP errors queued on the test's socket and classify the failure.
+void readProbeErrors(struct Test *test) {
+#if __linux__
+    while (1) {
+        uint8_t payload[576];
+        uint8_t control[512];
+        struct iovec iov = { payload, sizeof(payload) };
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t length = recvmsg(test->mSocket, &msg, MSG_ERRQUEUE);
+        if (length == -1) {
+            break;
+        }
+
+        // The payload is the request that failed.
+        if (!test->mInFlight || !isOutstandingRequest(test, payload, length)) {
+            continue;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+
+            struct sock_extended_err *ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            char c;
+            if (ee->ee_origin == SO_EE_ORIGIN_ICMP) {
+                c = getCharForIcmpError(ee->ee_type, ee->ee_code);
+
+                struct sockaddr_in *offender = (struct sockaddr_in *) SO_EE_OFFENDER(ee);
+                if (offender->sin_family == AF_INET) {
+                    inet_ntop(AF_INET, &offender->sin_addr,
+                            test->mErrorFrom, sizeof(test->mErrorFrom));
+                }
+            } else {
+                c = getCharForErrno(ee->ee_errno);
+            }
+
+            test->mInFlight = 0;
+            recordResult(test, c);
+        }
+    }
+#else
+    (void) test;
+#endif
+}
+
+// Next random number of the simulated network (splitmix64), so that a seed
+// always gives the same network.
+uint64_t getSimRandom(struct SimNetwork *network) {
+    uint64_t z = network->mRandom += 0x9E3779B97F4A7C15ull;
+
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+
+    return z ^ (z >> 31);
+}
+
+// User and system CPU time of the process so far, in seconds.
+double getCpuTime(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+// Random number in [0, 1).
+double getSimUniform(struct SimNetwork *network) {
+    return (getSimRandom(network) >> 11)*0x1.0p-53;
+}
+
+// Normally distributed random number (Box-Muller), mean 0 and sigma 1.
+double getSimNormal(struct SimNetwork *network) {
+    double u = 1 - getSimUniform(network);
+    double v = getSimUniform(network);
+
+    return sqrt(-2*log(u))*cos(2*M_PI*v);
+}
+
+// Parse "targets[,name=value...][,virtual]" for -N into "network" and
+// "*count". Returns whether it's valid.
+int parseSimulation(char const *spec, struct SimNetwork *network, int *count) {
+    int length = 0;
+    unsigned long long seed = 1;
+    double a, b;
+
+    network->mRttMedian = 0.020;
+    network->mRttSigma = 0.5;
+    network->mLoss = 0.01;
+    network->mOutageRate = 0.0001;
+    network->mOutageLength = 30;
+    network->mTickLimit = 60;
+
+    if (sscanf(spec, "%d%n", count, &length) != 1 || *count <= 0) {
+        return 0;
+    }
+    spec += length;
+
+    while (*spec == ',') {
+        spec++;
+        if (sscanf(spec, "rtt=%lf%n", &a, &length) == 1 && a > 0) {
+            network->mRttMedian = a/1000;
+        } else if (sscanf(spec, "jitter=%lf%n", &a, &length) == 1 && a >= 0) {
+            network->mRttSigma = a;
+        } else if (sscanf(spec, "loss=%lf%n", &a, &length) == 1 && a >= 0 && a <= 100) {
+            network->mLoss = a/100;
+        } else if (sscanf(spec, "outage=%lf:%lf%n", &a, &b, &length) == 2 &&
+                a >= 0 && a <= 100 && b > 0) {
+
+            network->mOutageRate = a/100;
+            network->mOutageLength = b;
+        } else if (sscanf(spec, "ticks=%lf%n", &a, &length) == 1 && a >= 0) {
+            network->mTickLimit = (uint64_t) a;
+        } else if (sscanf(spec, "seed=%llu%n", &seed, &length) == 1) {
+            // Nothing else to do.
+        } else if (strncmp(spec, "virtual", 7) == 0 && (spec[7] == ',' || spec[7] == '\0')) {
+            network->mVirtualClock = 1;
+            length = 7;
+        } else {
+            return 0;
+        }
+        spec += length;
+    }
+    network->mRandom = seed;
+    network->mDigest = 0xCBF29CE484222325ull;
+
+    return *spec == '\0';
+}
+
+// Replace TESTS with "count" SIMULATED tests on "network", in groups of 256,
+// and give each target its median round-trip time.
+void startSimulation(struct SimNetwork *network, int count) {
+    TESTS = (struct Test *) calloc(count, sizeof(struct Test));
+    TEST_COUNT = count;
+    network->mRttScales = (double *) malloc(count*sizeof(double));
+    network->mOutageEnds = (double *) calloc(count, sizeof(double));
+
+    char *group = NULL;
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &TESTS[i];
+
+        if (i % 256 == 0) {
+            asprintf(&group, "10.%d.%d.0/24", (i >> 16) & 0xFF, (i >> 8) & 0xFF);
+        }
+        test->mTestType = SIMULATED;
+        asprintf(&test->mAddress, "10.%d.%d.%d", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+        test->mGroup = group;
+        network->mRttScales[i] = exp(getSimNormal(network));
+    }
+}
+
+// Swap two replies in the heap.
+void swapSimReplies(struct SimNetwork *network, int a, int b) {
+    struct SimReply reply = network->mReplies[a];
+
+    network->mReplies[a] = network->mReplies[b];
+    network->mReplies[b] = reply;
+}
+
+// Schedule a reply to the test's outstanding probe at "time".
+void pushSimReply(struct SimNetwork *network, double time, int index, uint16_t sequence) {
+    if (network->mReplyCount == network->mReplyCapacity) {
+        network->mReplyCapacity = network->mReplyCapacity == 0 ? 1024 : network->mReplyCapacity*2;
+        network->mReplies = (struct SimReply *) realloc(network->mReplies,
+                network->mReplyCapacity*sizeof(struct SimReply));
+    }
+
+    int i = network->mReplyCount++;
+    network->mReplies[i].mTime = time;
+    network->mReplies[i].mIndex = index;
+    network->mReplies[i].mSequence = sequence;
+
+    while (i > 0 && network->mReplies[(i - 1)/2].mTime > network->mReplies[i].mTime) {
+        swapSimReplies(network, i, (i - 1)/2);
+        i = (i - 1)/2;
+    }
+}
+
+// Remove the earliest reply from the heap and return it.
+struct SimReply popSimReply(struct SimNetwork *network) {
+    struct SimReply reply = network->mReplies[0];
+
+    network->mReplies[0] = network->mReplies[--network->mReplyCount];
+
+    int i = 0;
+    while (1) {
+        int earliest = i;
+        for (int child = 2*i + 1; child <= 2*i + 2 && child < network->mReplyCount; child++) {
+            if (network->mReplies[child].mTime < network->mReplies[earliest].mTime) {
+                earliest = child;
+            }
+        }
+        if (earliest == i) {
+            break;
+        }
+        swapSimReplies(network, i, earliest);
+        i = earliest;
+    }
+
+    return reply;
+}
+
+// Send a probe of a SIMULATED test. The network decides now whether and when
+// it's answered; unanswered probes time out like native ones.
+void sendSimulatedProbe(struct SimNetwork *network, struct Test *test) {
+    int index = test - TESTS;
+    double now = getMonotonicTime();
+
+    test->mSendTime = now;
+    test->mSequence++;
+    test->mInFlight = 1;
+    network->mProbeCount++;
+    TRACE2(probe_send, index, getTraceTime(now));
+
+    double *outageEnd = &network->mOutageEnds[index];
+    if (now >= *outageEnd && getSimUniform(network) < network->mOutageRate) {
+        *outageEnd = now - network->mOutageLength*log(1 - getSimUniform(network));
+    }
+    if (now < *outageEnd || getSimUniform(network) < network->mLoss) {
+        return;
+    }
+
+    double rtt = network->mRttMedian*network->mRttScales[index]*
+        exp(network->mRttSigma*getSimNormal(network));
+    pushSimReply(network, now + rtt, index, test->mSequence);
+}
+
+// Hand the tests the replies that are due, noting how late we are.
+void deliverSimulatedReplies(struct SimNetwork *network, struct Test tests[], double now) {
+    while (network->mReplyCount > 0 && network->mReplies[0].mTime <= now) {
+        struct SimReply reply = popSimReply(network);
+        struct Test *test = &tests[reply.mIndex];
+
+        if (!test->mInFlight || test->mSequence != reply.mSequence) {
+            // Late reply to a probe that timed out.
+            continue;
+        }
+        test->mInFlight = 0;
+        recordResult(test, SUCCESS_CHAR);
+        traceReply(test);
+
+        double latency = now - reply.mTime;
+        int bucket = (int) (latency/SIM_LATENCY_STEP);
+        network->mLatencyCounts[bucket < SIM_LATENCY_BUCKETS ? bucket : SIM_LATENCY_BUCKETS - 1]++;
+        if (latency > network->mMaxLatency) {
+            network->mMaxLatency = latency;
+        }
+    }
+}
+
+// Initialize the Test structures.
+void initializeTests(struct Test tests[], int count) {
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        test->mPid = 0;
+        startHistory(&test->mResults);
+        test->mInFlight = 0;
+        test->mPaused = 0;
+        test->mPendingResult = 0;
+        test->mErrorFrom[0] = '\0';
+        test->mSocket = -1;
+
+        test->mHaveNtpResult = 0;
+        test->mSuccessCount = 0;
+        test->mFailureCount = 0;
+        memset(test->mRttBuckets, 0, sizeof(test->mRttBuckets));
+        test->mRttSum = 0;
+        test->mLastRtt = 0;
+        test->mWindowSuccesses = 0;
+        test->mWindowFailures = 0;
+        memset(test->mWindowRttCounts, 0, sizeof(test->mWindowRttCounts));
+        memset(test->mWindowRttBuckets, -1, sizeof(test->mWindowRttBuckets));
+        test->mWindowPosition = 0;
+        test->mOutageTicks = 0;
+        test->mRttBucket = -1;
+        test->mSentResult = 0;
+        test->mSentLoss = -1;
+        test->mSentRtt = -1;
+        for (int f = 0; f < METRIC_FAMILY_COUNT; f++) {
+            test->mMetrics[f] = NULL;
+        }
+
+        if (test->mTestType == PING) {
+            openPingSocket(test, i);
+        } else if (test->mTestType == NTP) {
+            openNtpSocket(test);
+        }
+    }
+}
+
+// Make "fd" non-blocking and not inherited by spawned programs.
+void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Find the watch for "fd", or NULL if it's not (or no longer) watched.
+struct Watch *findWatch(int fd) {
+    for (int i = 0; i < WATCH_COUNT; i++) {
+        if (WATCHES[i].mFd == fd) {
+            return &WATCHES[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Have the main loop call "handler" when "fd" has any of "events".
+void watchFd(int fd, short events, WatchHandler handler, void *data) {
+    WATCHES = (struct Watch *) realloc(WATCHES, (WATCH_COUNT + 1)*sizeof(struct Watch));
+    struct Watch *watch = &WATCHES[WATCH_COUNT++];
+
+    watch->mFd = fd;
+    watch->mEvents = events;
+    watch->mHandler = handler;
+    watch->mData = data;
+}
+
+// Change the events we're waiting for on a watched file descriptor.
+void setWatchEvents(int fd, short events) {
+    struct Watch *watch = findWatch(fd);
+
+    if (watch != NULL) {
+        watch->mEvents = events;
+    }
+}
+
+// Stop watching "fd". Does not close it.
+void unwatchFd(int fd) {
+    struct Watch *watch = findWatch(fd);
+
+    if (watch != NULL) {
+        *watch = WATCHES[--WATCH_COUNT];
+    }
+}
+
+// Wait until "deadline" (from getMonotonicTime()), recording the results of
+// native probes as soon as their reply or error arrives, and serving any
+// watched file descriptors. Returns early when a frame of the table is due.
+void waitForResults(struct Test tests[], int count, double deadline) {
+    struct pollfd *fds = (struct pollfd *) malloc((count + 1)*sizeof(struct pollfd));
+    int *indices = (int *) malloc(count*sizeof(int));
+
+    // The probe sockets come first and don't change while we wait, so only
+    // look for them once.
+    int probeFdCount = 0;
+    for (int i = 0; i < count; i++) {
+        if (tests[i].mSocket != -1) {
+            fds[probeFdCount].fd = tests[i].mSocket;
+            fds[probeFdCount].events = POLLIN;
+            indices[probeFdCount] = i;
+            probeFdCount++;
+        }
+    }
+
+    while (1) {
+        double now = getMonotonicTime();
+        if (SIM_NETWORK != NULL) {
+            deliverSimulatedReplies(SIM_NETWORK, tests, now);
+        }
+        double wakeTime = deadline;
+        if (wakeTime <= now) {
+            break;
+        }
+
+        // Wake up for the next simulated reply.
+        if (SIM_NETWORK != NULL && SIM_NETWORK->mReplyCount > 0 &&
+                SIM_NETWORK->mReplies[0].mTime < wakeTime) {
+
+            wakeTime = SIM_NETWORK->mReplies[0].mTime;
+        }
+
+        // Return in time for the caller to draw a frame that's waiting.
+        if (RENDERER != NULL && RENDERER->mDirty) {
+            if (RENDERER->mNextFrameTime <= now) {
+                break;
+            }
+            if (RENDERER->mNextFrameTime < wakeTime) {
+                wakeTime = RENDERER->mNextFrameTime;
+            }
+        }
+
+        fds = (struct pollfd *) realloc(fds,
+                (probeFdCount + WATCH_COUNT + 1)*sizeof(struct pollfd));
+
+        for (int i = 0; i < probeFdCount; i++) {
+            fds[i].revents = 0;
+        }
+        int fdCount = probeFdCount;
+        for (int i = 0; i < WATCH_COUNT; i++) {
+            fds[fdCount].fd = WATCHES[i].mFd;
+            fds[fdCount].events = WATCHES[i].mEvents;
+            fds[fdCount].revents = 0;
+            fdCount++;
+        }
+
+        // With a virtual clock nothing happens between our own events, so take
+        // what's ready now and then skip to the next event.
+        int virtualClock = SIM_NETWORK != NULL && SIM_NETWORK->mVirtualClock;
+        int ready = poll(fds, fdCount, virtualClock ? 0 : (int) ((wakeTime - now)*1000) + 1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+
+        for (int i = 0; i < fdCount && ready > 0; i++) {
+            if (fds[i].revents != 0) {
+                if (i < probeFdCount) {
+                    struct Test *test = &tests[indices[i]];
+
+                    readProbeErrors(test);
+                    readProbeReplies(test);
+                } else {
+                    // Handlers may unwatch other file descriptors.
+                    struct Watch *watch = findWatch(fds[i].fd);
+                    if (watch != NULL) {
+                        watch->mHandler(fds[i].fd, fds[i].revents, watch->mData);
+                    }
+                }
+                ready--;
+            }
+        }
+        if (virtualClock) {
+            SIM_NETWORK->mNow = wakeTime;
+        }
+    }
+
+    free(indices);
+    free(fds);
+}
+
+// Whether the result character means the target replied.
+int isSuccessChar(char c) {
+    return c == SUCCESS_CHAR || c == CLOCK_OFF_CHAR;
+}
+
+// Whether the result character means the probe failed.
+int isFailureChar(char c) {
+    return c != 0 && c != WAITING_CHAR && c != PAUSED_CHAR && c != NO_DATA_CHAR &&
+        !isSuccessChar(c);
+}
+
+// Get the name of a result character for machine-readable output.
+char const *getResultName(char c) {
+    if (c == SUCCESS_CHAR) {
+        return "success";
+    } else if (c == CLOCK_OFF_CHAR) {
+        return "clock_off";
+    } else if (c == FAIL_CHAR) {
+        return "fail";
+    } else if (c == HOST_UNREACHABLE_CHAR) {
+        return "host_unreachable";
+    } else if (c == NET_UNREACHABLE_CHAR) {
+        return "net_unreachable";
+    } else if (c == PROHIBITED_CHAR) {
+        return "prohibited";
+    } else if (c == TIME_EXCEEDED_CHAR) {
+        return "time_exceeded";
+    } else if (c == WAITING_CHAR) {
+        return "waiting";
+    } else if (c == PAUSED_CHAR) {
+        return "paused";
+    } else {
+        return "unknown";
+    }
+}
+
+// Create an output buffer writing to "path", or standard output for "-".
+struct OutputBuffer *openOutput(char const *path) {
+    struct OutputBuffer *out = (struct OutputBuffer *) malloc(sizeof(struct OutputBuffer));
+
+    if (strcmp(path, "-") == 0) {
+        out->mFd = STDOUT_FILENO;
+    } else {
+        out->mFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (out->mFd == -1) {
+            perror(path);
+            exit(1);
+        }
+    }
+    out->mLength = 0;
+    out->mRecordCount = 0;
+    out->mWriter = NULL;
+
+    return out;
+}
+
+// Write all of "data" to "fd". Returns 0, or -1 with errno set.
+int tryWriteFully(int fd, char const *data, size_t length) {
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t count = write(fd, data + written, length - written);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += count;
+    }
+
+    return 0;
+}
+
+// Write all of "data" to "fd", exiting on error.
+void writeFully(int fd, char const *data, size_t length) {
+    if (tryWriteFully(fd, data, length) == -1) {
+        perror("write");
+        exit(1);
+    }
+}
+
+// Take the oldest block off the writer's queue, or return NULL if it's empty.
+// Safe to call from both the thread and the probe loop.
+struct WriterBlock *takeQueuedBlock(struct DiskWriter *writer) {
+    uint32_t head = atomic_load(&writer->mHead);
+
+    while (head != atomic_load(&writer->mTail)) {
+        struct WriterBlock *block = atomic_load(&writer->mQueue[head % WRITER_QUEUE_LENGTH]);
+
+        // If the other side took it first, "head" gets the new head and we
+        // try again.
+        if (atomic_compare_exchange_weak(&writer->mHead, &head, head + 1)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+// Whether "name" is "base" followed by a segment's time stamp (as made by
+// rotateOutput()) and "suffix".
+int isSegmentName(char const *name, char const *base, char const *suffix) {
+    static char const PATTERN[] = ".00000000-000000.000";
+    size_t baseLength = strlen(base);
+    size_t patternLength = strlen(PATTERN);
+
+    if (strncmp(name, base, baseLength) != 0 ||
+            strlen(name) != baseLength + patternLength + strlen(suffix) ||
+            strcmp(name + baseLength + patternLength, suffix) != 0) {
+
+        return 0;
+    }
+    for (size_t i = 0; i < patternLength; i++) {
+        char c = name[baseLength + i];
+        if (PATTERN[i] == '0' ? c < '0' || c > '9' : c != PATTERN[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Split "path" into a newly-allocated directory and a pointer to its file name.
+char *splitPath(char const *path, char const **name) {
+    char const *slash = strrchr(path, '/');
+
+    *name = slash == NULL ? path : slash + 1;
+
+    return slash == NULL ? strdup(".") : strndup(path, slash - path + 1);
+}
+
+// Compare strings for qsort().
+int compareStrings(void const *a, void const *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// List the files in the directory of "path" that are its segments with
+// "suffix", oldest first. Returns the number, and full paths in "*names".
+int listSegments(char const *path, char const *suffix, char ***names) {
+    char const *base;
+    char *directory = splitPath(path, &base);
+    int count = 0;
+
+    *names = NULL;
+
+    DIR *dir = opendir(directory);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (isSegmentName(entry->d_name, base, suffix)) {
+                *names = (char **) realloc(*names, (count + 1)*sizeof(char *));
+                if (asprintf(&(*names)[count], "%s%s%s", directory,
+                            strcmp(directory, ".") == 0 ? "/" : "", entry->d_name) == -1) {
+
+                    perror("asprintf");
+                    exit(1);
+                }
+                count++;
+            }
+        }
+        closedir(dir);
+    }
+    free(directory);
+
+    // Time stamps sort in time order.
+    qsort(*names, count, sizeof(char *), compareStrings);
+
+    return count;
+}
+
+// Compress the closed segment at "path" into "path.gz" as a series of
+// gzip members of about SEGMENT_FRAME_SIZE bytes of whole records, and write
+// an index "path.gz.idx" with a line per member giving its offset in the
+// compressed file and the time of its first record. Removes the original.
+// On an error (a full disk, say) the original is left as it is, to be tried
+// again on the next start, rather than stopping the probes.
+void compressSegment(char const *path) {
+    char *gzPath;
+    char *indexPath;
+    char *tmpPath;
+    if (asprintf(&gzPath, "%s.gz", path) == -1 ||
+            asprintf(&indexPath, "%s.gz.idx", path) == -1 ||
+            asprintf(&tmpPath, "%s.gz.tmp", path) == -1) {
+
+        perror("asprintf");
+        exit(1);
+    }
+
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    int out = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *index = fopen(indexPath, "we");
+    int failed = in == -1 || out == -1 || index == NULL;
+    if (failed) {
+        perror(path);
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 more window bits for a gzip header.
+    if (!failed && deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+
+        fprintf(stderr, "deflateInit2 failed\n");
+        failed = 1;
+    }
+
+    size_t compressedSize = deflateBound(&stream, SEGMENT_FRAME_SIZE);
+    char *data = (char *) malloc(SEGMENT_FRAME_SIZE);
+    unsigned char *compressed = (unsigned char *) malloc(compressedSize);
+    size_t length = 0;
+    int64_t offset = 0;
+    int eof = 0;
+
+    while (!failed && (!eof || length > 0)) {
+        while (!eof && length < SEGMENT_FRAME_SIZE) {
+            ssize_t count = read(in, data + length, SEGMENT_FRAME_SIZE - length);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror(path);
+                failed = 1;
+                break;
+            }
+            eof = count == 0;
+            length += count;
+        }
+        if (failed || length == 0) {
+            break;
+        }
+
+        // End the member at a record boundary so a reader can start there.
+        size_t frameLength = length;
+        if (!eof) {
+            while (frameLength > 0 && data[frameLength - 1] != '\n') {
+                frameLength--;
+            }
+            if (frameLength == 0) {
+                frameLength = length;
+            }
+        }
+
+        stream.next_in = (unsigned char *) data;
+        stream.avail_in = frameLength;
+        stream.next_out = compressed;
+        stream.avail_out = compressedSize;
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            fprintf(stderr, "deflate failed\n");
+            failed = 1;
+            break;
+        }
+        size_t outLength = compressedSize - stream.avail_out;
+        if (tryWriteFully(out, (char *) compressed, outLength) == -1) {
+            perror(tmpPath);
+            failed = 1;
+            break;
+        }
+        deflateReset(&stream);
+
+        long long time = -1;
+        if (strncmp(data, "{\"t\":", 5) == 0) {
+            time = strtoll(data + 5, NULL, 10);
+        }
+        fprintf(index, "%lld %lld\n", (long long) offset, time);
+        offset += outLength;
+
+        memmove(data, data + frameLength, length - frameLength);
+        length -= frameLength;
+    }
+
+    deflateEnd(&stream);
+    free(data);
+    free(compressed);
+    if (in != -1) {
+        close(in);
+    }
+
+    // Only replace the original once everything is on disk.
+    if (!failed && fdatasync(out) == -1) {
+        perror(tmpPath);
+        failed = 1;
+    }
+    if (out != -1 && close(out) == -1 && !failed) {
+        perror(tmpPath);
+        failed = 1;
+    }
+    if (index != NULL && fclose(index) != 0 && !failed) {
+        perror(indexPath);
+        failed = 1;
+    }
+    if (!failed && rename(tmpPath, gzPath) == -1) {
+        perror(gzPath);
+        failed = 1;
+    }
+    if (failed) {
+        unlink(tmpPath);
+        unlink(indexPath);
+        fprintf(stderr, "Leaving %s uncompressed\n", path);
+    } else {
+        unlink(path);
+    }
+
+    free(gzPath);
+    free(indexPath);
+    free(tmpPath);
+}
+
+// Delete the oldest compressed segments of "path" beyond the "keep" newest.
+void applyRetention(char const *path, int keep) {
+    char **names;
+    int count = listSegments(path, ".gz", &names);
+
+    for (int i = 0; i < count; i++) {
+        if (i < count - keep) {
+            char *indexPath;
+            if (asprintf(&indexPath, "%s.idx", names[i]) == -1) {
+                perror("asprintf");
+                exit(1);
+            }
+            unlink(names[i]);
+            unlink(indexPath);
+            free(indexPath);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Compress closed segments as they come in, and delete old ones.
+void *runCompressor(void *data) {
+    struct DiskWriter *writer = (struct DiskWriter *) data;
+
+    while (1) {
+        pthread_mutex_lock(&writer->mSegmentLock);
+        while (writer->mSegmentCount == 0) {
+            pthread_cond_wait(&writer->mSegmentReady, &writer->mSegmentLock);
+        }
+        char *path = writer->mSegments[0];
+        writer->mSegmentCount--;
+        memmove(writer->mSegments, writer->mSegments + 1, writer->mSegmentCount*sizeof(char *));
+        pthread_mutex_unlock(&writer->mSegmentLock);
+
+        compressSegment(path);
+        free(path);
+
+        if (writer->mRotation.mKeep > 0) {
+            applyRetention(writer->mPath, writer->mRotation.mKeep);
+        }
+    }
+
+    return NULL;
+}
+
+// Give a closed segment to the compression thread.
+void queueSegment(struct DiskWriter *writer, char *path) {
+    pthread_mutex_lock(&writer->mSegmentLock);
+    writer->mSegments = (char **) realloc(writer->mSegments,
+            (writer->mSegmentCount + 1)*sizeof(char *));
+    writer->mSegments[writer->mSegmentCount++] = path;
+    pthread_cond_signal(&writer->mSegmentReady);
+    pthread_mutex_unlock(&writer->mSegmentLock);
+}
+
+// Close the current log file as a segment named after the time, and start a
+// new one in its place.
+void rotateOutput(struct DiskWriter *writer) {
+    struct timespec ts;
+    struct tm tm;
+    char stamp[32];
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    char *segment;
+    if (asprintf(&segment, "%s.%s.%03ld", writer->mPath, stamp, ts.tv_nsec/1000000) == -1) {
+        perror("asprintf");
+        exit(1);
+    }
+
+    // Keep the same descriptor number, the probe loop knows it.
+    int fd = -1;
+    if (rename(writer->mPath, segment) == -1 ||
+            (fd = open(writer->mPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1 ||
+            dup2(fd, writer->mFd) == -1 || fcntl(writer->mFd, F_SETFD, FD_CLOEXEC) == -1) {
+
+        perror(writer->mPath);
+        exit(1);
+    }
+    close(fd);
+
+    writer->mSegmentSize = 0;
+    writer->mSegmentStart = getMonotonicTime();
+    queueSegment(writer, segment);
+}
+
+// Whether it's time to start a new log file.
+int isRotationDue(struct DiskWriter *writer, double now) {
+    struct Rotation *rotation = &writer->mRotation;
+
+    return writer->mRotating && writer->mSegmentSize > 0 &&
+        ((rotation->mMaxSize > 0 && writer->mSegmentSize >= rotation->mMaxSize) ||
+         (rotation->mMaxAge > 0 && now - writer->mSegmentStart >= rotation->mMaxAge));
+}
+
+// Write queued blocks until told there are none, syncing the file now and then.
+void *runDiskWriter(void *data) {
+    struct DiskWriter *writer = (struct DiskWriter *) data;
+    struct WriterBlock *blocks[WRITER_QUEUE_LENGTH];
+    struct iovec iov[WRITER_QUEUE_LENGTH];
+    double lastSync = getMonotonicTime();
+    int dirty = 0;
+    int canSync = 1;
+    int failing = 0;
+
+    while (1) {
+        // Group everything that's queued into one write.
+        int count = 0;
+        while (count < WRITER_QUEUE_LENGTH &&
+                (blocks[count] = takeQueuedBlock(writer)) != NULL) {
+
+            count++;
+        }
+
+        if (count > 0) {
+            for (int i = 0; i < count; i++) {
+                iov[i].iov_base = blocks[i]->mData;
+                iov[i].iov_len = blocks[i]->mLength;
+            }
+
+            // Rarely partial on a file, so finish those the simple way. A
+            // full or failing disk mustn't stop probing, so the blocks from
+            // the one that failed on are counted as dropped, and we try
+            // again with the next ones.
+            ssize_t written = writev(writer->mFd, iov, count);
+            int failed = written == -1 && errno != EINTR;
+            for (int i = 0; i < count; i++) {
+                size_t length = iov[i].iov_len;
+                size_t done = written <= 0 ? 0 : (size_t) written < length ? written : length;
+                if (!failed) {
+                    failed = tryWriteFully(writer->mFd, blocks[i]->mData + done,
+                            length - done) == -1;
+                }
+                written -= done;
+                if (failed) {
+                    atomic_fetch_add(&writer->mDroppedRecords, blocks[i]->mRecordCount);
+                } else {
+                    atomic_fetch_add(&writer->mWrittenRecords, blocks[i]->mRecordCount);
+                    writer->mSegmentSize += length;
+                    dirty = 1;
+                }
+            }
+
+            // Only say so when it starts failing, not for every block.
+            if (failed && !failing) {
+                perror("write");
+            }
+            failing = failed;
+
+            for (int i = 0; i < count; i++) {
+                uint32_t tail = atomic_load(&writer->mFreeTail);
+                atomic_store(&writer->mFree[tail % (WRITER_QUEUE_LENGTH + 1)], blocks[i]);
+                atomic_store(&writer->mFreeTail, tail + 1);
+            }
+        }
+
+        double now = getMonotonicTime();
+        if (dirty && canSync && now - lastSync >= WRITER_SYNC_INTERVAL) {
+            if (fdatasync(writer->mFd) == 0) {
+                atomic_fetch_add(&writer->mSyncCount, 1);
+            } else if (errno == EINVAL || errno == EROFS) {
+                // Pipe or terminal.
+                canSync = 0;
+            } else {
+                // Try again at the next interval.
+                perror("fdatasync");
+            }
+            dirty = 0;
+            lastSync = now;
+        }
+
+        // The compression thread syncs the segment.
+        if (isRotationDue(writer, now)) {
+            rotateOutput(writer);
+            dirty = 0;
+        }
+
+        if (count == 0) {
+            // Sleep until there's a block or it's time to sync or rotate.
+            // Checking the queue after saying we're idle means we can't miss
+            // a wake-up.
+            double wakeUp = dirty && canSync ? lastSync + WRITER_SYNC_INTERVAL : now + 60;
+            if (writer->mRotating && writer->mRotation.mMaxAge > 0 && writer->mSegmentSize > 0 &&
+                    writer->mSegmentStart + writer->mRotation.mMaxAge < wakeUp) {
+
+                wakeUp = writer->mSegmentStart + writer->mRotation.mMaxAge;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            double seconds = deadline.tv_nsec/1e9 + (wakeUp - now);
+            deadline.tv_sec += (time_t) seconds;
+            deadline.tv_nsec = (long) ((seconds - (time_t) seconds)*1e9);
+
+            pthread_mutex_lock(&writer->mLock);
+            atomic_store(&writer->mIdle, 1);
+            if (atomic_load(&writer->mHead) == atomic_load(&writer->mTail)) {
+                pthread_cond_timedwait(&writer->mWakeUp, &writer->mLock, &deadline);
+            }
+            atomic_store(&writer->mIdle, 0);
+            pthread_mutex_unlock(&writer->mLock);
+        }
+    }
+
+    return NULL;
+}
+
+// Hand the output's writes to a new thread. If the disk can't keep up,
+// either wait for it ("blockWhenFull") or drop the oldest records. If
+// "rotation" isn't NULL, the output is the file at "path", which gets
+// rotated, compressed and pruned accordingly.
+void startDiskWriter(struct OutputBuffer *out, int blockWhenFull,
+        char const *path, struct Rotation *rotation) {
+
+    struct DiskWriter *writer = (struct DiskWriter *) calloc(1, sizeof(struct DiskWriter));
+
+    writer->mFd = out->mFd;
+    writer->mBlockWhenFull = blockWhenFull;
+    pthread_mutex_init(&writer->mLock, NULL);
+    pthread_cond_init(&writer->mWakeUp, NULL);
+
+    if (rotation != NULL) {
+        struct stat st;
+        if (fstat(out->mFd, &st) == -1) {
+            perror(path);
+            exit(1);
+        }
+
+        writer->mRotating = 1;
+        writer->mRotation = *rotation;
+        writer->mPath = strdup(path);
+        writer->mSegmentSize = st.st_size;
+        writer->mSegmentStart = getMonotonicTime();
+        pthread_mutex_init(&writer->mSegmentLock, NULL);
+        pthread_cond_init(&writer->mSegmentReady, NULL);
+
+        // Finish what a previous run didn't get to.
+        char **names;
+        int count = listSegments(path, "", &names);
+        for (int i = 0; i < count; i++) {
+            queueSegment(writer, names[i]);
+        }
+        free(names);
+
+        if (pthread_create(&writer->mCompressor, NULL, runCompressor, writer) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    if (pthread_create(&writer->mThread, NULL, runDiskWriter, writer) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    out->mWriter = writer;
+}
+
+// Get an empty block for the probe loop, or NULL if they're all queued.
+struct WriterBlock *getFreeBlock(struct DiskWriter *writer) {
+    struct WriterBlock *block = writer->mSpare;
+
+    if (block != NULL) {
+        writer->mSpare = NULL;
+    } else {
+        uint32_t head = atomic_load(&writer->mFreeHead);
+        if (head != atomic_load(&writer->mFreeTail)) {
+            block = atomic_load(&writer->mFree[head % (WRITER_QUEUE_LENGTH + 1)]);
+            atomic_store(&writer->mFreeHead, head + 1);
+        } else if (writer->mBlockCount < WRITER_QUEUE_LENGTH + 1) {
+            // Only allocated when the disk falls behind.
+            block = (struct WriterBlock *) malloc(sizeof(struct WriterBlock));
+            writer->mBlockCount++;
+        } else {
+            return NULL;
+        }
+    }
+
+    block->mLength = 0;
+    block->mRecordCount = 0;
+
+    return block;
+}
+
+// Queue the block being filled. Returns whether there was room.
+int queuePendingBlock(struct DiskWriter *writer) {
+    uint32_t tail = atomic_load(&writer->mTail);
+
+    if (tail - atomic_load(&writer->mHead) >= WRITER_QUEUE_LENGTH) {
+        return 0;
+    }
+    atomic_store(&writer->mQueue[tail % WRITER_QUEUE_LENGTH], writer->mPending);
+    atomic_store(&writer->mTail, tail + 1);
+    writer->mPending = NULL;
+
+    if (atomic_load(&writer->mIdle)) {
+        pthread_mutex_lock(&writer->mLock);
+        pthread_cond_signal(&writer->mWakeUp);
+        pthread_mutex_unlock(&writer->mLock);
+    }
+
+    return 1;
+}
+
+// Called when the queue is full or all blocks are in use: drop the oldest
+// queued block, or give the thread a millisecond to write some.
+void makeRoomInQueue(struct DiskWriter *writer) {
+    if (writer->mBlockWhenFull) {
+        struct timespec delay = { 0, 1000000 };
+        double start = getMonotonicTime();
+
+        nanosleep(&delay, NULL);
+        atomic_fetch_add(&writer->mStallMicroseconds,
+                (uint64_t) ((getMonotonicTime() - start)*1e6));
+    } else {
+        struct WriterBlock *block = takeQueuedBlock(writer);
+
+        // NULL if the thread just took them all, which also makes room.
+        if (block != NULL) {
+            atomic_fetch_add(&writer->mDroppedRecords, block->mRecordCount);
+            writer->mSpare = block;
+        }
+    }
+}
+
+// Hand the records of "out" to its writer thread. They collect in a block
+// while the thread is busy, and the block is queued when the thread is
+// waiting for work or when it's full.
+void submitOutput(struct OutputBuffer *out) {
+    struct DiskWriter *writer = out->mWriter;
+
+    if (writer->mPending != NULL &&
+            writer->mPending->mLength + out->mLength > WRITER_BLOCK_SIZE) {
+
+        while (!queuePendingBlock(writer)) {
+            makeRoomInQueue(writer);
+        }
+    }
+
+    while (writer->mPending == NULL) {
+        writer->mPending = getFreeBlock(writer);
+        if (writer->mPending == NULL) {
+            makeRoomInQueue(writer);
+        }
+    }
+
+    struct WriterBlock *block = writer->mPending;
+    memcpy(block->mData + block->mLength, out->mData, out->mLength);
+    block->mLength += out->mLength;
+    block->mRecordCount += out->mRecordCount;
+
+    if (atomic_load(&writer->mHead) == atomic_load(&writer->mTail)) {
+        // The thread is done with everything else, so it might as well
+        // start on these.
+        queuePendingBlock(writer);
+    }
+}
+
+// Write out everything buffered, or hand it to the output's writer thread.
+void flushOutput(struct OutputBuffer *out) {
+    if (out->mWriter != NULL) {
+        if (out->mLength > 0) {
+            submitOutput(out);
+        }
+        out->mLength = 0;
+        out->mRecordCount = 0;
+        return;
+    }
+
+    int written = 0;
+
+    while (written < out->mLength) {
+        ssize_t length = write(out->mFd, out->mData + written, out->mLength - written);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        written += length;
+    }
+    out->mLength = 0;
+    out->mRecordCount = 0;
+}
+
+// Make sure there's room for a record of up to MAX_RECORD_LENGTH bytes. We
+// only check once per record so that the formatting functions below don't
+// have to.
+void reserveRecord(struct OutputBuffer *out) {
+    if (out->mLength > OUTPUT_BUFFER_SIZE - MAX_RECORD_LENGTH) {
+        flushOutput(out);
+    }
+    out->mRecordCount++;
+}
+
+// Append raw bytes.
+void writeBytes(struct OutputBuffer *out, char const *data, int length) {
+    memcpy(out->mData + out->mLength, data, length);
+    out->mLength += length;
+}
+
+// Append a nul-terminated string.
+void writeString(struct OutputBuffer *out, char const *s) {
+    writeBytes(out, s, strlen(s));
+}
+
+// Append a string as a quoted JSON string, truncated to keep the record
+// within MAX_RECORD_LENGTH.
+void writeJsonString(struct OutputBuffer *out, char const *s) {
+    static char const HEX[] = "0123456789abcdef";
+    char *p = out->mData + out->mLength;
+    char *end = p + MAX_RECORD_LENGTH/4;
+
+    *p++ = '"';
+    for (; *s != '\0' && p < end; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            *p++ = '\\';
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = HEX[c >> 4];
+            *p++ = HEX[c & 0xF];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+
+    out->mLength = p - out->mData;
+}
+
+// Append a decimal integer.
+void writeInteger(struct OutputBuffer *out, int64_t n) {
+    char digits[20];
+    int count = 0;
+    uint64_t u = n < 0 ? -(uint64_t) n : (uint64_t) n;
+
+    do {
+        digits[count++] = '0' + u%10;
+        u /= 10;
+    } while (u != 0);
+
+    char *p = out->mData + out->mLength;
+    if (n < 0) {
+        *p++ = '-';
+    }
+    while (count > 0) {
+        *p++ = digits[--count];
+    }
+    out->mLength = p - out->mData;
+}
+
+// Append a number with a fixed number of decimals (at most 9).
+void writeFixed(struct OutputBuffer *out, double x, int decimals) {
+    static int64_t const SCALE[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+    };
+
+    int64_t scaled = (int64_t) (fabs(x)*SCALE[decimals] + 0.5);
+    if (x < 0 && scaled != 0) {
+        writeBytes(out, "-", 1);
+    }
+    writeInteger(out, scaled/SCALE[decimals]);
+
+    if (decimals > 0) {
+        int64_t fraction = scaled%SCALE[decimals];
+        char *p = out->mData + out->mLength;
+        *p++ = '.';
+        for (int i = decimals - 1; i >= 0; i--) {
+            p[i] = '0' + fraction%10;
+            fraction /= 10;
+        }
+        out->mLength += 1 + decimals;
+    }
+}
+
+// Get the current wall-clock time in milliseconds since the Unix epoch.
+int64_t getWallClockMs() {
+    if (SIM_NETWORK != NULL && SIM_NETWORK->mVirtualClock) {
+        return SIM_VIRTUAL_EPOCH + (int64_t) (SIM_NETWORK->mNow*1000);
+    }
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (int64_t) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Write a result of a test as an NDJSON record. "index" is the test's
+// position in the list and "resultTime" the wall-clock time of the result.
+void writeResultRecord(struct OutputBuffer *out, struct Test *test, int index,
+        char c, int64_t resultTime) {
+
+    reserveRecord(out);
+
+    writeString(out, "{\"t\":");
+    writeInteger(out, resultTime);
+    writeString(out, ",\"id\":");
+    writeInteger(out, index);
+    writeString(out, ",\"type\":");
+    writeJsonString(out, getLabelForType(test->mTestType));
+    writeString(out, ",\"target\":");
+    writeJsonString(out, test->mAddress);
+    writeString(out, ",\"result\":\"");
+    writeString(out, getResultName(c));
+    writeString(out, "\"");
+    if (isSuccessChar(c)) {
+        writeString(out, ",\"rtt\":");
+        writeFixed(out, test->mResultTime - test->mSendTime, 6);
+    }
+    if (test->mErrorFrom[0] != '\0') {
+        writeString(out, ",\"from\":");
+        writeJsonString(out, test->mErrorFrom);
+    }
+    if (test->mTestType == NTP && isSuccessChar(c)) {
+        writeString(out, ",\"offset\":");
+        writeFixed(out, test->mNtpOffset, 6);
+        writeString(out, ",\"delay\":");
+        writeFixed(out, test->mNtpDelay, 6);
+    }
+    writeString(out, "}\n");
+}
+
+// Replace "*s" with a newly-allocated formatted string.
+void formatString(char **s, char const *format, ...) {
+    va_list ap;
+
+    free(*s);
+    va_start(ap, format);
+    if (vasprintf(s, format, ap) == -1) {
+        perror("vasprintf");
+        exit(1);
+    }
+    va_end(ap);
+}
+
+// Re-serialize the test's OpenMetrics samples from its statistics.
+void serializeMetrics(struct Test *test) {
+    char *type = getLabelForType(test->mTestType);
+    char *address = test->mAddress;
+    int up = isSuccessChar(getHistoryChar(&test->mResults, 0));
+    int windowCount = test->mWindowSuccesses + test->mWindowFailures;
+
+    formatString(&test->mMetrics[METRIC_UP],
+            "network_diagnosis_up{type=\"%s\",target=\"%s\"} %d\n",
+            type, address, up);
+    formatString(&test->mMetrics[METRIC_PROBES],
+            "network_diagnosis_probes_total{type=\"%s\",target=\"%s\",result=\"success\"} %llu\n"
+            "network_diagnosis_probes_total{type=\"%s\",target=\"%s\",result=\"failure\"} %llu\n",
+            type, address, (unsigned long long) test->mSuccessCount,
+            type, address, (unsigned long long) test->mFailureCount);
+    formatString(&test->mMetrics[METRIC_LOSS],
+            "network_diagnosis_loss_ratio{type=\"%s\",target=\"%s\"} %g\n",
+            type, address, windowCount == 0 ? 0.0 :
+            (double) test->mWindowFailures/windowCount);
+
+    // Histogram buckets are cumulative.
+    char rtt[2048];
+    int length = 0;
+    uint64_t cumulative = 0;
+    for (int b = 0; b < RTT_BUCKET_COUNT; b++) {
+        cumulative += test->mRttBuckets[b];
+        length += snprintf(rtt + length, sizeof(rtt) - length,
+                "network_diagnosis_rtt_seconds_bucket{type=\"%s\",target=\"%s\",le=\"%g\"} %llu\n",
+                type, address, RTT_BUCKETS[b], (unsigned long long) cumulative);
+        if (length >= (int) sizeof(rtt)) {
+            // Truncated; don't let "length" run past the buffer.
+            length = sizeof(rtt) - 1;
+        }
+    }
+    formatString(&test->mMetrics[METRIC_RTT],
+            "%s"
+            "network_diagnosis_rtt_seconds_bucket{type=\"%s\",target=\"%s\",le=\"+Inf\"} %llu\n"
+            "network_diagnosis_rtt_seconds_count{type=\"%s\",target=\"%s\"} %llu\n"
+            "network_diagnosis_rtt_seconds_sum{type=\"%s\",target=\"%s\"} %g\n",
+            rtt,
+            type, address, (unsigned long long) test->mSuccessCount,
+            type, address, (unsigned long long) test->mSuccessCount,
+            type, address, test->mRttSum);
+}
+
+// Histogram bucket of a round-trip time, RTT_BUCKET_COUNT for +Inf.
+int getRttBucket(double rtt) {
+    int b = 0;
+
+    while (b < RTT_BUCKET_COUNT && rtt > RTT_BUCKETS[b]) {
+        b++;
+    }
+
+    return b;
+}
+
+// Move a test's contribution to its group's summary from what it was
+// ("wasFailing" and "oldBucket") to what it is now.
+void updateGroupMember(struct Test *test, int wasFailing, int oldBucket) {
+    struct Group *group = &GROUPS[test->mGroupIndex];
+
+    group->mFailingCount += (test->mOutageTicks > 0) - wasFailing;
+    if (test->mRttBucket != oldBucket) {
+        if (oldBucket != -1) {
+            group->mRttCounts[oldBucket]--;
+        }
+        if (test->mRttBucket != -1) {
+            group->mRttCounts[test->mRttBucket]++;
+        }
+    }
+}
+
+// How bad the test is by the metric, higher is worse.
+double getRankScore(struct Test *test, enum RankMetric metric) {
+    switch (metric) {
+        case RANK_LOSS: {
+            int windowCount = test->mWindowSuccesses + test->mWindowFailures;
+            return windowCount == 0 ? 0 : (double) test->mWindowFailures/windowCount;
+        }
+
+        case RANK_RTT: {
+            // Upper bound of the bucket with the 99th percentile of the
+            // replies in the window, infinite for the +Inf bucket.
+            int total = 0;
+            for (int b = 0; b <= RTT_BUCKET_COUNT; b++) {
+                total += test->mWindowRttCounts[b];
+            }
+            int cumulative = 0;
+            for (int b = 0; b <= RTT_BUCKET_COUNT; b++) {
+                cumulative += test->mWindowRttCounts[b];
+                if (cumulative > 0 && cumulative >= 0.99*total) {
+                    return b < RTT_BUCKET_COUNT ? RTT_BUCKETS[b] : INFINITY;
+                }
+            }
+            return 0;
+        }
+
+        case RANK_OUTAGE:
+            return test->mOutageTicks;
+    }
+
+    return 0;
+}
+
+// Whether the test at heap position "a" ranks worse than the one at "b".
+// Ties go to the earlier test, so the order doesn't flicker.
+int isRankedAbove(struct Ranking *ranking, int a, int b) {
+    int x = ranking->mHeap[a];
+    int y = ranking->mHeap[b];
+
+    return ranking->mScores[x] > ranking->mScores[y] ||
+        (ranking->mScores[x] == ranking->mScores[y] && x < y);
+}
+
+// Swap two positions of the heap.
+void swapRanked(struct Ranking *ranking, int a, int b) {
+    int x = ranking->mHeap[a];
+
+    ranking->mHeap[a] = ranking->mHeap[b];
+    ranking->mHeap[b] = x;
+    ranking->mPositions[ranking->mHeap[a]] = a;
+    ranking->mPositions[ranking->mHeap[b]] = b;
+}
+
+// Move the test at "position" down the heap below any worse children.
+void siftRankedDown(struct Ranking *ranking, int position) {
+    while (1) {
+        int worst = position;
+        int left = 2*position + 1;
+        int right = left + 1;
+
+        if (left < ranking->mCount && isRankedAbove(ranking, left, worst)) {
+            worst = left;
+        }
+        if (right < ranking->mCount && isRankedAbove(ranking, right, worst)) {
+            worst = right;
+        }
+        if (worst == position) {
+            break;
+        }
+        swapRanked(ranking, position, worst);
+        position = worst;
+    }
+}
+
+// Restore the heap after the score at "position" changed.
+void siftRanked(struct Ranking *ranking, int position) {
+    while (position > 0 && isRankedAbove(ranking, position, (position - 1)/2)) {
+        swapRanked(ranking, position, (position - 1)/2);
+        position = (position - 1)/2;
+    }
+
+    siftRankedDown(ranking, position);
+}
+
+// Move test "index" in the heap if its score changed.
+void updateRankScore(struct Ranking *ranking, struct Test *test, int index) {
+    double score = getRankScore(test, ranking->mMetric);
+
+    if (score != ranking->mScores[index]) {
+        ranking->mScores[index] = score;
+        siftRanked(ranking, ranking->mPositions[index]);
+    }
+}
+
+// Record the result for this tick (possibly WAITING_CHAR) in the statistics,
+// re-serializing the metrics if anything changed and we serve them, and
+// moving the test in the worst-N ranking if its score changed.
+void updateStatistics(struct Test *test, char c) {
+    int changed = test->mMetrics[0] == NULL;
+
+    int wasFailing = test->mOutageTicks > 0;
+    int oldBucket = test->mRttBucket;
+
+    if (isSuccessChar(c)) {
+        double rtt = test->mResultTime - test->mSendTime;
+        int b = getRttBucket(rtt);
+        if (b < RTT_BUCKET_COUNT) {
+            test->mRttBuckets[b]++;
+        }
+        test->mRttBucket = b;
+        test->mRttSum += rtt;
+        test->mLastRtt = rtt;
+        test->mSuccessCount++;
+        test->mWindowSuccesses++;
+        changed = 1;
+    } else if (isFailureChar(c)) {
+        test->mFailureCount++;
+        test->mWindowFailures++;
+        changed = 1;
+    }
+
+    if (isSuccessChar(c)) {
+        test->mOutageTicks = 0;
+    } else if (test->mOutageTicks > 0 || isFailureChar(c)) {
+        test->mOutageTicks++;
+
+        // Its last round-trip time no longer says anything about its group.
+        test->mRttBucket = -1;
+    }
+    if (GROUPS != NULL) {
+        updateGroupMember(test, wasFailing, oldBucket);
+    }
+
+    // Reply that just dropped out of the window, and this tick's.
+    int8_t *windowBucket = &test->mWindowRttBuckets[test->mWindowPosition];
+    if (*windowBucket != -1) {
+        test->mWindowRttCounts[*windowBucket]--;
+    }
+    *windowBucket = isSuccessChar(c) ? test->mRttBucket : -1;
+    if (*windowBucket != -1) {
+        test->mWindowRttCounts[*windowBucket]++;
+    }
+    test->mWindowPosition = (test->mWindowPosition + 1) % LOSS_WINDOW;
+
+    // Result that just dropped out of the loss window ("c" is already added).
+    char old = getHistoryChar(&test->mResults, LOSS_WINDOW);
+    if (isSuccessChar(old)) {
+        test->mWindowSuccesses--;
+        changed = 1;
+    } else if (isFailureChar(old)) {
+        test->mWindowFailures--;
+        changed = 1;
+    }
+
+    if (changed && SERVING_METRICS) {
+        serializeMetrics(test);
+    }
+    if (RANKING != NULL) {
+        updateRankScore(RANKING, test, (int) (test - TESTS));
+    }
+}
+
+// Add the tick's result "c" to the test's mRttHistory.
+void recordRttCode(struct Test *test, char c) {
+    uint8_t code = isSuccessChar(c) ? RTT_CODE_BUCKET + test->mRttBucket :
+        isFailureChar(c) ? RTT_CODE_FAILED : RTT_CODE_NONE;
+
+    test->mRttHistory[test->mRttTickCount++ % RTT_HISTORY] = code;
+}
+
+// See if any processes have finished and record their results.
+void checkResults(struct Test tests[], int count) {
+    double reapStart = getMonotonicTime();
+
+    while (1) {
+        // See if any children finished.
+        int status;
+        pid_t pid = wait4(-1, &status, WNOHANG, NULL);
+        if (pid == -1) {
+            if (errno == ECHILD) {
+                // No finished child processes, we're done.
+                break;
+            } else {
+                perror("wait4");
+                exit(1);
+            }
+        }
+        if (pid == 0) {
+            // No finished child processes, we're done.
+            break;
+        }
+
+        // Sanity check.
+        if (!WIFEXITED(status)) {
+            printf("Process did not terminate normally.\n");
+            exit(1);
+        }
+        status = WEXITSTATUS(status);
+
+        // Find the test that finished.
+        for (int i = 0; i < count; i++) {
+            struct Test *test = &tests[i];
+
+            if (test->mPid == pid) {
+                test->mPid = 0;
+                TRACE4(reap, i, TRACE_NOW(), pid, status);
+
+                // Update results.
+                char c = status == 0 ? SUCCESS_CHAR :
+                    status == test->mFailureExitCode ? FAIL_CHAR : UNKNOWN_CHAR;
+                recordResult(test, c);
+                break;
+            }
+        }
+    }
+
+    // Give up on native probes that have been waiting too long.
+    double now = getMonotonicTime();
+    SELF_STATS.mReapTime = now - reapStart;
+    SELF_STATS.mTotalReapTime += SELF_STATS.mReapTime;
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        if (test->mInFlight && now - test->mSendTime >= PING_TIMEOUT) {
+            test->mInFlight = 0;
+            TRACE2(probe_timeout, i, getTraceTime(now));
+            recordResult(test, FAIL_CHAR);
+        }
+    }
+
+    // Convert monotonic result times to wall-clock times.
+    int64_t wallClockNow = getWallClockMs();
+
+    // Write the result, or a dot for all the ones that didn't finish this round.
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        char c = test->mPendingResult != 0 ? test->mPendingResult :
+            test->mPaused ? PAUSED_CHAR : WAITING_CHAR;
+        addToHistory(&test->mResults, c);
+        TRACE3(result, i, getTraceTime(now), c);
+        if (SIM_NETWORK != NULL) {
+            SIM_NETWORK->mDigest = (SIM_NETWORK->mDigest ^ (uint8_t) c)*0x100000001B3ull;
+        }
+        updateStatistics(test, c);
+        if (test->mRttHistory != NULL) {
+            recordRttCode(test, c);
+        }
+        if (RESULTS_OUTPUT != NULL && c != WAITING_CHAR && c != PAUSED_CHAR) {
+            writeResultRecord(RESULTS_OUTPUT, test, i, c,
+                    wallClockNow - (int64_t) ((now - test->mResultTime)*1000));
+        }
+        test->mPendingResult = 0;
+    }
+
+    if (RESULTS_OUTPUT != NULL) {
+        flushOutput(RESULTS_OUTPUT);
+    }
+}
+
+// Start a probe of the test, which must not be running.
+void startTest(struct Test *test) {
+    switch (test->mTestType) {
+        case PING: {
+            if (test->mSocket != -1) {
+                sendPing(test);
+                break;
+            }
+            spawnCheck(test,
+#if __APPLE__
+                    2,
+                    "/sbin/ping", "-n", "-c", "1", "-q", "-t", "5",
+#elif __linux__
+                    1,
+                    "/bin/ping", "-n", "-c", "1", "-q", "-W", "5",
+#else
+#  error "Unknown platform"
+#endif
+                    test->mAddress,
+                    (char *) NULL);
+            break;
+        }
+
+        case DNS:
+            spawnCheck(test, 1,
+                    "/usr/bin/host", "-t", "a", "plunk.org", test->mAddress,
+                    (char *) NULL);
+            break;
+
+        case NTP:
+            if (test->mSocket != -1) {
+                sendNtpRequest(test);
+            } else {
+                recordResult(test, UNKNOWN_CHAR);
+            }
+            break;
+
+        case SIMULATED:
+            sendSimulatedProbe(SIM_NETWORK, test);
+            break;
+    }
+}
+
+// Whether the test has a probe in progress.
+int isTestRunning(struct Test *test) {
+    return test->mPid != 0 || test->mInFlight;
+}
+
+// Spawn new tests.
+void spawnTests(struct Test tests[], int count) {
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        if (!isTestRunning(test) && !test->mPaused) {
+            startTest(test);
+        }
+    }
+}
+
+// Rank "count" tests by "metric", keeping up to "worstCount" of the worst.
+struct Ranking *startRanking(enum RankMetric metric, int worstCount,
+        struct Test tests[], int count) {
+
+    struct Ranking *ranking = (struct Ranking *) calloc(1, sizeof(struct Ranking));
+    ranking->mMetric = metric;
+    ranking->mHeap = (int *) malloc(count*sizeof(int));
+    ranking->mPositions = (int *) malloc(count*sizeof(int));
+    ranking->mScores = (double *) malloc(count*sizeof(double));
+    ranking->mCount = count;
+    ranking->mWorstCapacity = worstCount < count ? worstCount : count;
+    ranking->mCandidates = (int *) malloc((2*ranking->mWorstCapacity + 1)*sizeof(int));
+    ranking->mWorst = (int *) malloc(ranking->mWorstCapacity*sizeof(int));
+
+    for (int i = 0; i < count; i++) {
+        ranking->mHeap[i] = i;
+        ranking->mPositions[i] = i;
+        ranking->mScores[i] = getRankScore(&tests[i], metric);
+    }
+    for (int i = count/2 - 1; i >= 0; i--) {
+        siftRankedDown(ranking, i);
+    }
+
+    return ranking;
+}
+
+// Restore the heap of "count" candidate positions after "c" changed.
+void siftCandidate(struct Ranking *ranking, int *candidates, int count, int c) {
+    while (c > 0 && isRankedAbove(ranking, candidates[c], candidates[(c - 1)/2])) {
+        int parent = candidates[(c - 1)/2];
+        candidates[(c - 1)/2] = candidates[c];
+        candidates[c] = parent;
+        c = (c - 1)/2;
+    }
+
+    while (1) {
+        int worst = c;
+        for (int child = 2*c + 1; child <= 2*c + 2 && child < count; child++) {
+            if (isRankedAbove(ranking, candidates[child], candidates[worst])) {
+                worst = child;
+            }
+        }
+        if (worst == c) {
+            break;
+        }
+        int swap = candidates[c];
+        candidates[c] = candidates[worst];
+        candidates[worst] = swap;
+        c = worst;
+    }
+}
+
+// Put the indices of the worst tests, worst first, in the ranking's mWorst.
+// Walks the top of the heap with a second, small heap of the positions whose
+// parents have been taken.
+void findWorstTests(struct Ranking *ranking) {
+    int *candidates = ranking->mCandidates;
+    int candidateCount = 0;
+
+    ranking->mWorstCount = 0;
+    if (ranking->mCount > 0) {
+        candidates[candidateCount++] = 0;
+    }
+
+    while (ranking->mWorstCount < ranking->mWorstCapacity && candidateCount > 0) {
+        int position = candidates[0];
+        ranking->mWorst[ranking->mWorstCount++] = ranking->mHeap[position];
+
+        // Take it out of the candidates, then add its children.
+        candidates[0] = candidates[--candidateCount];
+        siftCandidate(ranking, candidates, candidateCount, 0);
+        for (int child = 2*position + 1; child <= 2*position + 2 && child < ranking->mCount; child++) {
+            candidates[candidateCount++] = child;
+            siftCandidate(ranking, candidates, candidateCount, candidateCount - 1);
+        }
+    }
+}
+
+// Print how bad the test is by the ranking's metric.
+void printRankScore(FILE *out, struct Ranking *ranking, struct Test *test) {
+    double score = getRankScore(test, ranking->mMetric);
+
+    switch (ranking->mMetric) {
+        case RANK_LOSS:
+            fprintf(out, " loss %.0f%%", score*100);
+            break;
+
+        case RANK_RTT:
+            if (isinf(score)) {
+                fprintf(out, " p99 >%gms", RTT_BUCKETS[RTT_BUCKET_COUNT - 1]*1000);
+            } else {
+                fprintf(out, " p99 <%gms", score*1000);
+            }
+            break;
+
+        case RANK_OUTAGE:
+            fprintf(out, " down %.0fs", score);
+            break;
+    }
+}
+
+// Display a string, coloring the various characters we use.
+void printColoredString(FILE *out, char const *s) {
+    while (*s != '\0') {
+        if (*s == SUCCESS_CHAR) {
+            fprintf(out, "\033[32m"); // Green
+        } else if (*s == FAIL_CHAR || *s == UNKNOWN_CHAR) {
+            fprintf(out, "\033[31m"); // Red
+        } else if (*s == HOST_UNREACHABLE_CHAR) {
+            fprintf(out, "\033[33m"); // Yellow
+        } else if (*s == NET_UNREACHABLE_CHAR) {
+            fprintf(out, "\033[35m"); // Magenta
+        } else if (*s == PROHIBITED_CHAR) {
+            fprintf(out, "\033[34m"); // Blue
+        } else if (*s == TIME_EXCEEDED_CHAR) {
+            fprintf(out, "\033[36m"); // Cyan
+        } else if (*s == CLOCK_OFF_CHAR || *s == SOME_FAILED_CHAR) {
+            fprintf(out, "\033[33m"); // Yellow
+        } else if (*s == WAITING_CHAR || *s == PAUSED_CHAR) {
+            fprintf(out, "\033[90m"); // Bright black (!)
+        } else {
+            fprintf(out, "\033[0m"); // Reset
+        }
+        putc(*s, out);
+        s++;
+    }
+    fprintf(out, "\033[0m"); // Reset
+}
+
+// Fill in RTT_GLYPHS for "view": round-trip times as block heights (spark)
+// or background colors (heat), both going from green to red.
+void startLatencyView(enum LatencyView view, struct Test tests[], int count) {
+    // xterm-256color ramp, one per bucket.
+    static int const COLORS[RTT_BUCKET_COUNT + 1] = {
+        46, 82, 118, 154, 190, 226, 220, 214, 208, 202, 196, 160, 124,
+    };
+    static char const *BLOCKS[] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+    for (int code = 0; code < RTT_CODE_COUNT; code++) {
+        struct RttGlyph *glyph = &RTT_GLYPHS[code];
+
+        if (code == RTT_CODE_NONE) {
+            strcpy(glyph->mEscape, "\033[0;90m");
+            strcpy(glyph->mGlyph, ".");
+        } else if (code == RTT_CODE_FAILED) {
+            strcpy(glyph->mEscape, "\033[0;31m");
+            strcpy(glyph->mGlyph, "X");
+        } else if (view == LATENCY_SPARK) {
+            int bucket = code - RTT_CODE_BUCKET;
+            snprintf(glyph->mEscape, sizeof(glyph->mEscape), "\033[0;38;5;%dm", COLORS[bucket]);
+            strcpy(glyph->mGlyph, BLOCKS[bucket*8/(RTT_BUCKET_COUNT + 1)]);
+        } else {
+            int bucket = code - RTT_CODE_BUCKET;
+            snprintf(glyph->mEscape, sizeof(glyph->mEscape), "\033[0;48;5;%dm", COLORS[bucket]);
+            strcpy(glyph->mGlyph, " ");
+        }
+        glyph->mEscapeLength = strlen(glyph->mEscape);
+        glyph->mGlyphLength = strlen(glyph->mGlyph);
+    }
+
+    for (int i = 0; i < count; i++) {
+        tests[i].mRttHistory = (uint8_t *) calloc(RTT_HISTORY, 1);
+    }
+}
+
+// Display the last "width" ticks of the test's mRttHistory, in one pass that
+// copies each tick's glyph (and color, when it changes) from RTT_GLYPHS.
+void printRttHistory(FILE *out, struct Test *test, int width) {
+    char line[RTT_HISTORY*(sizeof(RTT_GLYPHS[0].mEscape) + sizeof(RTT_GLYPHS[0].mGlyph)) + 8];
+    size_t length = 0;
+    int previous = -1;
+
+    if (width > RTT_HISTORY) {
+        width = RTT_HISTORY;
+    }
+    uint64_t end = test->mRttTickCount;
+    uint64_t start = end > (uint64_t) width ? end - width : 0;
+
+    for (uint64_t t = start; t < end; t++) {
+        int code = test->mRttHistory[t % RTT_HISTORY];
+        struct RttGlyph *glyph = &RTT_GLYPHS[code];
+
+        if (code != previous) {
+            memcpy(line + length, glyph->mEscape, glyph->mEscapeLength);
+            length += glyph->mEscapeLength;
+            previous = code;
+        }
+        memcpy(line + length, glyph->mGlyph, glyph->mGlyphLength);
+        length += glyph->mGlyphLength;
+    }
+    memcpy(line + length, "\033[0m", 4);
+    length += 4;
+
+    fwrite(line, 1, length, out);
+}
+
+// Display a test and its results as a row of a table.
+void displayTest(FILE *out, struct Test *test, int maxWidth) {
+    char *label = getLabelForType(test->mTestType);
+
+    int width = fprintf(out, "%s %s: ", label, test->mAddress);
+    fprintf(out, "%*s", maxWidth - width, "");
+    if (test->mRttHistory != NULL) {
+        printRttHistory(out, test, TERMINAL_WIDTH - maxWidth);
+    } else {
+        char row[TERMINAL_WIDTH + 1];
+        printColoredString(out, getHistoryString(&test->mResults, row, TERMINAL_WIDTH - maxWidth));
+    }
+    if (RANKING != NULL) {
+        printRankScore(out, RANKING, test);
+    }
+    if (test->mErrorFrom[0] != '\0') {
+        fprintf(out, " from %s", test->mErrorFrom);
+    } else if (test->mHaveNtpResult) {
+        fprintf(out, " offset %+.3fs delay %.3fs", test->mNtpOffset, test->mNtpDelay);
+    }
+    // Clear to end of line, the reporting router may have changed.
+    fprintf(out, "\033[K\n");
+}
+
+// Display tests and their results as rows of a table.
+void displayTests(FILE *out, struct Test tests[], int count, int maxWidth) {
+    for (int i = 0; i < count; i++) {
+        displayTest(out, &tests[i], maxWidth);
+    }
+}
+
+// Print a plain line for each test whose latest result differs from the one
+// before it, or for every test on the first tick. For when standard output
+// isn't a terminal and isn't getting JSON records.
+void printResultChanges(FILE *out, struct Test tests[], int count, int first) {
+    time_t now = time(NULL);
+    struct tm tm;
+    char stamp[32];
+
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        char c = getHistoryChar(&test->mResults, 0);
+
+        if (c != 0 && (first || c != getHistoryChar(&test->mResults, 1))) {
+            fprintf(out, "%s %s %s: %c\n", stamp, getLabelForType(test->mTestType),
+                    test->mAddress, c);
+        }
+    }
+    fflush(out);
+}
+
+// Move up "count" rows.
+void backupCursor(FILE *out, int count) {
+    fprintf(out, "\033[%dA", count);
+}
+
+// Number of rows of the terminal on standard output, or a guess.
+int getTerminalRows(void) {
+    struct winsize size;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_row == 0) {
+        return 24;
+    }
+
+    return size.ws_row;
+}
+
+// Make groups of adjacent tests with the same mGroup and summarize them.
+// Returns the width of the widest group label, like getMaxWidth().
+int startGroups(struct Test tests[], int count) {
+    int maxWidth = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        char const *name = test->mGroup != NULL ? test->mGroup : "Other";
+
+        if (GROUP_COUNT == 0 || strcmp(GROUPS[GROUP_COUNT - 1].mName, name) != 0) {
+            GROUPS = (struct Group *) realloc(GROUPS, (GROUP_COUNT + 1)*sizeof(struct Group));
+            struct Group *group = &GROUPS[GROUP_COUNT++];
+            memset(group, 0, sizeof(*group));
+            group->mName = name;
+            group->mFirst = i;
+            startHistory(&group->mResults);
+            group->mCollapsed = 1;
+        }
+
+        // The results so far, possibly from a checkpoint.
+        struct Group *group = &GROUPS[GROUP_COUNT - 1];
+        test->mGroupIndex = GROUP_COUNT - 1;
+        if (test->mSuccessCount > 0 && test->mOutageTicks == 0) {
+            test->mRttBucket = getRttBucket(test->mLastRtt);
+            group->mRttCounts[test->mRttBucket]++;
+        }
+        group->mFailingCount += test->mOutageTicks > 0;
+        group->mCount++;
+    }
+
+    for (int g = 0; g < GROUP_COUNT; g++) {
+        // "+ name (count): "
+        int width = 2 + strlen(GROUPS[g].mName) + snprintf(NULL, 0, " (%d)", GROUPS[g].mCount) + 2;
+        if (width > maxWidth) {
+            maxWidth = width;
+        }
+    }
+
+    return maxWidth;
+}
+
+// Add the summary of the tick that just finished to each group's history.
+void recordGroupResults(void) {
+    for (int g = 0; g < GROUP_COUNT; g++) {
+        struct Group *group = &GROUPS[g];
+        int replied = 0;
+
+        for (int b = 0; b <= RTT_BUCKET_COUNT; b++) {
+            replied += group->mRttCounts[b];
+        }
+
+        addToHistory(&group->mResults,
+                group->mFailingCount == group->mCount ? FAIL_CHAR :
+                group->mFailingCount > 0 ? SOME_FAILED_CHAR :
+                replied > 0 ? SUCCESS_CHAR : WAITING_CHAR);
+    }
+}
+
+// Display the summary row of a group.
+void displayGroup(FILE *out, struct Group *group, int maxWidth) {
+    int width = fprintf(out, "%c %s (%d): ", group->mCollapsed ? '+' : '-', group->mName, group->mCount);
+    fprintf(out, "%*s", maxWidth - width, "");
+    char row[TERMINAL_WIDTH + 1];
+    printColoredString(out, getHistoryString(&group->mResults, row, TERMINAL_WIDTH - maxWidth));
+
+    if (group->mFailingCount > 0) {
+        fprintf(out, " %d/%d failing", group->mFailingCount, group->mCount);
+    }
+    for (int b = RTT_BUCKET_COUNT; b >= 0; b--) {
+        if (group->mRttCounts[b] > 0) {
+            if (b == RTT_BUCKET_COUNT) {
+                fprintf(out, " worst RTT >%gms", RTT_BUCKETS[RTT_BUCKET_COUNT - 1]*1000);
+            } else {
+                fprintf(out, " worst RTT <%gms", RTT_BUCKETS[b]*1000);
+            }
+            break;
+        }
+    }
+    fprintf(out, "\033[K\n");
+}
+
+// Number of rows of the grouped table: a summary per group, followed by its
+// members unless it's collapsed.
+int getGroupRowCount(void) {
+    int rows = 0;
+
+    for (int g = 0; g < GROUP_COUNT; g++) {
+        rows += 1 + (GROUPS[g].mCollapsed ? 0 : GROUPS[g].mCount);
+    }
+
+    return rows;
+}
+
+// Draw "count" rows of the grouped table starting at row "first".
+void drawGroupRows(FILE *out, struct TestTable *table, int first, int count) {
+    int row = 0;
+
+    for (int g = 0; g < GROUP_COUNT && count > 0; g++) {
+        struct Group *group = &GROUPS[g];
+        int rows = 1 + (group->mCollapsed ? 0 : group->mCount);
+
+        if (row + rows > first) {
+            // Row of the group to start at, 0 for its summary.
+            int offset = first - row;
+            if (offset == 0) {
+                displayGroup(out, group, table->mMaxWidth);
+                count--;
+                offset = 1;
+            }
+
+            int members = rows - offset < count ? rows - offset : count;
+            displayTests(out, table->mTests + group->mFirst + offset - 1, members, table->mMaxWidth);
+            count -= members;
+            first = row + rows;
+        }
+        row += rows;
+    }
+}
+
+// Display the status line of the program's own timings.
+void displaySelfStats(FILE *out, struct SelfStats *stats) {
+    fprintf(out, "\033[7m Self \033[0m tick %.3fs, %llu late; spawn %.2fms, reap %.2fms, "
+            "render %.2fms; %llu KB drawn; %d in flight%s\033[K\n",
+            stats->mTickTime, (unsigned long long) stats->mOverrunCount,
+            stats->mSpawnTime*1000, stats->mReapTime*1000, stats->mRenderTime*1000,
+            (unsigned long long) stats->mTerminalBytes/1024, stats->mInFlight,
+            RENDERER != NULL && RENDERER->mDroppedCount > 0 ? ", frames dropped" : "");
+}
+
+// Count the end of a tick that started at "start".
+void finishTickStats(struct SelfStats *stats, struct Test tests[], int count, double start) {
+    stats->mTickTime = getMonotonicTime() - start;
+    stats->mTickCount++;
+    if (stats->mTickTime > 1 + TICK_OVERRUN_SLACK) {
+        stats->mOverrunCount++;
+        stats->mOverrunTime += stats->mTickTime - 1;
+    }
+
+    stats->mTotalSpawnTime += stats->mSpawnTime;
+
+    stats->mInFlight = 0;
+    for (int i = 0; i < count; i++) {
+        stats->mInFlight += isTestRunning(&tests[i]);
+    }
+}
+
+// Time by which "fraction" of the replies since the last report were handled.
+double getSimLatencyPercentile(struct SimNetwork *network, double fraction) {
+    uint64_t total = 0;
+    for (int b = 0; b < SIM_LATENCY_BUCKETS; b++) {
+        total += network->mLatencyCounts[b];
+    }
+
+    uint64_t cumulative = 0;
+    for (int b = 0; b < SIM_LATENCY_BUCKETS; b++) {
+        cumulative += network->mLatencyCounts[b];
+        if (cumulative > 0 && cumulative >= total*fraction) {
+            return (b + 1)*SIM_LATENCY_STEP;
+        }
+    }
+
+    return 0;
+}
+
+// Print how well the loop kept up with the simulated network since the last
+// report, and start counting again.
+void reportSimulation(struct SimNetwork *network, struct SelfStats *stats, int count) {
+    struct rusage usage;
+    double cpuTime = getCpuTime();
+
+    getrusage(RUSAGE_SELF, &usage);
+#if __APPLE__
+    long maxRss = usage.ru_maxrss/1024;
+#else
+    long maxRss = usage.ru_maxrss;
+#endif
+
+    double cpuPerProbe = network->mProbeCount == 0 ? 0 :
+        (cpuTime - network->mReportCpuTime)*1e6/network->mProbeCount;
+    uint64_t tickCount = stats->mTickCount - network->mReportTickCount;
+
+    // Virtual ticks never overrun and replies are never late, but the
+    // results should be the same in every run with the same spec.
+    if (network->mVirtualClock) {
+        printf("%d targets, tick %llu: %.2f us CPU per probe, %.0f ticks per CPU second, "
+                "max RSS %ld MB, results %016llx\n",
+                count, (unsigned long long) stats->mTickCount, cpuPerProbe,
+                cpuTime > network->mReportCpuTime ?
+                    tickCount/(cpuTime - network->mReportCpuTime) : 0,
+                maxRss/1024, (unsigned long long) network->mDigest);
+    } else {
+        printf("%d targets, tick %llu: %.2f us CPU per probe, %llu of %llu ticks overran, "
+                "max RSS %ld MB, result latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                count, (unsigned long long) stats->mTickCount, cpuPerProbe,
+                (unsigned long long) (stats->mOverrunCount - network->mReportOverrunCount),
+                (unsigned long long) tickCount,
+                maxRss/1024,
+                getSimLatencyPercentile(network, 0.5)*1000,
+                getSimLatencyPercentile(network, 0.99)*1000,
+                network->mMaxLatency*1000);
+    }
+    fflush(stdout);
+
+    network->mProbeCount = 0;
+    memset(network->mLatencyCounts, 0, sizeof(network->mLatencyCounts));
+    network->mMaxLatency = 0;
+    network->mReportCpuTime = cpuTime;
+    network->mReportTickCount = stats->mTickCount;
+    network->mReportOverrunCount = stats->mOverrunCount;
+}
+
+// Draw the rows of the table that fit on the terminal over the previous
+// frame, leaving the cursor below them. If they don't all fit, a status line
+// says which are shown. Only the visible rows are drawn.
+void drawViewport(FILE *out, struct Viewport *viewport, struct TestTable *table) {
+    int count = table->mGrouped ? getGroupRowCount() : table->mCount;
+
+    // Keep a row free for the cursor so the screen doesn't scroll.
+    int rows = getTerminalRows() - 1 - SELF_STATS.mShown;
+    int fits = count <= rows;
+    if (!fits) {
+        rows = rows > 2 ? rows - 1 : 1;
+    }
+
+    if (viewport->mTop > count - rows) {
+        viewport->mTop = count - rows;
+    }
+    if (viewport->mTop < 0) {
+        viewport->mTop = 0;
+    }
+    viewport->mRows = rows;
+
+    if (viewport->mShown > 0) {
+        backupCursor(out, viewport->mShown);
+    }
+
+    int visible = count - viewport->mTop < rows ? count - viewport->mTop : rows;
+    if (table->mGrouped) {
+        drawGroupRows(out, table, viewport->mTop, visible);
+    } else if (table->mRows != NULL) {
+        for (int i = 0; i < visible; i++) {
+            displayTest(out, &table->mTests[table->mRows[viewport->mTop + i]], table->mMaxWidth);
+        }
+    } else {
+        displayTests(out, table->mTests + viewport->mTop, visible, table->mMaxWidth);
+    }
+    viewport->mShown = visible;
+    if (!fits) {
+        fprintf(out, "\033[7m Rows %d-%d of %d \033[0m j/k: scroll, space/b: page, g/G: top/bottom%s\033[K\n",
+                viewport->mTop + 1, viewport->mTop + visible, count,
+                table->mGrouped ? ", c/e: collapse/expand" : "");
+        viewport->mShown++;
+    }
+    if (SELF_STATS.mShown) {
+        displaySelfStats(out, &SELF_STATS);
+        viewport->mShown++;
+    }
+
+    // Erase what's left of a longer previous frame.
+    fprintf(out, "\033[J");
+}
+
+// Put the terminal back the way we found it.
+void restoreKeyboard(void) {
+    if (VIEWPORT.mKeyboard) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &VIEWPORT.mSavedTermios);
+    }
+}
+
+// Remove the shared memory segment, so readers don't find stale results.
+void removeResultsShm(void) {
+    if (RESULTS_SHM_NAME != NULL) {
+        shm_unlink(RESULTS_SHM_NAME);
+    }
+}
+
+// Restore the terminal and remove the shared memory segment, then die of the
+// signal as we would have.
+void handleFatalSignal(int sig) {
+    restoreKeyboard();
+    removeResultsShm();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Note that the table changed, so the next frame will show it.
+void requestFrame(struct Renderer *renderer) {
+    renderer->mDirty = 1;
+}
+
+// Write as much of the frame as the terminal will take without blocking.
+void sendFrame(struct Renderer *renderer) {
+    while (renderer->mFrameSent < renderer->mFrameLength) {
+        ssize_t length = write(renderer->mFd, renderer->mFrameData + renderer->mFrameSent,
+                renderer->mFrameLength - renderer->mFrameSent);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Nowhere to draw, forget the frame.
+                renderer->mFrameSent = renderer->mFrameLength;
+            }
+            break;
+        }
+        renderer->mFrameSent += length;
+        SELF_STATS.mTerminalBytes += length;
+    }
+
+    setWatchEvents(renderer->mFd, renderer->mFrameSent < renderer->mFrameLength ? POLLOUT : 0);
+}
+
+// Send more of the frame when the terminal can take it.
+void handleTerminal(int fd, short revents, void *data) {
+    sendFrame((struct Renderer *) data);
+}
+
+// Draw a frame if the table changed and it's been long enough since the
+// last one. If the terminal hasn't taken all of the last frame yet, this one
+// is dropped rather than queued behind it.
+void renderFrame(struct Renderer *renderer) {
+    double now = getMonotonicTime();
+
+    if (!renderer->mDirty || now < renderer->mNextFrameTime) {
+        return;
+    }
+    renderer->mNextFrameTime = now + FRAME_INTERVAL;
+
+    if (renderer->mFrameSent < renderer->mFrameLength) {
+        renderer->mDroppedCount++;
+        return;
+    }
+
+    renderer->mDirty = 0;
+    rewind(renderer->mFrame);
+    drawViewport(renderer->mFrame, renderer->mViewport, renderer->mTable);
+    fflush(renderer->mFrame);
+    SELF_STATS.mRenderTime = getMonotonicTime() - now;
+    SELF_STATS.mTotalRenderTime += SELF_STATS.mRenderTime;
+    renderer->mFrameLength = ftell(renderer->mFrame);
+    renderer->mFrameSent = 0;
+    renderer->mFrameCount++;
+    TRACE3(frame, getTraceTime(now), renderer->mFrameLength,
+            getTraceTime(SELF_STATS.mRenderTime));
+
+    sendFrame(renderer);
+}
+
+// Redraw after the terminal changes size.
+void handleResize(int sig) {
+    if (RENDERER != NULL) {
+        RENDERER->mDirty = 1;
+    }
+}
+
+// Start drawing "table" through "viewport" on the terminal of standard output.
+struct Renderer *startRenderer(struct Viewport *viewport, struct TestTable *table) {
+    struct Renderer *renderer = (struct Renderer *) calloc(1, sizeof(struct Renderer));
+    renderer->mViewport = viewport;
+    renderer->mTable = table;
+    renderer->mDirty = 1;
+
+    char *tty = ttyname(STDOUT_FILENO);
+    renderer->mFd = tty == NULL ? -1 : open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY);
+    if (renderer->mFd == -1) {
+        // Not a terminal, so it's fine to wait for it.
+        renderer->mFd = dup(STDOUT_FILENO);
+    }
+
+    renderer->mFrame = open_memstream(&renderer->mFrameData, &renderer->mFrameSize);
+    if (renderer->mFrame == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+
+    watchFd(renderer->mFd, 0, handleTerminal, renderer);
+    RENDERER = renderer;
+    signal(SIGWINCH, handleResize);
+
+    return renderer;
+}
+
+// Scroll the viewport by the keys the user pressed, and redraw it.
+void handleKeyboard(int fd, short revents, void *data) {
+    struct Renderer *renderer = (struct Renderer *) data;
+    struct Viewport *viewport = renderer->mViewport;
+    char keys[64];
+
+    ssize_t length = read(fd, keys, sizeof(keys));
+    if (length <= 0) {
+        if (length == 0 || (errno != EAGAIN && errno != EINTR)) {
+            // No more keyboard.
+            unwatchFd(fd);
+        }
+        return;
+    }
+
+    int top = viewport->mTop;
+    int redraw = 0;
+    for (int i = 0; i < length; i++) {
+        char key = keys[i];
+
+        // Translate the escape sequences of the arrow and paging keys.
+        if (key == '\033' && i + 2 < length && keys[i + 1] == '[') {
+            char code = keys[i + 2];
+            i += 2;
+            if (code >= '1' && code <= '6' && i + 1 < length && keys[i + 1] == '~') {
+                i++;
+                key = code == '5' ? 'b' : code == '6' ? ' ' : code == '1' ? 'g' : code == '4' ? 'G' : 0;
+            } else {
+                key = code == 'A' ? 'k' : code == 'B' ? 'j' : code == 'H' ? 'g' : code == 'F' ? 'G' : 0;
+            }
+        }
+
+        switch (key) {
+            case 'j':
+                top++;
+                break;
+
+            case 'k':
+                top--;
+                break;
+
+            case ' ':
+            case 'f':
+                top += viewport->mRows;
+                break;
+
+            case 'b':
+                top -= viewport->mRows;
+                break;
+
+            case 'g':
+                top = 0;
+                break;
+
+            case 'G':
+                // Clamped when drawn.
+                top = INT32_MAX/2;
+                break;
+
+            case 'i':
+                SELF_STATS.mShown = !SELF_STATS.mShown;
+                redraw = 1;
+                break;
+
+            case 'c':
+            case 'e':
+                // Fold or unfold all groups.
+                for (int g = 0; g < GROUP_COUNT; g++) {
+                    GROUPS[g].mCollapsed = key == 'c';
+                }
+                redraw = 1;
+                break;
+        }
+    }
+
+    if (top != viewport->mTop || redraw) {
+        viewport->mTop = top;
+        requestFrame(renderer);
+        renderFrame(renderer);
+    }
+}
+
+// Read single keys from the terminal without echoing them, to scroll the
+// table. Returns whether there is a terminal to read from.
+int startKeyboard(struct Viewport *viewport) {
+    struct termios termios;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &termios) == -1) {
+        return 0;
+    }
+
+    viewport->mSavedTermios = termios;
+    viewport->mKeyboard = 1;
+
+    // Reads return whatever has been typed, but still let ^C through.
+    termios.c_lflag &= ~(ICANON | ECHO);
+    termios.c_cc[VMIN] = 0;
+    termios.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &termios);
+
+    atexit(restoreKeyboard);
+    signal(SIGINT, handleFatalSignal);
+    signal(SIGTERM, handleFatalSignal);
+    signal(SIGHUP, handleFatalSignal);
+
+    return 1;
+}
+
+// Header of each metric family, in the order of enum MetricFamily.
+static char const *METRIC_HEADERS[METRIC_FAMILY_COUNT] = {
+    "# TYPE network_diagnosis_up gauge\n"
+    "# HELP network_diagnosis_up Whether the most recent probe got a reply.\n",
+    "# TYPE network_diagnosis_probes counter\n"
+    "# HELP network_diagnosis_probes Probes that completed, by result.\n",
+    "# TYPE network_diagnosis_loss_ratio gauge\n"
+    "# HELP network_diagnosis_loss_ratio Fraction of recent probes that failed.\n",
+    "# TYPE network_diagnosis_rtt_seconds histogram\n"
+    "# UNIT network_diagnosis_rtt_seconds seconds\n"
+    "# HELP network_diagnosis_rtt_seconds Round-trip time of probes that got a reply.\n",
+};
+static char const METRICS_EOF[] = "# EOF\n";
+
+// Format the metrics of the program's own performance into "dest".
+void formatSelfMetrics(char *dest, size_t size, struct SelfStats *stats) {
+    snprintf(dest, size,
+            "# TYPE network_diagnosis_self_ticks counter\n"
+            "# HELP network_diagnosis_self_ticks Ticks of the main loop.\n"
+            "network_diagnosis_self_ticks_total %llu\n"
+            "# TYPE network_diagnosis_self_overruns counter\n"
+            "# HELP network_diagnosis_self_overruns Ticks that took noticeably longer than a second.\n"
+            "network_diagnosis_self_overruns_total %llu\n"
+            "# TYPE network_diagnosis_self_overrun_seconds counter\n"
+            "# UNIT network_diagnosis_self_overrun_seconds seconds\n"
+            "# HELP network_diagnosis_self_overrun_seconds How late those ticks were in total.\n"
+            "network_diagnosis_self_overrun_seconds_total %g\n"
+            "# TYPE network_diagnosis_self_tick_seconds gauge\n"
+            "# UNIT network_diagnosis_self_tick_seconds seconds\n"
+            "# HELP network_diagnosis_self_tick_seconds Duration of the last tick.\n"
+            "network_diagnosis_self_tick_seconds %g\n"
+            "# TYPE network_diagnosis_self_spawns counter\n"
+            "# HELP network_diagnosis_self_spawns Probe programs spawned.\n"
+            "network_diagnosis_self_spawns_total %llu\n"
+            "# TYPE network_diagnosis_self_busy_seconds counter\n"
+            "# UNIT network_diagnosis_self_busy_seconds seconds\n"
+            "# HELP network_diagnosis_self_busy_seconds Time spent spawning and reaping probes and drawing the table.\n"
+            "network_diagnosis_self_busy_seconds_total{task=\"spawn\"} %g\n"
+            "network_diagnosis_self_busy_seconds_total{task=\"reap\"} %g\n"
+            "network_diagnosis_self_busy_seconds_total{task=\"render\"} %g\n"
+            "# TYPE network_diagnosis_self_terminal_bytes counter\n"
+            "# UNIT network_diagnosis_self_terminal_bytes bytes\n"
+            "# HELP network_diagnosis_self_terminal_bytes Bytes of the table written to the terminal.\n"
+            "network_diagnosis_self_terminal_bytes_total %llu\n"
+            "# TYPE network_diagnosis_self_frames counter\n"
+            "# HELP network_diagnosis_self_frames Frames of the table drawn, and dropped because the terminal was slow.\n"
+            "network_diagnosis_self_frames_total{result=\"drawn\"} %llu\n"
+            "network_diagnosis_self_frames_total{result=\"dropped\"} %llu\n"
+            "# TYPE network_diagnosis_self_in_flight gauge\n"
+            "# HELP network_diagnosis_self_in_flight Probes outstanding at the end of the last tick.\n"
+            "network_diagnosis_self_in_flight %d\n",
+            (unsigned long long) stats->mTickCount,
+            (unsigned long long) stats->mOverrunCount, stats->mOverrunTime,
+            stats->mTickTime,
+            (unsigned long long) stats->mSpawnCount,
+            stats->mTotalSpawnTime, stats->mTotalReapTime, stats->mTotalRenderTime,
+            (unsigned long long) stats->mTerminalBytes,
+            (unsigned long long) (RENDERER != NULL ? RENDERER->mFrameCount : 0),
+            (unsigned long long) (RENDERER != NULL ? RENDERER->mDroppedCount : 0),
+            stats->mInFlight);
+}
+
+// Format the metrics of the NDJSON writer thread into "dest", or nothing if
+// there isn't one.
+void formatWriterMetrics(char *dest, size_t size) {
+    struct DiskWriter *writer = RESULTS_OUTPUT == NULL ? NULL : RESULTS_OUTPUT->mWriter;
+
+    if (writer == NULL) {
+        dest[0] = '\0';
+        return;
+    }
+
+    snprintf(dest, size,
+            "# TYPE network_diagnosis_records counter\n"
+            "# HELP network_diagnosis_records JSON records written, and dropped because the disk was slow or failing.\n"
+            "network_diagnosis_records_total{result=\"written\"} %llu\n"
+            "network_diagnosis_records_total{result=\"dropped\"} %llu\n"
+            "# TYPE network_diagnosis_record_syncs counter\n"
+            "# HELP network_diagnosis_record_syncs Calls to fdatasync() on the JSON records.\n"
+            "network_diagnosis_record_syncs_total %llu\n"
+            "# TYPE network_diagnosis_record_stall_seconds counter\n"
+            "# UNIT network_diagnosis_record_stall_seconds seconds\n"
+            "# HELP network_diagnosis_record_stall_seconds Time probing waited for the disk.\n"
+            "network_diagnosis_record_stall_seconds_total %g\n",
+            (unsigned long long) atomic_load(&writer->mWrittenRecords),
+            (unsigned long long) atomic_load(&writer->mDroppedRecords),
+            (unsigned long long) atomic_load(&writer->mSyncCount),
+            atomic_load(&writer->mStallMicroseconds)/1e6);
+}
+
+// Number of bytes that copyMetrics() will write.
+size_t getMetricsLength(struct Test tests[], int count, char const *extra) {
+    size_t length = 0;
+
+    for (int f = 0; f < METRIC_FAMILY_COUNT; f++) {
+        length += strlen(METRIC_HEADERS[f]);
+        for (int i = 0; i < count; i++) {
+            if (tests[i].mMetrics[f] != NULL) {
+                length += strlen(tests[i].mMetrics[f]);
+            }
+        }
+    }
+
+    return length + strlen(extra) + strlen(METRICS_EOF);
+}
+
+// Concatenate the pre-serialized metrics of all tests, then "extra", into
+// "dest", returning the end of what was written.
+char *copyMetrics(struct Test tests[], int count, char const *extra, char *dest) {
+    for (int f = 0; f < METRIC_FAMILY_COUNT; f++) {
+        dest = stpcpy(dest, METRIC_HEADERS[f]);
+        for (int i = 0; i < count; i++) {
+            if (tests[i].mMetrics[f] != NULL) {
+                dest = stpcpy(dest, tests[i].mMetrics[f]);
+            }
+        }
+    }
+
+    dest = stpcpy(dest, extra);
+
+    return stpcpy(dest, METRICS_EOF);
+}
+
+// Page served at / of the HTTP server. It loads a snapshot of all tests from
+// /events, then applies the changes that follow each tick.
+static char const DASHBOARD_HTML[] =
+    "<!DOCTYPE html>\n"
+    "<html><head><meta charset=\"utf-8\"><title>Network diagnosis</title>\n"
+    "<style>\n"
+    "body { font-family: sans-serif; margin: 1em; }\n"
+    "td { padding: 0 0.6em; white-space: nowrap; }\n"
+    "td.h { font-family: monospace; }\n"
+    "td.n { text-align: right; }\n"
+    "#s { color: gray; }\n"
+    "</style></head><body>\n"
+    "<h1>Network diagnosis</h1><p id=\"s\">Connecting...</p>\n"
+    "<table><thead><tr><th>Type</th><th>Target</th><th>History</th>"
+    "<th>Loss</th><th>RTT</th></tr></thead><tbody id=\"t\"></tbody></table>\n"
+    "<script>\n"
+    "const HISTORY = 120, body = document.getElementById('t'), status = document.getElementById('s');\n"
+    "let rows = [];\n"
+    "function cell(tr, c) { const td = tr.insertCell(); td.className = c || ''; return td; }\n"
+    "function show(r) {\n"
+    "  r.h.textContent = r.history;\n"
+    "  r.l.textContent = r.loss + '%';\n"
+    "  r.r.textContent = r.rtt > 0 ? r.rtt.toFixed(1) + ' ms' : '';\n"
+    "}\n"
+    "const events = new EventSource('/events');\n"
+    "events.addEventListener('snapshot', e => {\n"
+    "  const s = JSON.parse(e.data);\n"
+    "  body.textContent = '';\n"
+    "  rows = s.tests.map(t => {\n"
+    "    const tr = body.insertRow();\n"
+    "    cell(tr).textContent = t.type;\n"
+    "    cell(tr).textContent = t.target;\n"
+    "    const r = { history: t.history, result: t.history.slice(-1) || '.', loss: t.loss, rtt: t.rtt,\n"
+    "      h: cell(tr, 'h'), l: cell(tr, 'n'), r: cell(tr, 'n') };\n"
+    "    show(r);\n"
+    "    return r;\n"
+    "  });\n"
+    "  status.textContent = 'Tick ' + s.tick;\n"
+    "});\n"
+    "events.addEventListener('tick', e => {\n"
+    "  const d = JSON.parse(e.data);\n"
+    "  for (const [i, result, loss, rtt] of d.changes) {\n"
+    "    Object.assign(rows[i], { result, loss, rtt });\n"
+    "  }\n"
+    "  for (const r of rows) {\n"
+    "    r.history = (r.history + r.result).slice(-HISTORY);\n"
+    "    show(r);\n"
+    "  }\n"
+    "  status.textContent = 'Tick ' + d.tick;\n"
+    "});\n"
+    "events.onerror = () => { status.textContent = 'Reconnecting...'; };\n"
+    "</script></body></html>\n";
+
+// Make an empty shared buffer with one reference.
+struct SharedBuffer *newSharedBuffer(void) {
+    struct SharedBuffer *buffer = (struct SharedBuffer *) calloc(1, sizeof(struct SharedBuffer));
+    buffer->mRefCount = 1;
+
+    return buffer;
+}
+
+// Drop a reference to a shared buffer, freeing it with the last one.
+void releaseSharedBuffer(struct SharedBuffer *buffer) {
+    if (--buffer->mRefCount == 0) {
+        free(buffer->mData);
+        free(buffer);
+    }
+}
+
+// Make room for "length" more bytes in a shared buffer.
+void reserveShared(struct SharedBuffer *buffer, size_t length) {
+    if (buffer->mLength + length > buffer->mCapacity) {
+        buffer->mCapacity = (buffer->mLength + length)*2;
+        buffer->mData = (char *) realloc(buffer->mData, buffer->mCapacity);
+    }
+}
+
+// Append printf-style text to a shared buffer.
+void appendShared(struct SharedBuffer *buffer, char const *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    reserveShared(buffer, length + 1);
+    va_start(args, format);
+    vsnprintf(buffer->mData + buffer->mLength, length + 1, format, args);
+    va_end(args);
+    buffer->mLength += length;
+}
+
+// Append a quoted JSON string to a shared buffer, escaping straight into it
+// as writeJsonString() does.
+void appendSharedJsonString(struct SharedBuffer *buffer, char const *s) {
+    static char const HEX[] = "0123456789abcdef";
+
+    // Each character takes at most six bytes escaped.
+    reserveShared(buffer, 6*strlen(s) + 2);
+    char *p = buffer->mData + buffer->mLength;
+
+    *p++ = '"';
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            *p++ = '\\';
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = HEX[c >> 4];
+            *p++ = HEX[c & 0xF];
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+
+    buffer->mLength = p - buffer->mData;
+}
+
+// Packet loss over the last LOSS_WINDOW ticks, as a whole percentage.
+int getLossPercent(struct Test *test) {
+    int windowCount = test->mWindowSuccesses + test->mWindowFailures;
+
+    return windowCount == 0 ? 0 : (int) (100.0*test->mWindowFailures/windowCount + 0.5);
+}
+
+// The event that brings a new dashboard up to date, shared by all
+// dashboards that connect during the same tick.
+struct SharedBuffer *getDashboardSnapshot(struct Test tests[], int count) {
+    if (DASHBOARD_SNAPSHOT == NULL) {
+        struct SharedBuffer *buffer = newSharedBuffer();
+
+        appendShared(buffer, "event: snapshot\ndata: {\"tick\":%llu,\"tests\":[",
+                (unsigned long long) DASHBOARD_TICK);
+        for (int i = 0; i < count; i++) {
+            struct Test *test = &tests[i];
+
+            appendShared(buffer, "%s{\"type\":", i == 0 ? "" : ",");
+            appendSharedJsonString(buffer, getLabelForType(test->mTestType));
+            appendShared(buffer, ",\"target\":");
+            appendSharedJsonString(buffer, test->mAddress);
+            appendShared(buffer, ",\"history\":");
+            char history[DASHBOARD_HISTORY + 1];
+            appendSharedJsonString(buffer,
+                    getHistoryString(&test->mResults, history, DASHBOARD_HISTORY));
+            appendShared(buffer, ",\"loss\":%d,\"rtt\":%.1f}",
+                    getLossPercent(test), test->mLastRtt*1000);
+        }
+        appendShared(buffer, "]}\n\n");
+
+        DASHBOARD_SNAPSHOT = buffer;
+    }
+
+    DASHBOARD_SNAPSHOT->mRefCount++;
+
+    return DASHBOARD_SNAPSHOT;
+}
+
+// Queue a buffer for a dashboard, taking over the caller's reference.
+void queueEvent(struct EventClient *client, struct SharedBuffer *buffer) {
+    if (client->mPendingCount == client->mPendingCapacity) {
+        client->mPendingCapacity = client->mPendingCapacity == 0 ? 8 : client->mPendingCapacity*2;
+        client->mPending = (struct SharedBuffer **) realloc(client->mPending,
+                client->mPendingCapacity*sizeof(struct SharedBuffer *));
+    }
+
+    client->mPending[client->mPendingCount++] = buffer;
+    client->mBacklog += buffer->mLength;
+}
+
+// Disconnect a dashboard.
+void closeEventClient(struct EventClient *client) {
+    for (int i = 0; i < EVENT_CLIENT_COUNT; i++) {
+        if (EVENT_CLIENTS[i] == client) {
+            EVENT_CLIENTS[i] = EVENT_CLIENTS[--EVENT_CLIENT_COUNT];
+            break;
+        }
+    }
+
+    unwatchFd(client->mFd);
+    close(client->mFd);
+    for (int i = 0; i < client->mPendingCount; i++) {
+        releaseSharedBuffer(client->mPending[i]);
+    }
+    free(client->mPending);
+    free(client);
+}
+
+// Write as much of a dashboard's queued events as we can without blocking.
+// Returns the number of bytes left, or -1 on error.
+ssize_t sendEvents(struct EventClient *client) {
+    while (client->mPendingCount > 0) {
+        struct iovec iov[EVENT_IOV_MAX];
+        int iovCount = client->mPendingCount < EVENT_IOV_MAX ?
+            client->mPendingCount : EVENT_IOV_MAX;
+
+        for (int i = 0; i < iovCount; i++) {
+            size_t skip = i == 0 ? client->mSent : 0;
+
+            iov[i].iov_base = client->mPending[i]->mData + skip;
+            iov[i].iov_len = client->mPending[i]->mLength - skip;
+        }
+
+        ssize_t length = writev(client->mFd, iov, iovCount);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        client->mBacklog -= length;
+
+        // Let go of the buffers we've finished.
+        int done = 0;
+        length += client->mSent;
+        while (done < client->mPendingCount &&
+                (size_t) length >= client->mPending[done]->mLength) {
+
+            length -= client->mPending[done]->mLength;
+            releaseSharedBuffer(client->mPending[done]);
+            done++;
+        }
+        client->mSent = length;
+        client->mPendingCount -= done;
+        memmove(client->mPending, client->mPending + done,
+                client->mPendingCount*sizeof(struct SharedBuffer *));
+    }
+
+    return client->mBacklog;
+}
+
+// Send queued events to a dashboard, and notice when it goes away.
+void handleEventClient(int fd, short revents, void *data) {
+    struct EventClient *client = (struct EventClient *) data;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        // Browsers don't send anything after the request, so this is EOF or an error.
+        char buffer[256];
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == 0 || (length == -1 && errno != EAGAIN && errno != EINTR)) {
+            closeEventClient(client);
+            return;
+        }
+    }
+
+    ssize_t remaining = sendEvents(client);
+    if (remaining == -1) {
+        closeEventClient(client);
+    } else {
+        setWatchEvents(fd, remaining > 0 ? POLLIN | POLLOUT : POLLIN);
+    }
+}
+
+// Turn an HTTP connection into an event stream that starts with a snapshot.
+void startEventClient(int fd) {
+    struct EventClient *client = (struct EventClient *) calloc(1, sizeof(struct EventClient));
+    client->mFd = fd;
+
+    struct SharedBuffer *headers = newSharedBuffer();
+    appendShared(headers,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: keep-alive\r\n"
+            "\r\n"
+            "retry: 1000\n\n");
+    queueEvent(client, headers);
+    queueEvent(client, getDashboardSnapshot(TESTS, TEST_COUNT));
+
+    EVENT_CLIENTS = (struct EventClient **) realloc(EVENT_CLIENTS,
+            (EVENT_CLIENT_COUNT + 1)*sizeof(struct EventClient *));
+    EVENT_CLIENTS[EVENT_CLIENT_COUNT++] = client;
+    watchFd(fd, POLLIN | POLLOUT, handleEventClient, client);
+}
+
+// Send the dashboards what changed during the tick that just finished: the
+// tests whose result, packet loss or round-trip time (by more than
+// DASHBOARD_RTT_CHANGE) differ from what we last sent. The event is built
+// once and shared by all dashboards, and ones that have fallen too far
+// behind are disconnected (they reconnect and get a fresh snapshot).
+void broadcastDashboard(struct Test tests[], int count) {
+    struct SharedBuffer *buffer = NULL;
+
+    DASHBOARD_TICK++;
+    if (DASHBOARD_SNAPSHOT != NULL) {
+        releaseSharedBuffer(DASHBOARD_SNAPSHOT);
+        DASHBOARD_SNAPSHOT = NULL;
+    }
+
+    if (EVENT_CLIENT_COUNT > 0) {
+        buffer = newSharedBuffer();
+        appendShared(buffer, "event: tick\ndata: {\"tick\":%llu,\"changes\":[",
+                (unsigned long long) DASHBOARD_TICK);
+    }
+
+    // Keep track of what changed even without dashboards, so that the
+    // deltas always pick up where a new dashboard's snapshot left off.
+    int changeCount = 0;
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        char result = getHistoryChar(&test->mResults, 0);
+        int loss = getLossPercent(test);
+        double rtt = test->mLastRtt;
+
+        if (result != test->mSentResult ||
+                loss != test->mSentLoss ||
+                fabs(rtt - test->mSentRtt) > test->mSentRtt*DASHBOARD_RTT_CHANGE) {
+
+            test->mSentResult = result;
+            test->mSentLoss = loss;
+            test->mSentRtt = rtt;
+            if (buffer != NULL) {
+                appendShared(buffer, "%s[%d,\"%c\",%d,%.1f]",
+                        changeCount == 0 ? "" : ",", i, result, loss, rtt*1000);
+            }
+            changeCount++;
+        }
+    }
+
+    if (buffer == NULL) {
+        return;
+    }
+    appendShared(buffer, "]}\n\n");
+
+    for (int i = EVENT_CLIENT_COUNT - 1; i >= 0; i--) {
+        struct EventClient *client = EVENT_CLIENTS[i];
+
+        if (client->mBacklog > MAX_VIEWER_BACKLOG) {
+            closeEventClient(client);
+        } else {
+            buffer->mRefCount++;
+            queueEvent(client, buffer);
+            setWatchEvents(client->mFd, POLLIN | POLLOUT);
+        }
+    }
+
+    releaseSharedBuffer(buffer);
+}
+
+// Stop keeping track of an HTTP client.
+void forgetHttpClient(struct HttpClient *client) {
+    for (int i = 0; i < HTTP_CLIENT_COUNT; i++) {
+        if (HTTP_CLIENTS[i] == client) {
+            HTTP_CLIENTS[i] = HTTP_CLIENTS[--HTTP_CLIENT_COUNT];
+            break;
+        }
+    }
+}
+
+// Close an HTTP connection.
+void closeHttpClient(int fd, struct HttpClient *client) {
+    forgetHttpClient(client);
+    unwatchFd(fd);
+    close(fd);
+    free(client->mResponse);
+    free(client);
+}
+
+// Close HTTP connections that have been idle too long.
+void expireHttpClients(void) {
+    double now = getMonotonicTime();
+
+    for (int i = HTTP_CLIENT_COUNT - 1; i >= 0; i--) {
+        struct HttpClient *client = HTTP_CLIENTS[i];
+
+        if (now >= client->mDeadline) {
+            closeHttpClient(client->mFd, client);
+        }
+    }
+}
+
+// Set up the response of an HTTP client, leaving room for "bodyLength" bytes
+// after the headers. Returns where the body goes.
+char *startHttpResponse(struct HttpClient *client, char const *status,
+        char const *contentType, size_t bodyLength) {
+
+    char headers[256];
+    int headersLength = snprintf(headers, sizeof(headers),
+            "HTTP/1.1 %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n"
+            "\r\n", status, contentType, bodyLength);
+
+    client->mResponseLength = headersLength + bodyLength;
+    client->mResponse = (char *) malloc(client->mResponseLength + 1);
+    client->mResponseSent = 0;
+    memcpy(client->mResponse, headers, headersLength);
+
+    return client->mResponse + headersLength;
+}
+
+// Set up a short plain-text response.
+void setHttpTextResponse(struct HttpClient *client, char const *status, char const *text) {
+    strcpy(startHttpResponse(client, status, "text/plain; charset=utf-8", strlen(text)), text);
+}
+
+// Parse the request of an HTTP client and set up its response.
+void respondToHttpRequest(struct HttpClient *client) {
+    char method[16];
+    char path[256];
+
+    if (sscanf(client->mRequest, "%15s %255s", method, path) != 2) {
+        setHttpTextResponse(client, "400 Bad Request", "Bad request\n");
+    } else if (strcmp(method, "GET") != 0) {
+        setHttpTextResponse(client, "405 Method Not Allowed", "Method not allowed\n");
+    } else if (strcmp(path, "/metrics") == 0) {
+        // Only copying here, the samples were serialized when they changed.
+        char extra[4096];
+        formatWriterMetrics(extra, sizeof(extra));
+        size_t extraLength = strlen(extra);
+        formatSelfMetrics(extra + extraLength, sizeof(extra) - extraLength, &SELF_STATS);
+        size_t length = getMetricsLength(TESTS, TEST_COUNT, extra);
+        char *body = startHttpResponse(client, "200 OK",
+                "application/openmetrics-text; version=1.0.0; charset=utf-8", length);
+        copyMetrics(TESTS, TEST_COUNT, extra, body);
+    } else if (strcmp(path, "/") == 0) {
+        strcpy(startHttpResponse(client, "200 OK", "text/html; charset=utf-8",
+                    strlen(DASHBOARD_HTML)), DASHBOARD_HTML);
+    } else if (strcmp(path, "/events") == 0) {
+        client->mEventStream = 1;
+    } else {
+        setHttpTextResponse(client, "404 Not Found", "Not found\n");
+    }
+}
+
+// Read the request of, or write the response to, an HTTP client.
+void handleHttpClient(int fd, short revents, void *data) {
+    struct HttpClient *client = (struct HttpClient *) data;
+
+    if (client->mResponse == NULL) {
+        ssize_t length = read(fd, client->mRequest + client->mRequestLength,
+                HTTP_REQUEST_MAX - 1 - client->mRequestLength);
+        if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (length <= 0) {
+            closeHttpClient(fd, client);
+            return;
+        }
+        client->mDeadline = getMonotonicTime() + HTTP_IDLE_TIMEOUT;
+        client->mRequestLength += length;
+        client->mRequest[client->mRequestLength] = '\0';
+
+        // We don't care about the headers, just that they're complete.
+        if (strstr(client->mRequest, "\r\n\r\n") != NULL) {
+            respondToHttpRequest(client);
+            if (client->mEventStream) {
+                forgetHttpClient(client);
+                unwatchFd(fd);
+                free(client);
+                startEventClient(fd);
+                return;
+            }
+        } else if (client->mRequestLength == HTTP_REQUEST_MAX - 1) {
+            setHttpTextResponse(client, "431 Request Header Fields Too Large",
+                    "Request too large\n");
+        } else {
+            return;
+        }
+        setWatchEvents(fd, POLLOUT);
+    }
+
+    ssize_t length = write(fd, client->mResponse + client->mResponseSent,
+            client->mResponseLength - client->mResponseSent);
+    if (length == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            closeHttpClient(fd, client);
+        }
+        return;
+    }
+    client->mDeadline = getMonotonicTime() + HTTP_IDLE_TIMEOUT;
+    client->mResponseSent += length;
+    if (client->mResponseSent == client->mResponseLength) {
+        closeHttpClient(fd, client);
+    }
+}
+
+// Accept new HTTP connections.
+void acceptHttpClients(int fd, short revents, void *data) {
+    while (1) {
+        int clientFd = accept(fd, NULL, NULL);
+        if (clientFd == -1) {
+            break;
+        }
+        setNonBlocking(clientFd);
+
+        struct HttpClient *client = (struct HttpClient *) calloc(1, sizeof(struct HttpClient));
+        client->mFd = clientFd;
+        client->mDeadline = getMonotonicTime() + HTTP_IDLE_TIMEOUT;
+        HTTP_CLIENTS = (struct HttpClient **) realloc(HTTP_CLIENTS,
+                (HTTP_CLIENT_COUNT + 1)*sizeof(struct HttpClient *));
+        HTTP_CLIENTS[HTTP_CLIENT_COUNT++] = client;
+        watchFd(clientFd, POLLIN, handleHttpClient, client);
+    }
+}
+
+// Start an HTTP server on "port" serving /metrics and the dashboard from the
+// main loop.
+void startHttpServer(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    setNonBlocking(fd);
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(fd, 64) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    watchFd(fd, POLLIN, acceptHttpClients, NULL);
+    SERVING_METRICS = 1;
+}
+
+// Create the shared memory segment "name" (e.g., "/network_diagnosis") for
+// publishing the results of the tests. See results_shm.h.
+void createResultsShm(char const *name, struct Test tests[], int count) {
+    size_t size = sizeof(struct ResultsShmHeader) + count*sizeof(struct ResultsShmRecord);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror(name);
+        exit(1);
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    // Invalidate any previous contents before changing the layout under
+    // existing readers.
+    struct ResultsShmHeader *header = (struct ResultsShmHeader *) p;
+    header->mMagic = 0;
+    atomic_thread_fence(memory_order_release);
+
+    memset(p, 0, size);
+    for (int i = 0; i < count; i++) {
+        struct ResultsShmRecord *record = &header->mRecords[i];
+
+        snprintf(record->mType, sizeof(record->mType), "%s", getLabelForType(tests[i].mTestType));
+        snprintf(record->mAddress, sizeof(record->mAddress), "%s", tests[i].mAddress);
+    }
+    header->mVersion = RESULTS_SHM_VERSION;
+    header->mRecordSize = sizeof(struct ResultsShmRecord);
+    header->mRecordCount = count;
+    atomic_thread_fence(memory_order_release);
+    header->mMagic = RESULTS_SHM_MAGIC;
+
+    RESULTS_SHM = header;
+    RESULTS_SHM_NAME = name;
+    atexit(removeResultsShm);
+    signal(SIGINT, handleFatalSignal);
+    signal(SIGTERM, handleFatalSignal);
+    signal(SIGHUP, handleFatalSignal);
+}
+
+// Publish the latest result of each test in shared memory.
+void publishResults(struct ResultsShmHeader *header, struct Test tests[], int count) {
+    int64_t now = getWallClockMs();
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        struct ResultsShmRecord *record = &header->mRecords[i];
+
+        resultsShmBeginWrite(record);
+        snprintf(record->mErrorFrom, sizeof(record->mErrorFrom), "%s", test->mErrorFrom);
+        record->mSuccessCount = test->mSuccessCount;
+        record->mFailureCount = test->mFailureCount;
+        record->mLastRtt = test->mLastRtt;
+        record->mHistory[record->mTickCount % RESULTS_SHM_HISTORY] =
+            getHistoryChar(&test->mResults, 0);
+        record->mTickCount++;
+        record->mTickTime = now;
+        resultsShmEndWrite(record);
+    }
+
+    atomic_store_explicit(&header->mUpdateTime, now, memory_order_release);
+}
+
+// Size of a checkpoint slot of "count" records, rounded up to its alignment.
+size_t getCheckpointSlotSize(int count) {
+    size_t size = sizeof(struct CheckpointSlot) + count*sizeof(struct CheckpointRecord);
+
+    return (size + CHECKPOINT_SLOT_ALIGN - 1)/CHECKPOINT_SLOT_ALIGN*CHECKPOINT_SLOT_ALIGN;
+}
+
+// Get slot "index" of a mapped checkpoint file.
+struct CheckpointSlot *getCheckpointSlot(struct CheckpointHeader *header, size_t slotSize,
+        int index) {
+
+    return (struct CheckpointSlot *) ((char *) header + CHECKPOINT_SLOT_ALIGN + index*slotSize);
+}
+
+// Checksum of a slot of "count" records.
+uint32_t getCheckpointChecksum(struct CheckpointSlot *slot, int count) {
+    unsigned char const *start = (unsigned char const *) &slot->mRecordCount;
+    unsigned char const *end = (unsigned char const *) &slot->mRecords[count];
+
+    return crc32(0, start, end - start);
+}
+
+// Find the newest valid slot of the checkpoint file mapped at "header"
+// ("size" bytes), or return NULL if there isn't one.
+struct CheckpointSlot *findCheckpointSlot(struct CheckpointHeader *header, size_t size,
+        int *index) {
+
+    if (size < CHECKPOINT_SLOT_ALIGN ||
+            header->mMagic != CHECKPOINT_MAGIC ||
+            header->mVersion != CHECKPOINT_VERSION ||
+            header->mRecordSize != sizeof(struct CheckpointRecord)) {
+
+        return NULL;
+    }
+
+    size_t slotSize = getCheckpointSlotSize(header->mRecordCount);
+    if (size < CHECKPOINT_SLOT_ALIGN + 2*slotSize) {
+        return NULL;
+    }
+
+    struct CheckpointSlot *newest = NULL;
+    for (int i = 0; i < 2; i++) {
+        struct CheckpointSlot *slot = getCheckpointSlot(header, slotSize, i);
+
+        if (slot->mRecordCount == header->mRecordCount &&
+                slot->mChecksum == getCheckpointChecksum(slot, slot->mRecordCount) &&
+                (newest == NULL || slot->mGeneration > newest->mGeneration)) {
+
+            newest = slot;
+            *index = i;
+        }
+    }
+
+    return newest;
+}
+
+// Whether a checkpoint record is of the test.
+int checkpointRecordMatches(struct CheckpointRecord *record, struct Test *test) {
+    return record->mType == test->mTestType &&
+        strncmp(record->mAddress, test->mAddress, sizeof(record->mAddress)) == 0;
+}
+
+// Hash of the identity of a checkpoint record (FNV-1a).
+uint64_t hashCheckpointKey(uint8_t type, char const *address) {
+    uint64_t hash = 14695981039346656037ull;
+
+    hash = (hash ^ type)*1099511628211ull;
+    for (int i = 0; i < (int) sizeof(((struct CheckpointRecord *) NULL)->mAddress) &&
+            address[i] != '\0'; i++) {
+
+        hash = (hash ^ (uint8_t) address[i])*1099511628211ull;
+    }
+
+    return hash;
+}
+
+// Restore the state of a test from its checkpoint record.
+void restoreTest(struct Test *test, struct CheckpointRecord *record) {
+    test->mPaused = record->mPaused;
+    test->mSuccessCount = record->mSuccessCount;
+    test->mFailureCount = record->mFailureCount;
+    memcpy(test->mRttBuckets, record->mRttBuckets, sizeof(test->mRttBuckets));
+    test->mRttSum = record->mRttSum;
+    test->mLastRtt = record->mLastRtt;
+    test->mWindowSuccesses = record->mWindowSuccesses;
+    test->mWindowFailures = record->mWindowFailures;
+    test->mOutageTicks = record->mOutageTicks;
+    memcpy(test->mWindowRttBuckets, record->mWindowRttBuckets, sizeof(test->mWindowRttBuckets));
+    test->mWindowPosition = record->mWindowPosition % LOSS_WINDOW;
+    memset(test->mWindowRttCounts, 0, sizeof(test->mWindowRttCounts));
+    for (int i = 0; i < LOSS_WINDOW; i++) {
+        int b = test->mWindowRttBuckets[i];
+        if (b >= 0 && b <= RTT_BUCKET_COUNT) {
+            test->mWindowRttCounts[b]++;
+        } else {
+            test->mWindowRttBuckets[i] = -1;
+        }
+    }
+
+    test->mResults.mCount = 0;
+    int length = record->mHistoryLength < CHECKPOINT_HISTORY ? record->mHistoryLength :
+        CHECKPOINT_HISTORY;
+    for (int i = 0; i < length; i++) {
+        addToHistory(&test->mResults, record->mHistory[i]);
+    }
+    serializeMetrics(test);
+}
+
+// Restore the state of the tests from the matching records of "slot". The
+// tests are usually the same as when it was written, so each is first
+// checked against the record at its own index; the others are looked up in
+// a hash table of the records, built only if needed.
+void restoreCheckpoint(struct CheckpointSlot *slot, struct Test tests[], int count) {
+    int recordCount = slot->mRecordCount;
+    int *table = NULL;
+    int tableSize = 1;
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        if (i < recordCount && checkpointRecordMatches(&slot->mRecords[i], test)) {
+            restoreTest(test, &slot->mRecords[i]);
+            continue;
+        }
+
+        if (table == NULL) {
+            // Open addressing, at most half full. Entries are record indices
+            // plus one, zero for empty.
+            while (tableSize < 2*recordCount) {
+                tableSize *= 2;
+            }
+            table = (int *) calloc(tableSize, sizeof(int));
+            for (int j = 0; j < recordCount; j++) {
+                struct CheckpointRecord *record = &slot->mRecords[j];
+                uint64_t h = hashCheckpointKey(record->mType, record->mAddress);
+
+                while (table[h & (tableSize - 1)] != 0) {
+                    h++;
+                }
+                table[h & (tableSize - 1)] = j + 1;
+            }
+        }
+
+        uint64_t h = hashCheckpointKey(test->mTestType, test->mAddress);
+        while (table[h & (tableSize - 1)] != 0) {
+            struct CheckpointRecord *record = &slot->mRecords[table[h & (tableSize - 1)] - 1];
+
+            if (checkpointRecordMatches(record, test)) {
+                restoreTest(test, record);
+                break;
+            }
+            h++;
+        }
+    }
+
+    free(table);
+}
+
+// Write the state of all tests to the older slot of the checkpoint file.
+void writeCheckpoint(struct Checkpoint *checkpoint, struct Test tests[], int count) {
+    int index = 1 - checkpoint->mSlot;
+    struct CheckpointSlot *slot = getCheckpointSlot(checkpoint->mHeader,
+            checkpoint->mSlotSize, index);
+
+    // If we die before we're done, the checksum won't match.
+    slot->mRecordCount = count;
+    slot->mGeneration = checkpoint->mGeneration + 1;
+    slot->mTime = getWallClockMs();
+
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        struct CheckpointRecord *record = &slot->mRecords[i];
+
+        memset(record, 0, offsetof(struct CheckpointRecord, mHistory));
+        record->mType = test->mTestType;
+        strncpy(record->mAddress, test->mAddress, sizeof(record->mAddress) - 1);
+        record->mPaused = test->mPaused;
+        record->mSuccessCount = test->mSuccessCount;
+        record->mFailureCount = test->mFailureCount;
+        memcpy(record->mRttBuckets, test->mRttBuckets, sizeof(record->mRttBuckets));
+        record->mRttSum = test->mRttSum;
+        record->mLastRtt = test->mLastRtt;
+        record->mWindowSuccesses = test->mWindowSuccesses;
+        record->mWindowFailures = test->mWindowFailures;
+        record->mOutageTicks = test->mOutageTicks;
+        memcpy(record->mWindowRttBuckets, test->mWindowRttBuckets,
+                sizeof(record->mWindowRttBuckets));
+        record->mWindowPosition = test->mWindowPosition;
+
+        record->mHistoryLength = copyHistory(&test->mResults, record->mHistory,
+                CHECKPOINT_HISTORY);
+    }
+
+    slot->mChecksum = getCheckpointChecksum(slot, count);
+
+    // The page cache survives us being killed, so this is only for crashes
+    // of the whole machine, when the checksum catches whatever didn't make it.
+    msync(slot, checkpoint->mSlotSize, MS_ASYNC);
+
+    checkpoint->mGeneration++;
+    checkpoint->mSlot = index;
+}
+
+// Restore the tests from the checkpoint file at "path", if it has one, and
+// set it up for checkpoints of these tests.
+void openCheckpoint(char const *path, struct Test tests[], int count) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    // Resume from the existing state. It's all in place, so there's nothing
+    // to parse or rebuild beyond copying it back.
+    uint64_t generation = 0;
+    int slotIndex = 1;
+    size_t oldSize = st.st_size;
+    if (oldSize > 0) {
+        void *p = mmap(NULL, oldSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        struct CheckpointSlot *slot = findCheckpointSlot((struct CheckpointHeader *) p,
+                oldSize, &slotIndex);
+        if (slot != NULL) {
+            restoreCheckpoint(slot, tests, count);
+            generation = slot->mGeneration;
+        }
+        munmap(p, oldSize);
+    }
+
+    size_t slotSize = getCheckpointSlotSize(count);
+    size_t size = CHECKPOINT_SLOT_ALIGN + 2*slotSize;
+    struct CheckpointHeader *header = NULL;
+    if (oldSize == size && generation > 0) {
+        header = (struct CheckpointHeader *) mmap(NULL, size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        // New file or different tests. Start over with the restored state.
+        if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+            perror(path);
+            exit(1);
+        }
+        header = (struct CheckpointHeader *) mmap(NULL, size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (header != MAP_FAILED) {
+            header->mMagic = CHECKPOINT_MAGIC;
+            header->mVersion = CHECKPOINT_VERSION;
+            header->mRecordSize = sizeof(struct CheckpointRecord);
+            header->mRecordCount = count;
+        }
+        slotIndex = 1;
+    }
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    CHECKPOINT = (struct Checkpoint *) malloc(sizeof(struct Checkpoint));
+    CHECKPOINT->mHeader = header;
+    CHECKPOINT->mSize = size;
+    CHECKPOINT->mSlotSize = slotSize;
+    CHECKPOINT->mGeneration = generation;
+    CHECKPOINT->mSlot = slotIndex;
+
+    writeCheckpoint(CHECKPOINT, tests, count);
+}
+
+// Append bytes to the queue.
+void queueBytes(struct SendQueue *q, void const *data, size_t length) {
+    if (q->mLength + length > q->mCapacity) {
+        q->mCapacity = (q->mLength + length)*2;
+        q->mData = (char *) realloc(q->mData, q->mCapacity);
+    }
+    memcpy(q->mData + q->mLength, data, length);
+    q->mLength += length;
+}
+
+// Append a byte.
+void queueU8(struct SendQueue *q, uint8_t n) {
+    queueBytes(q, &n, 1);
+}
+
+// Append a 32-bit integer in host order (all our sockets are local).
+void queueU32(struct SendQueue *q, uint32_t n) {
+    queueBytes(q, &n, sizeof(n));
+}
+
+// Append a 64-bit integer in host order.
+void queueU64(struct SendQueue *q, uint64_t n) {
+    queueBytes(q, &n, sizeof(n));
+}
+
+// Append a double in host format.
+void queueDouble(struct SendQueue *q, double x) {
+    queueBytes(q, &x, sizeof(x));
+}
+
+// Append a string of at most 64 KiB prefixed by its length.
+void queueString(struct SendQueue *q, char const *s) {
+    size_t length = strlen(s);
+    uint16_t length16 = length > 0xFFFF ? 0xFFFF : length;
+
+    queueBytes(q, &length16, sizeof(length16));
+    queueBytes(q, s, length16);
+}
+
+// Start a framed message. Returns what to pass to endMessage().
+size_t beginMessage(struct SendQueue *q, uint8_t type) {
+    size_t start = q->mLength;
+
+    queueU32(q, 0);
+    queueU8(q, type);
+
+    return start;
+}
+
+// Fill in the length of a framed message.
+void endMessage(struct SendQueue *q, size_t start) {
+    uint32_t length = q->mLength - start - sizeof(uint32_t);
+
+    memcpy(q->mData + start, &length, sizeof(length));
+}
+
+// Write as much of the queue as the non-blocking "fd" takes. Returns -1 on
+// error, otherwise the number of bytes still queued.
+ssize_t sendQueued(int fd, struct SendQueue *q) {
+    while (q->mSent < q->mLength) {
+        ssize_t length = write(fd, q->mData + q->mSent, q->mLength - q->mSent);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        q->mSent += length;
+    }
+
+    // Compact, usually to empty.
+    memmove(q->mData, q->mData + q->mSent, q->mLength - q->mSent);
+    q->mLength -= q->mSent;
+    q->mSent = 0;
+
+    return q->mLength;
+}
+
+// Read bytes from a message.
+void readBytes(struct MessageReader *r, void *data, size_t length) {
+    if (r->mError || r->mOffset + length > r->mLength) {
+        r->mError = 1;
+        memset(data, 0, length);
+    } else {
+        memcpy(data, r->mData + r->mOffset, length);
+        r->mOffset += length;
+    }
+}
+
+// Read a byte from a message.
+uint8_t readU8(struct MessageReader *r) {
+    uint8_t n;
+
+    readBytes(r, &n, sizeof(n));
+
+    return n;
+}
+
+// Read a 32-bit integer from a message.
+uint32_t readU32(struct MessageReader *r) {
+    uint32_t n;
+
+    readBytes(r, &n, sizeof(n));
+
+    return n;
+}
+
+// Read a 64-bit integer from a message.
+uint64_t readU64(struct MessageReader *r) {
+    uint64_t n;
+
+    readBytes(r, &n, sizeof(n));
+
+    return n;
+}
+
+// Read a double from a message.
+double readDouble(struct MessageReader *r) {
+    double x;
+
+    readBytes(r, &x, sizeof(x));
+
+    return x;
+}
+
+// Read a length-prefixed string from a message into a new allocation.
+char *readString(struct MessageReader *r) {
+    uint16_t length;
+
+    readBytes(r, &length, sizeof(length));
+    if (r->mError || r->mOffset + length > r->mLength) {
+        r->mError = 1;
+        return strdup("");
+    }
+
+    char *s = strndup((char const *) r->mData + r->mOffset, length);
+    r->mOffset += length;
+
+    return s;
+}
+
+// Append the details of a test that can change when it finishes.
+void queueTestDetails(struct SendQueue *q, struct Test *test) {
+    queueString(q, test->mErrorFrom);
+    queueU8(q, test->mHaveNtpResult);
+    queueDouble(q, test->mNtpOffset);
+    queueDouble(q, test->mNtpDelay);
+}
+
+// Read what queueTestDetails() wrote.
+void readTestDetails(struct MessageReader *r, struct Test *test) {
+    char *errorFrom = readString(r);
+
+    strncpy(test->mErrorFrom, errorFrom, sizeof(test->mErrorFrom) - 1);
+    test->mErrorFrom[sizeof(test->mErrorFrom) - 1] = '\0';
+    free(errorFrom);
+    test->mHaveNtpResult = readU8(r);
+    test->mNtpOffset = readDouble(r);
+    test->mNtpDelay = readDouble(r);
+}
+
+// Append a snapshot of all tests for a new viewer.
+void queueSnapshot(struct SendQueue *q, struct Test tests[], int count) {
+    size_t start = beginMessage(q, VIEWER_SNAPSHOT);
+
+    queueU32(q, count);
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+
+        queueU8(q, test->mTestType);
+        queueString(q, test->mAddress);
+        char history[SNAPSHOT_HISTORY + 1];
+        queueString(q, getHistoryString(&test->mResults, history, SNAPSHOT_HISTORY));
+        queueTestDetails(q, test);
+    }
+
+    endMessage(q, start);
+}
+
+// Append the results of the tick that just finished.
+void queueTick(struct SendQueue *q, struct Test tests[], int count) {
+    size_t start = beginMessage(q, VIEWER_TICK);
+
+    queueU32(q, count);
+    for (int i = 0; i < count; i++) {
+        queueU8(q, getHistoryChar(&tests[i].mResults, 0));
+    }
+
+    // Details only change when a test finishes.
+    for (int i = 0; i < count; i++) {
+        if (getHistoryChar(&tests[i].mResults, 0) != WAITING_CHAR) {
+            queueU32(q, i);
+            queueTestDetails(q, &tests[i]);
+        }
+    }
+
+    endMessage(q, start);
+}
+
+// Disconnect a viewer.
+void closeViewer(struct Viewer *viewer) {
+    for (int i = 0; i < VIEWER_COUNT; i++) {
+        if (VIEWERS[i] == viewer) {
+            VIEWERS[i] = VIEWERS[--VIEWER_COUNT];
+            break;
+        }
+    }
+
+    unwatchFd(viewer->mFd);
+    close(viewer->mFd);
+    free(viewer->mQueue.mData);
+    free(viewer);
+}
+
+// Send queued updates to a viewer, and notice when it hangs up.
+void handleViewer(int fd, short revents, void *data) {
+    struct Viewer *viewer = (struct Viewer *) data;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        // Viewers don't send us anything, so this is EOF or an error.
+        char buffer[256];
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == 0 || (length == -1 && errno != EAGAIN && errno != EINTR)) {
+            closeViewer(viewer);
+            return;
+        }
+    }
+
+    ssize_t remaining = sendQueued(fd, &viewer->mQueue);
+    if (remaining == -1) {
+        closeViewer(viewer);
+    } else {
+        setWatchEvents(fd, remaining > 0 ? POLLIN | POLLOUT : POLLIN);
+    }
+}
+
+// Accept new viewers and queue a snapshot for each.
+void acceptViewers(int fd, short revents, void *data) {
+    while (1) {
+        int viewerFd = accept(fd, NULL, NULL);
+        if (viewerFd == -1) {
+            break;
+        }
+        setNonBlocking(viewerFd);
+
+        struct Viewer *viewer = (struct Viewer *) calloc(1, sizeof(struct Viewer));
+        viewer->mFd = viewerFd;
+        queueSnapshot(&viewer->mQueue, TESTS, TEST_COUNT);
+
+        VIEWERS = (struct Viewer **) realloc(VIEWERS, (VIEWER_COUNT + 1)*sizeof(struct Viewer *));
+        VIEWERS[VIEWER_COUNT++] = viewer;
+        watchFd(viewerFd, POLLIN | POLLOUT, handleViewer, viewer);
+    }
+}
+
+// Queue the tick that just finished for all viewers. Viewers that have
+// fallen too far behind are disconnected rather than slowing us down.
+void broadcastTick(struct Test tests[], int count) {
+    if (VIEWER_COUNT == 0) {
+        return;
+    }
+
+    // Serialize once for everyone.
+    struct SendQueue message = { NULL, 0, 0, 0 };
+    queueTick(&message, tests, count);
+
+    for (int i = VIEWER_COUNT - 1; i >= 0; i--) {
+        struct Viewer *viewer = VIEWERS[i];
+
+        if (viewer->mQueue.mLength > MAX_VIEWER_BACKLOG) {
+            closeViewer(viewer);
+        } else {
+            queueBytes(&viewer->mQueue, message.mData, message.mLength);
+            setWatchEvents(viewer->mFd, POLLIN | POLLOUT);
+        }
+    }
+
+    free(message.mData);
+}
+
+// Fill in a Unix domain socket address for "path".
+void makeUnixAddress(struct sockaddr_un *addr, char const *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+// Listen on the Unix domain socket "path", replacing any stale one, and have
+// the main loop call "handler" when connections come in.
+void startUnixServer(char const *path, WatchHandler handler) {
+    struct sockaddr_un addr;
+    makeUnixAddress(&addr, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    setNonBlocking(fd);
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    if (listen(fd, 16) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    watchFd(fd, POLLIN, handler, NULL);
+}
+
+// Connect to the Unix domain socket "path", exiting on failure.
+int connectUnix(char const *path) {
+    struct sockaddr_un addr;
+    makeUnixAddress(&addr, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Detach from the terminal so that we keep running after it goes away.
+void detach() {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid != 0) {
+        // Not exit(), whose handlers would clean up after the child.
+        fflush(NULL);
+        _exit(0);
+    }
+
+    setsid();
+
+    int fd = open("/dev/null", O_RDWR);
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+// Apply a message from the daemon to the viewer's copy of the tests.
+void handleViewerMessage(struct MessageReader *r, struct Test **tests, int *count) {
+    uint8_t type = readU8(r);
+
+    switch (type) {
+        case VIEWER_SNAPSHOT: {
+            for (int i = 0; i < *count; i++) {
+                free((*tests)[i].mAddress);
+                free((*tests)[i].mResults.mData);
+            }
+            *count = readU32(r);
+            *tests = (struct Test *) realloc(*tests, *count*sizeof(struct Test));
+            memset(*tests, 0, *count*sizeof(struct Test));
+
+            for (int i = 0; i < *count; i++) {
+                struct Test *test = &(*tests)[i];
+
+                test->mTestType = (enum TestType) readU8(r);
+                test->mAddress = readString(r);
+                char *history = readString(r);
+                startHistory(&test->mResults);
+                for (char const *c = history; *c != '\0'; c++) {
+                    addToHistory(&test->mResults, *c);
+                }
+                free(history);
+                readTestDetails(r, test);
+            }
+            break;
+        }
+
+        case VIEWER_TICK: {
+            if (readU32(r) != (uint32_t) *count) {
+                r->mError = 1;
+                break;
+            }
+            for (int i = 0; i < *count; i++) {
+                addToHistory(&(*tests)[i].mResults, readU8(r));
+            }
+            while (!r->mError && r->mOffset < r->mLength) {
+                uint32_t i = readU32(r);
+                if (i >= (uint32_t) *count) {
+                    r->mError = 1;
+                    break;
+                }
+                readTestDetails(r, &(*tests)[i]);
+            }
+            break;
+        }
+
+        default:
+            // Newer daemon, ignore.
+            break;
+    }
+}
+
+// Attach to the daemon at "path" and draw its results until it goes away.
+void runViewer(char const *path) {
+    int fd = connectUnix(path);
+
+    struct Test *tests = NULL;
+    int count = 0;
+    struct SendQueue input = { NULL, 0, 0, 0 };
+    struct TestTable table = { NULL, 0, 0, 0, NULL };
+    struct Renderer *renderer = startRenderer(&VIEWPORT, &table);
+    int keyboard = isatty(STDOUT_FILENO) && startKeyboard(&VIEWPORT);
+
+    while (1) {
+        struct pollfd fds[3] = {
+            { fd, POLLIN, 0 },
+            { renderer->mFd, renderer->mFrameSent < renderer->mFrameLength ? POLLOUT : 0, 0 },
+            { STDIN_FILENO, POLLIN, 0 },
+        };
+        int timeout = -1;
+        if (renderer->mDirty) {
+            double frame = renderer->mNextFrameTime - getMonotonicTime();
+            timeout = frame > 0 ? (int) (frame*1000) + 1 : 0;
+        }
+        int ready = poll(fds, keyboard ? 3 : 2, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (ready > 0 && fds[1].revents != 0) {
+            sendFrame(renderer);
+        }
+        if (ready > 0 && keyboard && fds[2].revents != 0) {
+            handleKeyboard(STDIN_FILENO, fds[2].revents, renderer);
+        }
+        renderFrame(renderer);
+        if (ready <= 0 || fds[0].revents == 0) {
+            continue;
+        }
+
+        char buffer[65536];
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            break;
+        }
+        queueBytes(&input, buffer, length);
+
+        // Handle all complete messages.
+        int changed = 0;
+        size_t offset = 0;
+        while (input.mLength - offset >= sizeof(uint32_t)) {
+            uint32_t messageLength;
+            memcpy(&messageLength, input.mData + offset, sizeof(messageLength));
+            if (input.mLength - offset - sizeof(uint32_t) < messageLength) {
+                break;
+            }
+
+            struct MessageReader r = {
+                (uint8_t const *) input.mData + offset + sizeof(uint32_t), messageLength, 0, 0,
+            };
+            handleViewerMessage(&r, &tests, &count);
+            if (r.mError) {
+                fprintf(stderr, "Bad message from daemon.\n");
+                exit(1);
+            }
+            offset += sizeof(uint32_t) + messageLength;
+            changed = 1;
+        }
+        memmove(input.mData, input.mData + offset, input.mLength - offset);
+        input.mLength -= offset;
+
+        if (changed) {
+            table.mTests = tests;
+            table.mCount = count;
+            table.mMaxWidth = getMaxWidth(tests, count);
+            requestFrame(renderer);
+            renderFrame(renderer);
+        }
+    }
+
+    fprintf(stderr, "Daemon went away.\n");
+    close(fd);
+}
+
+// Whether the test matches a control pattern.
+int testMatches(struct Test *test, char const *pattern) {
+    return strcmp(pattern, "*") == 0 ||
+        strcmp(pattern, test->mAddress) == 0 ||
+        strcasecmp(pattern, getLabelForType(test->mTestType)) == 0 ||
+        (test->mGroup != NULL && strcasecmp(pattern, test->mGroup) == 0);
+}
+
+// Carry out a control request, queueing the response.
+void handleControlRequest(struct MessageReader *r, struct SendQueue *q) {
+    uint8_t type = readU8(r);
+    char *pattern = readString(r);
+
+    if (r->mError || type < CONTROL_QUERY || type > CONTROL_EXPAND) {
+        size_t start = beginMessage(q, CONTROL_BAD_REQUEST);
+        endMessage(q, start);
+        free(pattern);
+        return;
+    }
+
+    int matches = 0;
+    for (int i = 0; i < TEST_COUNT; i++) {
+        matches += testMatches(&TESTS[i], pattern);
+    }
+
+    size_t start = beginMessage(q, matches == 0 ? CONTROL_NOT_FOUND : CONTROL_OK);
+    queueU32(q, matches);
+
+    // Bound the response, however many tests there are.
+    int included = 0;
+    if (type == CONTROL_QUERY && matches > 0) {
+        included = matches < CONTROL_QUERY_MAX ? matches : CONTROL_QUERY_MAX;
+        queueU32(q, included);
+    }
+
+    for (int i = 0; i < TEST_COUNT; i++) {
+        struct Test *test = &TESTS[i];
+
+        if (!testMatches(test, pattern)) {
+            continue;
+        }
+
+        switch (type) {
+            case CONTROL_QUERY: {
+                if (included == 0) {
+                    break;
+                }
+                included--;
+                int windowCount = test->mWindowSuccesses + test->mWindowFailures;
+
+                queueU8(q, test->mTestType);
+                queueString(q, test->mAddress);
+                queueU8(q, getHistoryChar(&test->mResults, 0));
+                queueU8(q, test->mPaused);
+                queueU64(q, test->mSuccessCount);
+                queueU64(q, test->mFailureCount);
+                queueDouble(q, test->mLastRtt);
+                queueDouble(q, windowCount == 0 ? 0 :
+                        (double) test->mWindowFailures/windowCount);
+                queueString(q, test->mErrorFrom);
+                break;
+            }
+
+            case CONTROL_PROBE:
+                if (!isTestRunning(test)) {
+                    startTest(test);
+                }
+                break;
+
+            case CONTROL_PAUSE:
+                test->mPaused = 1;
+                break;
+
+            case CONTROL_RESUME:
+                test->mPaused = 0;
+                break;
+
+            case CONTROL_COLLAPSE:
+            case CONTROL_EXPAND:
+                if (GROUPS != NULL) {
+                    GROUPS[test->mGroupIndex].mCollapsed = type == CONTROL_COLLAPSE;
+                }
+                if (RENDERER != NULL) {
+                    requestFrame(RENDERER);
+                }
+                break;
+        }
+    }
+
+    endMessage(q, start);
+    free(pattern);
+}
+
+// Disconnect a control client.
+void closeControlClient(struct ControlClient *client) {
+    unwatchFd(client->mFd);
+    close(client->mFd);
+    free(client->mInput.mData);
+    free(client->mOutput.mData);
+    free(client);
+}
+
+// Handle the client's complete buffered requests until its responses pile
+// up. Returns the number handled, or -1 if the client sent a bad request.
+int handleControlRequests(struct ControlClient *client) {
+    struct SendQueue *input = &client->mInput;
+    size_t offset = 0;
+    int handled = 0;
+
+    while (input->mLength - offset >= sizeof(uint32_t) &&
+            client->mOutput.mLength < CONTROL_OUTPUT_MAX) {
+
+        uint32_t requestLength;
+        memcpy(&requestLength, input->mData + offset, sizeof(requestLength));
+        if (requestLength > CONTROL_REQUEST_MAX) {
+            return -1;
+        }
+        if (input->mLength - offset - sizeof(uint32_t) < requestLength) {
+            break;
+        }
+
+        struct MessageReader r = {
+            (uint8_t const *) input->mData + offset + sizeof(uint32_t), requestLength, 0, 0,
+        };
+        handleControlRequest(&r, &client->mOutput);
+        offset += sizeof(uint32_t) + requestLength;
+        handled++;
+    }
+    memmove(input->mData, input->mData + offset, input->mLength - offset);
+    input->mLength -= offset;
+
+    return handled;
+}
+
+// Read requests from, and write responses to, a control client.
+void handleControlClient(int fd, short revents, void *data) {
+    struct ControlClient *client = (struct ControlClient *) data;
+
+    // Stop reading while responses pile up, so a client that doesn't read
+    // them can't make us use unbounded memory.
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+            client->mOutput.mLength < CONTROL_OUTPUT_MAX) {
+
+        char buffer[4096];
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == 0 || (length == -1 && errno != EAGAIN && errno != EINTR)) {
+            closeControlClient(client);
+            return;
+        }
+        if (length > 0) {
+            queueBytes(&client->mInput, buffer, length);
+        }
+    }
+
+    // Send responses and handle requests. Requests left waiting because the
+    // responses piled up are handled as soon as sending drains them, without
+    // waiting for the client to send more.
+    ssize_t remaining = sendQueued(fd, &client->mOutput);
+    while (remaining != -1 && remaining < CONTROL_OUTPUT_MAX) {
+        int handled = handleControlRequests(client);
+        if (handled == -1) {
+            closeControlClient(client);
+            return;
+        }
+        if (handled == 0) {
+            break;
+        }
+        remaining = sendQueued(fd, &client->mOutput);
+    }
+    if (remaining == -1) {
+        closeControlClient(client);
+        return;
+    }
+
+    short events = remaining > 0 ? POLLOUT : 0;
+    if (remaining < CONTROL_OUTPUT_MAX) {
+        events |= POLLIN;
+    }
+    setWatchEvents(fd, events);
+}
+
+// Accept new control clients.
+void acceptControlClients(int fd, short revents, void *data) {
+    while (1) {
+        int clientFd = accept(fd, NULL, NULL);
+        if (clientFd == -1) {
+            break;
+        }
+        setNonBlocking(clientFd);
+
+        struct ControlClient *client = (struct ControlClient *) calloc(1, sizeof(struct ControlClient));
+        client->mFd = clientFd;
+        watchFd(clientFd, POLLIN, handleControlClient, client);
+    }
+}
+
+// Read exactly "length" bytes from the blocking "fd", exiting if the
+// connection closes.
+void readFully(int fd, void *data, size_t length) {
+    size_t have = 0;
+
+    while (have < length) {
+        ssize_t n = read(fd, (char *) data + have, length - have);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Connection closed.\n");
+            exit(1);
+        }
+        have += n;
+    }
+}
+
+// Read one framed message from the blocking "fd" into "q", replacing its
+// contents.
+void readMessage(int fd, struct SendQueue *q) {
+    uint32_t length;
+
+    readFully(fd, &length, sizeof(length));
+    q->mLength = 0;
+    if (length > q->mCapacity) {
+        q->mCapacity = length;
+        q->mData = (char *) realloc(q->mData, q->mCapacity);
+    }
+    readFully(fd, q->mData, length);
+    q->mLength = length;
+}
+
+// Make a control request over the blocking "fd" and wait for the response.
+void makeControlRequest(int fd, uint8_t type, char const *pattern, struct SendQueue *response) {
+    struct SendQueue request = { NULL, 0, 0, 0 };
+
+    size_t start = beginMessage(&request, type);
+    queueString(&request, pattern);
+    endMessage(&request, start);
+    if (write(fd, request.mData, request.mLength) != (ssize_t) request.mLength) {
+        perror("write");
+        exit(1);
+    }
+    free(request.mData);
+
+    readMessage(fd, response);
+}
+
+// Compare doubles for qsort().
+int compareDoubles(void const *a, void const *b) {
+    double x = *(double const *) a;
+    double y = *(double const *) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Run a control command ("query", "probe", "pause", "resume", "collapse",
+// "expand", or "bench") against the instance serving "path", printing the
+// result. Returns the exit status.
+int runControlCommand(char const *path, char const *command, char const *pattern) {
+    static char const *COMMANDS[] = { "query", "probe", "pause", "resume", "collapse", "expand" };
+    int fd = connectUnix(path);
+    struct SendQueue response = { NULL, 0, 0, 0 };
+
+    if (strcmp(command, "bench") == 0) {
+        // Round-trip latency of sequential queries.
+        double *latencies = (double *) malloc(CONTROL_BENCH_QUERIES*sizeof(double));
+        double start = getMonotonicTime();
+        for (int i = 0; i < CONTROL_BENCH_QUERIES; i++) {
+            double before = getMonotonicTime();
+            makeControlRequest(fd, CONTROL_QUERY, pattern, &response);
+            latencies[i] = getMonotonicTime() - before;
+        }
+        double elapsed = getMonotonicTime() - start;
+
+        qsort(latencies, CONTROL_BENCH_QUERIES, sizeof(double), compareDoubles);
+        printf("%d queries in %.3f s: %.0f queries/s, latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                CONTROL_BENCH_QUERIES, elapsed, CONTROL_BENCH_QUERIES/elapsed,
+                latencies[CONTROL_BENCH_QUERIES/2]*1e6,
+                latencies[CONTROL_BENCH_QUERIES*99/100]*1e6,
+                latencies[CONTROL_BENCH_QUERIES - 1]*1e6);
+        free(latencies);
+        return 0;
+    }
+
+    int type = 0;
+    for (int i = 0; i < (int) (sizeof(COMMANDS)/sizeof(COMMANDS[0])); i++) {
+        if (strcmp(command, COMMANDS[i]) == 0) {
+            type = CONTROL_QUERY + i;
+        }
+    }
+    if (type == 0) {
+        fprintf(stderr, "Unknown command: %s\n", command);
+        return 1;
+    }
+
+    makeControlRequest(fd, type, pattern, &response);
+
+    struct MessageReader r = { (uint8_t const *) response.mData, response.mLength, 0, 0 };
+    uint8_t status = readU8(&r);
+    if (status == CONTROL_BAD_REQUEST) {
+        fprintf(stderr, "Bad request.\n");
+        return 1;
+    }
+    uint32_t count = readU32(&r);
+    if (status == CONTROL_NOT_FOUND) {
+        fprintf(stderr, "No tests match %s\n", pattern);
+        return 1;
+    }
+
+    if (type == CONTROL_QUERY) {
+        uint32_t included = readU32(&r);
+        for (uint32_t i = 0; i < included && !r.mError; i++) {
+            struct Test test;
+
+            memset(&test, 0, sizeof(test));
+            test.mTestType = (enum TestType) readU8(&r);
+            char *address = readString(&r);
+            char last = readU8(&r);
+            int paused = readU8(&r);
+            uint64_t successes = readU64(&r);
+            uint64_t failures = readU64(&r);
+            double rtt = readDouble(&r);
+            double loss = readDouble(&r);
+            char *errorFrom = readString(&r);
+
+            printf("%s %s: last=%s paused=%d success=%llu failure=%llu rtt=%.6f loss=%.3f",
+                    getLabelForType(test.mTestType), address, getResultName(last), paused,
+                    (unsigned long long) successes, (unsigned long long) failures,
+                    rtt, loss);
+            if (errorFrom[0] != '\0') {
+                printf(" from=%s", errorFrom);
+            }
+            printf("\n");
+            free(address);
+            free(errorFrom);
+        }
+        if (included < count) {
+            printf("(%u more)\n", count - included);
+        }
+    } else {
+        printf("%u tests\n", count);
+    }
+
+    free(response.mData);
+    close(fd);
+
+    return r.mError ? 1 : 0;
+}
+
+// Append an unsigned variable-length integer.
+void queueVarint(struct SendQueue *q, uint64_t n) {
+    uint8_t bytes[10];
+    int count = 0;
+
+    do {
+        bytes[count] = n & 0x7F;
+        n >>= 7;
+        if (n != 0) {
+            bytes[count] |= 0x80;
+        }
+        count++;
+    } while (n != 0);
+
+    queueBytes(q, bytes, count);
+}
+
+// Append a signed variable-length integer.
+void queueSignedVarint(struct SendQueue *q, int64_t n) {
+    queueVarint(q, ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+}
+
+// Append a string prefixed by its variable-length length.
+void queueVarString(struct SendQueue *q, char const *s) {
+    size_t length = strlen(s);
+
+    queueVarint(q, length);
+    queueBytes(q, s, length);
+}
+
+// Read an unsigned variable-length integer.
+uint64_t readVarint(struct MessageReader *r) {
+    uint64_t n = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readU8(r);
+        n |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return n;
+        }
+    }
+
+    r->mError = 1;
+    return 0;
+}
+
+// Read a signed variable-length integer.
+int64_t readSignedVarint(struct MessageReader *r) {
+    uint64_t n = readVarint(r);
+
+    return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+// Read a string prefixed by its variable-length length into a new allocation.
+char *readVarString(struct MessageReader *r) {
+    uint64_t length = readVarint(r);
+
+    if (r->mError || length > r->mLength - r->mOffset) {
+        r->mError = 1;
+        return strdup("");
+    }
+
+    char *s = strndup((char const *) r->mData + r->mOffset, length);
+    r->mOffset += length;
+
+    return s;
+}
+
+// Call "handler" with each complete framed message at the start of "input",
+// then remove them. Stops early if the handler returns 0. Returns 0 if a
+// message is larger than "maxLength".
+int forEachMessage(struct SendQueue *input, uint32_t maxLength,
+        int (*handler)(struct MessageReader *r, void *data), void *data) {
+
+    size_t offset = 0;
+    int ok = 1;
+
+    while (input->mLength - offset >= sizeof(uint32_t)) {
+        uint32_t length;
+        memcpy(&length, input->mData + offset, sizeof(length));
+        if (length > maxLength) {
+            ok = 0;
+            break;
+        }
+        if (input->mLength - offset - sizeof(uint32_t) < length) {
+            break;
+        }
+
+        struct MessageReader r = {
+            (uint8_t const *) input->mData + offset + sizeof(uint32_t), length, 0, 0,
+        };
+        offset += sizeof(uint32_t) + length;
+        if (!handler(&r, data)) {
+            ok = 0;
+            break;
+        }
+    }
+
+    memmove(input->mData, input->mData + offset, input->mLength - offset);
+    input->mLength -= offset;
+
+    return ok;
+}
+
+// Read what's available on the non-blocking "fd" into "input". Returns 0 if
+// the connection closed or failed.
+int readAvailable(int fd, struct SendQueue *input) {
+    char buffer[65536];
+
+    while (1) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        if (length == 0) {
+            return 0;
+        }
+        queueBytes(input, buffer, length);
+    }
+}
+
+// Queue an AGENT_BATCH message for a pending batch.
+void queueAgentBatch(struct AgentLink *link, struct AgentBatch *batch) {
+    size_t start = beginMessage(&link->mOutput, AGENT_BATCH);
+
+    queueVarint(&link->mOutput, batch->mSequence);
+    queueSignedVarint(&link->mOutput, batch->mTime - link->mLastSentTime);
+    queueBytes(&link->mOutput, batch->mResults.mData, batch->mResults.mLength);
+    link->mLastSentTime = batch->mTime;
+
+    endMessage(&link->mOutput, start);
+}
+
+// Queue the hello and all pending batches on a new connection.
+void queueAgentHello(struct AgentLink *link, struct Test tests[], int count) {
+    link->mOutput.mLength = 0;
+    link->mOutput.mSent = 0;
+    link->mLastSentTime = 0;
+
+    size_t start = beginMessage(&link->mOutput, AGENT_HELLO);
+    queueVarint(&link->mOutput, AGENT_PROTOCOL_VERSION);
+    queueVarString(&link->mOutput, link->mName);
+    queueVarint(&link->mOutput, link->mSession);
+    queueVarint(&link->mOutput, count);
+    for (int i = 0; i < count; i++) {
+        queueU8(&link->mOutput, tests[i].mTestType);
+        queueVarString(&link->mOutput, tests[i].mAddress);
+    }
+    endMessage(&link->mOutput, start);
+
+    for (int i = 0; i < link->mPendingCount; i++) {
+        queueAgentBatch(link, &link->mPending[i]);
+    }
+}
+
+// Drop the connection to the collector and try again later. Pending batches
+// are kept and resent. If we never got connected, the collector's next address
+// is tried at the next tick, and once they've all failed we wait.
+void disconnectAgent(struct AgentLink *link) {
+    if (link->mFd != -1) {
+        unwatchFd(link->mFd);
+        close(link->mFd);
+        link->mFd = -1;
+    }
+    link->mInput.mLength = 0;
+
+    link->mNextAddress = link->mConnecting ? link->mNextAddress->ai_next : NULL;
+    link->mConnecting = 0;
+    if (link->mNextAddress != NULL) {
+        link->mReconnectTime = 0;
+    } else {
+        link->mNextAddress = link->mAddresses;
+        link->mReconnectTime = getMonotonicTime() + AGENT_RECONNECT_DELAY;
+    }
+}
+
+// Forget pending batches that the collector has acknowledged.
+int handleAgentAck(struct MessageReader *r, void *data) {
+    struct AgentLink *link = (struct AgentLink *) data;
+
+    if (readU8(r) != AGENT_ACK) {
+        return 0;
+    }
+    uint64_t sequence = readVarint(r);
+    if (r->mError) {
+        return 0;
+    }
+
+    int acked = 0;
+    while (acked < link->mPendingCount && link->mPending[acked].mSequence <= sequence) {
+        free(link->mPending[acked].mResults.mData);
+        acked++;
+    }
+    memmove(link->mPending, link->mPending + acked,
+            (link->mPendingCount - acked)*sizeof(struct AgentBatch));
+    link->mPendingCount -= acked;
+
+    return 1;
+}
+
+// Finish connecting to, read acknowledgements from, and send batches to the
+// collector.
+void handleAgentLink(int fd, short revents, void *data) {
+    struct AgentLink *link = (struct AgentLink *) data;
+
+    if (link->mConnecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            disconnectAgent(link);
+            return;
+        }
+        link->mConnecting = 0;
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (!readAvailable(fd, &link->mInput) ||
+                !forEachMessage(&link->mInput, AGENT_MESSAGE_MAX, handleAgentAck, link)) {
+
+            disconnectAgent(link);
+            return;
+        }
+    }
+
+    ssize_t remaining = sendQueued(fd, &link->mOutput);
+    if (remaining == -1) {
+        disconnectAgent(link);
+    } else {
+        setWatchEvents(fd, remaining > 0 ? POLLIN | POLLOUT : POLLIN);
+    }
+}
+
+// Start connecting to the collector if it's time.
+void connectAgent(struct AgentLink *link, struct Test tests[], int count) {
+    if (link->mFd != -1 || getMonotonicTime() < link->mReconnectTime) {
+        return;
+    }
+
+    struct addrinfo *address = link->mNextAddress;
+    int fd = socket(address->ai_family, SOCK_STREAM, 0);
+    link->mConnecting = 1;
+    if (fd != -1) {
+        setNonBlocking(fd);
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == -1 &&
+                errno != EINPROGRESS) {
+
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        disconnectAgent(link);
+        return;
+    }
+
+    link->mFd = fd;
+    queueAgentHello(link, tests, count);
+    watchFd(fd, POLLIN | POLLOUT, handleAgentLink, link);
+}
+
+// Set up streaming results to the collector at "address" ("host:port").
+void startAgent(char const *address, char const *name) {
+    char const *colon = strrchr(address, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "Collector address must be host:port\n");
+        exit(1);
+    }
+
+    char *host = strndup(address, colon - address);
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &addresses) != 0) {
+        fprintf(stderr, "Can't resolve %s\n", host);
+        exit(1);
+    }
+    free(host);
+
+    struct AgentLink *link = (struct AgentLink *) calloc(1, sizeof(struct AgentLink));
+    link->mAddresses = addresses;
+    link->mNextAddress = addresses;
+    link->mSession = getWallClockMs();
+    link->mFd = -1;
+    link->mNextSequence = 1;
+
+    if (name != NULL) {
+        link->mName = strdup(name);
+    } else {
+        char hostname[256];
+        gethostname(hostname, sizeof(hostname));
+        hostname[sizeof(hostname) - 1] = '\0';
+        link->mName = strdup(hostname);
+    }
+
+    AGENT_LINK = link;
+}
+
+// Record the tick that just finished as a batch for the collector, and send
+// it if we're connected.
+void sendAgentBatch(struct AgentLink *link, struct Test tests[], int count) {
+    if (link->mPendingCount == AGENT_MAX_PENDING) {
+        // Collector has been away too long, drop the oldest.
+        free(link->mPending[0].mResults.mData);
+        memmove(link->mPending, link->mPending + 1,
+                (link->mPendingCount - 1)*sizeof(struct AgentBatch));
+        link->mPendingCount--;
+        link->mDroppedCount++;
+    }
+
+    link->mPending = (struct AgentBatch *) realloc(link->mPending,
+            (link->mPendingCount + 1)*sizeof(struct AgentBatch));
+    struct AgentBatch *batch = &link->mPending[link->mPendingCount++];
+    memset(batch, 0, sizeof(*batch));
+    batch->mSequence = link->mNextSequence++;
+    batch->mTime = getWallClockMs();
+
+    int resultCount = 0;
+    for (int i = 0; i < count; i++) {
+        resultCount += getHistoryChar(&tests[i].mResults, 0) != WAITING_CHAR;
+    }
+    queueVarint(&batch->mResults, resultCount);
+
+    int previous = 0;
+    for (int i = 0; i < count; i++) {
+        struct Test *test = &tests[i];
+        char c = getHistoryChar(&test->mResults, 0);
+
+        if (c != WAITING_CHAR) {
+            queueVarint(&batch->mResults, i - previous);
+            queueU8(&batch->mResults, c);
+            if (isSuccessChar(c)) {
+                queueVarint(&batch->mResults, (uint64_t) (test->mLastRtt*1e6));
+            }
+            previous = i;
+        }
+    }
+
+    if (link->mFd != -1) {
+        queueAgentBatch(link, batch);
+        setWatchEvents(link->mFd, POLLIN | POLLOUT);
+    } else {
+        connectAgent(link, tests, count);
+    }
+}
+
+// Hash of the key of a record in the collector's store (FNV-1a).
+uint64_t hashRecordKey(char const *agentName, enum TestType testType, char const *address) {
+    uint64_t hash = 14695981039346656037ull;
+    char type = testType;
+
+    for (char const *p = agentName; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t) *p)*1099511628211ull;
+    }
+    hash = (hash ^ (uint8_t) type)*1099511628211ull;
+    for (char const *p = address; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t) *p)*1099511628211ull;
+    }
+
+    return hash;
+}
+
+// Set up the collector's store.
+void initializeStore() {
+    for (int i = 0; i < STORE_SHARD_COUNT; i++) {
+        pthread_mutex_init(&STORE[i].mLock, NULL);
+    }
+}
+
+// Insert a record into the index of a shard, which must have room.
+void indexRecord(struct StoreShard *shard, struct StoreRecord *record) {
+    size_t mask = shard->mIndexCapacity - 1;
+    size_t slot = (record->mHash/STORE_SHARD_COUNT) & mask;
+
+    while (shard->mIndex[slot] != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    shard->mIndex[slot] = record;
+}
+
+// Find the record of an agent's test in the store, adding it if it's new.
+// Returns NULL if the shard is full.
+struct StoreRecord *findRecord(struct Agent *agent, enum TestType testType, char const *address) {
+    uint64_t hash = hashRecordKey(agent->mName, testType, address);
+    struct StoreShard *shard = &STORE[hash % STORE_SHARD_COUNT];
+    struct StoreRecord *record = NULL;
+
+    pthread_mutex_lock(&shard->mLock);
+
+    // Look it up.
+    if (shard->mIndexCapacity > 0) {
+        size_t mask = shard->mIndexCapacity - 1;
+        for (size_t slot = (hash/STORE_SHARD_COUNT) & mask; shard->mIndex[slot] != NULL;
+                slot = (slot + 1) & mask) {
+
+            struct StoreRecord *r = shard->mIndex[slot];
+            if (r->mHash == hash && r->mAgent == agent && r->mTestType == testType &&
+                    strcmp(r->mAddress, address) == 0) {
+
+                record = r;
+                break;
+            }
+        }
+    }
+
+    size_t count = atomic_load_explicit(&shard->mCount, memory_order_relaxed);
+    if (record == NULL && count < STORE_MAX_CHUNKS*STORE_CHUNK_SIZE) {
+        // Keep the index at most half full.
+        if ((count + 1)*2 > shard->mIndexCapacity) {
+            struct StoreRecord **oldIndex = shard->mIndex;
+            size_t oldCapacity = shard->mIndexCapacity;
+
+            shard->mIndexCapacity = oldCapacity == 0 ? 64 : oldCapacity*2;
+            shard->mIndex = (struct StoreRecord **) calloc(shard->mIndexCapacity,
+                    sizeof(struct StoreRecord *));
+            for (size_t i = 0; i < oldCapacity; i++) {
+                if (oldIndex[i] != NULL) {
+                    indexRecord(shard, oldIndex[i]);
+                }
+            }
+            free(oldIndex);
+        }
+
+        struct StoreRecord *chunk = atomic_load_explicit(
+                &shard->mChunks[count/STORE_CHUNK_SIZE], memory_order_relaxed);
+        if (chunk == NULL) {
+            chunk = (struct StoreRecord *) calloc(STORE_CHUNK_SIZE, sizeof(struct StoreRecord));
+            atomic_store_explicit(&shard->mChunks[count/STORE_CHUNK_SIZE], chunk,
+                    memory_order_release);
+        }
+
+        record = &chunk[count % STORE_CHUNK_SIZE];
+        record->mHash = hash;
+        record->mAgent = agent;
+        record->mTestType = testType;
+        record->mAddress = strdup(address);
+        snprintf(record->mShared.mType, sizeof(record->mShared.mType), "%s",
+                getLabelForType(testType));
+        snprintf(record->mShared.mAddress, sizeof(record->mShared.mAddress),
+                "%s:%s", agent->mName, address);
+        indexRecord(shard, record);
+
+        // Readers may see it now.
+        atomic_store_explicit(&shard->mCount, count + 1, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&shard->mLock);
+
+    return record;
+}
+
+// Call "callback" with a consistent copy of each record in the store. Never
+// blocks the ingest threads.
+void forEachRecord(void (*callback)(struct ResultsShmRecord *record, void *data), void *data) {
+    for (int i = 0; i < STORE_SHARD_COUNT; i++) {
+        struct StoreShard *shard = &STORE[i];
+        size_t count = atomic_load_explicit(&shard->mCount, memory_order_acquire);
+
+        for (size_t j = 0; j < count; j++) {
+            struct StoreRecord *chunk = atomic_load_explicit(
+                    &shard->mChunks[j/STORE_CHUNK_SIZE], memory_order_acquire);
+            struct ResultsShmRecord record;
+
+            resultsShmReadRecord(&chunk[j % STORE_CHUNK_SIZE].mShared, &record);
+            callback(&record, data);
+        }
+    }
+}
+
+// Find or create the collector's record of the agent "name".
+struct Agent *findAgent(char const *name) {
+    struct Agent *agent = NULL;
+
+    pthread_mutex_lock(&AGENTS_LOCK);
+    for (int i = 0; i < AGENT_COUNT && agent == NULL; i++) {
+        if (strcmp(AGENTS[i]->mName, name) == 0) {
+            agent = AGENTS[i];
+        }
+    }
+
+    if (agent == NULL) {
+        agent = (struct Agent *) calloc(1, sizeof(struct Agent));
+        agent->mName = strdup(name);
+        pthread_mutex_init(&agent->mLock, NULL);
+        AGENTS = (struct Agent **) realloc(AGENTS, (AGENT_COUNT + 1)*sizeof(struct Agent *));
+        AGENTS[AGENT_COUNT++] = agent;
+    }
+    pthread_mutex_unlock(&AGENTS_LOCK);
+
+    return agent;
+}
+
+// Handle an agent's hello. Returns 0 if it's malformed.
+int handleAgentHello(struct MessageReader *r, struct AgentConnection *connection) {
+    if (readVarint(r) != AGENT_PROTOCOL_VERSION) {
+        return 0;
+    }
+    char *name = readVarString(r);
+    int64_t session = readVarint(r);
+    uint64_t count = readVarint(r);
+    if (r->mError || count > AGENT_MESSAGE_MAX) {
+        free(name);
+        return 0;
+    }
+
+    struct Agent *agent = findAgent(name);
+    free(name);
+
+    pthread_mutex_lock(&agent->mLock);
+
+    // A restarted agent starts its sequence over, and may have new tests.
+    if (agent->mSession != session) {
+        agent->mSession = session;
+        agent->mLastSequence = 0;
+    }
+
+    // Records are keyed by address, so a test keeps its history even if the
+    // agent's list changes.
+    agent->mRecords = (struct StoreRecord **) realloc(agent->mRecords,
+            count*sizeof(struct StoreRecord *));
+    agent->mTestCount = count;
+    for (uint64_t i = 0; i < count && !r->mError; i++) {
+        enum TestType testType = (enum TestType) readU8(r);
+        char *address = readVarString(r);
+
+        agent->mRecords[i] = findRecord(agent, testType, address);
+        if (agent->mRecords[i] == NULL) {
+            r->mError = 1;
+        }
+        free(address);
+    }
+    if (r->mError) {
+        agent->mTestCount = 0;
+    }
+
+    connection->mAgent = agent;
+    connection->mLastTime = 0;
+
+    // Tell it what we already have.
+    size_t start = beginMessage(&connection->mOutput, AGENT_ACK);
+    queueVarint(&connection->mOutput, agent->mLastSequence);
+    endMessage(&connection->mOutput, start);
+
+    pthread_mutex_unlock(&agent->mLock);
+
+    return !r->mError;
+}
+
+// Record one tick's result of a test in its store record.
+void storeResult(struct StoreRecord *record, char c, double rtt, int64_t time) {
+    struct ResultsShmRecord *shared = &record->mShared;
+
+    resultsShmBeginWrite(shared);
+    shared->mHistory[shared->mTickCount % RESULTS_SHM_HISTORY] = c;
+    shared->mTickCount++;
+    shared->mTickTime = time;
+    if (isSuccessChar(c)) {
+        shared->mSuccessCount++;
+        shared->mLastRtt = rtt;
+    } else if (isFailureChar(c)) {
+        shared->mFailureCount++;
+    }
+    resultsShmEndWrite(shared);
+}
+
+// Decode the results of a batch from an agent into the thread's scratch
+// space, checking them against the agent's tests. Returns the number of
+// results, or -1 if they're malformed.
+int decodeAgentResults(struct MessageReader *r, struct Agent *agent,
+        struct IngestThread *thread) {
+
+    uint64_t count = readVarint(r);
+    if (r->mError || count > (uint64_t) agent->mTestCount) {
+        return -1;
+    }
+
+    if (thread->mResultCapacity < agent->mTestCount) {
+        thread->mResultCapacity = agent->mTestCount;
+        thread->mResults = (struct AgentResult *) realloc(thread->mResults,
+                thread->mResultCapacity*sizeof(struct AgentResult));
+    }
+
+    // Test indices only go up.
+    uint64_t index = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t delta = readVarint(r);
+        char c = readU8(r);
+        double rtt = isSuccessChar(c) ? readVarint(r)/1e6 : 0;
+        if (r->mError || (i > 0 && delta == 0) ||
+                delta >= (uint64_t) agent->mTestCount - index) {
+
+            return -1;
+        }
+        index += delta;
+
+        struct AgentResult *result = &thread->mResults[i];
+        result->mIndex = index;
+        result->mChar = c;
+        result->mRtt = rtt;
+    }
+
+    return r->mOffset == r->mLength ? (int) count : -1;
+}
+
+// Apply a batch of results from an agent. The whole batch is decoded before
+// any of it goes into the store. Returns 0 if it's malformed.
+int handleAgentBatch(struct MessageReader *r, struct AgentConnection *connection,
+        struct IngestThread *thread) {
+
+    struct Agent *agent = connection->mAgent;
+    uint64_t sequence = readVarint(r);
+    int64_t time = connection->mLastTime + readSignedVarint(r);
+
+    if (r->mError || agent == NULL) {
+        return 0;
+    }
+    connection->mLastTime = time;
+
+    pthread_mutex_lock(&agent->mLock);
+
+    if (sequence <= agent->mLastSequence) {
+        // Already have it from before a reconnection.
+        atomic_fetch_add_explicit(&thread->mResentCount, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&agent->mLock);
+        return 1;
+    }
+
+    int count = decodeAgentResults(r, agent, thread);
+    if (count == -1) {
+        pthread_mutex_unlock(&agent->mLock);
+        return 0;
+    }
+
+    // Leave a gap for the ticks we don't have, so the history lines up with
+    // the agent's clock. Ticks are a second apart.
+    if (agent->mLastTime != 0 && time > agent->mLastTime) {
+        int64_t missing = (time - agent->mLastTime + 500)/1000 - 1;
+        if (missing > RESULTS_SHM_HISTORY) {
+            missing = RESULTS_SHM_HISTORY;
+        }
+        for (int i = 0; i < agent->mTestCount; i++) {
+            for (int64_t t = 0; t < missing; t++) {
+                storeResult(agent->mRecords[i], NO_DATA_CHAR, 0, time);
+            }
+        }
+    }
+
+    // Walk the tests in order, those without a result were waiting.
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        struct AgentResult *result = &thread->mResults[i];
+
+        while (next < result->mIndex) {
+            storeResult(agent->mRecords[next++], WAITING_CHAR, 0, time);
+        }
+        storeResult(agent->mRecords[next++], result->mChar, result->mRtt, time);
+    }
+    while (next < agent->mTestCount) {
+        storeResult(agent->mRecords[next++], WAITING_CHAR, 0, time);
+    }
+    if (agent->mLastSequence != 0) {
+        atomic_fetch_add_explicit(&thread->mMissingCount, sequence - agent->mLastSequence - 1,
+                memory_order_relaxed);
+    }
+    agent->mLastSequence = sequence;
+    agent->mLastTime = time;
+
+    size_t start = beginMessage(&connection->mOutput, AGENT_ACK);
+    queueVarint(&connection->mOutput, sequence);
+    endMessage(&connection->mOutput, start);
+
+    atomic_fetch_add_explicit(&thread->mBatchCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&thread->mResultCount, agent->mTestCount, memory_order_relaxed);
+
+    pthread_mutex_unlock(&agent->mLock);
+
+    return 1;
+}
+
+// Handle a message from an agent on an ingest thread.
+int handleAgentMessage(struct MessageReader *r, void *data) {
+    void **context = (void **) data;
+    struct AgentConnection *connection = (struct AgentConnection *) context[0];
+    struct IngestThread *thread = (struct IngestThread *) context[1];
+
+    switch (readU8(r)) {
+        case AGENT_HELLO:
+            return handleAgentHello(r, connection);
+
+        case AGENT_BATCH:
+            return handleAgentBatch(r, connection, thread);
+
+        default:
+            return 0;
+    }
+}
+
+#if __linux__
+// Disconnect an agent. The collector keeps what it has of its results.
+void closeAgentConnection(int epollFd, struct AgentConnection *connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->mFd, NULL);
+    close(connection->mFd);
+    free(connection->mInput.mData);
+    free(connection->mOutput.mData);
+    free(connection);
+}
+
+// Read batches from, and send acknowledgements to, an agent.
+void handleAgentConnection(int epollFd, struct AgentConnection *connection,
+        uint32_t events, struct IngestThread *thread) {
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        void *context[2] = { connection, thread };
+
+        if (!readAvailable(connection->mFd, &connection->mInput) ||
+                !forEachMessage(&connection->mInput, AGENT_MESSAGE_MAX,
+                    handleAgentMessage, context)) {
+
+            closeAgentConnection(epollFd, connection);
+            return;
+        }
+    }
+
+    ssize_t remaining = sendQueued(connection->mFd, &connection->mOutput);
+    if (remaining == -1) {
+        closeAgentConnection(epollFd, connection);
+        return;
+    }
+
+    // Only bother the kernel when it changes.
+    int waitingToWrite = remaining > 0;
+    if (waitingToWrite != connection->mWaitingToWrite) {
+        struct epoll_event event;
+        event.events = waitingToWrite ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.ptr = connection;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->mFd, &event);
+        connection->mWaitingToWrite = waitingToWrite;
+    }
+}
+
+// Accept agents on the thread's own listening socket and handle them. The
+// kernel spreads connections across the threads' sockets (SO_REUSEPORT).
+void *runIngestThread(void *data) {
+    struct IngestThread *thread = (struct IngestThread *) data;
+    struct epoll_event events[256];
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // The listening socket is the only one with no connection.
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, thread->mListenFd, &event);
+
+    while (1) {
+        int count = epoll_wait(epollFd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct AgentConnection *connection = (struct AgentConnection *) events[i].data.ptr;
+
+            if (connection != NULL) {
+                handleAgentConnection(epollFd, connection, events[i].events, thread);
+                continue;
+            }
+
+            while (1) {
+                int fd = accept(thread->mListenFd, NULL, NULL);
+                if (fd == -1) {
+                    break;
+                }
+                setNonBlocking(fd);
+
+                connection = (struct AgentConnection *) calloc(1, sizeof(struct AgentConnection));
+                connection->mFd = fd;
+                event.events = EPOLLIN;
+                event.data.ptr = connection;
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+            }
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+// Listen for TCP connections on "port", sharing the port with other sockets
+// of ours. Returns the non-blocking socket.
+int listenTcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    setNonBlocking(fd);
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(fd, 1024) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    return fd;
+}
+
+// Snapshots of the store's records, being gathered for display.
+struct RecordList {
+    struct ResultsShmRecord *mRecords;
+    int mCount;
+    int mCapacity;
+};
+
+// Add a record to a RecordList. Callback for forEachRecord().
+void addRecordToList(struct ResultsShmRecord *record, void *data) {
+    struct RecordList *list = (struct RecordList *) data;
+
+    if (list->mCount == list->mCapacity) {
+        list->mCapacity = list->mCapacity == 0 ? 64 : list->mCapacity*2;
+        list->mRecords = (struct ResultsShmRecord *) realloc(list->mRecords,
+                list->mCapacity*sizeof(struct ResultsShmRecord));
+    }
+    list->mRecords[list->mCount++] = *record;
+}
+
+// Order records by address (which starts with the agent's name) for qsort().
+int compareRecords(void const *a, void const *b) {
+    struct ResultsShmRecord const *x = (struct ResultsShmRecord const *) a;
+    struct ResultsShmRecord const *y = (struct ResultsShmRecord const *) b;
+    int order = strcmp(x->mAddress, y->mAddress);
+
+    return order != 0 ? order : strcmp(x->mType, y->mType);
+}
+
+// Display records of the store as a table, like displayTests().
+void displayRecords(struct ResultsShmRecord records[], int count) {
+    int maxWidth = 0;
+    for (int i = 0; i < count; i++) {
+        int width = strlen(records[i].mType) + 1 + strlen(records[i].mAddress) + 2;
+        if (width > maxWidth) {
+            maxWidth = width;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct ResultsShmRecord *record = &records[i];
+
+        // Oldest to newest of the history we have.
+        char history[RESULTS_SHM_HISTORY + 1];
+        int length = 0;
+        uint64_t first = record->mTickCount > RESULTS_SHM_HISTORY ?
+            record->mTickCount - RESULTS_SHM_HISTORY : 0;
+        for (uint64_t t = first; t < record->mTickCount; t++) {
+            history[length++] = record->mHistory[t % RESULTS_SHM_HISTORY];
+        }
+        history[length] = '\0';
+
+        int width = printf("%s %s: ", record->mType, record->mAddress);
+        printf("%*s", maxWidth - width, "");
+        printColoredString(stdout, rightString(history, TERMINAL_WIDTH - maxWidth));
+        printf("\033[K\n");
+    }
+}
+
+// Collect results from agents on "port" using "threadCount" ingest threads
+// and show them all in one table (or report throughput if there's no
+// terminal). The table is drawn from the store without locking it.
+void runCollector(int port, int threadCount, int showTable) {
+#if __linux__
+    struct IngestThread *threads = (struct IngestThread *) calloc(threadCount,
+            sizeof(struct IngestThread));
+    struct RecordList list = { NULL, 0, 0 };
+    int shown = 0;
+    uint64_t lastResultCount = 0;
+    double lastReportTime = getMonotonicTime();
+
+    initializeStore();
+
+    // Bind in this thread so errors show up before anything starts.
+    for (int i = 0; i < threadCount; i++) {
+        threads[i].mListenFd = listenTcp(port);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&threads[i].mThread, NULL, runIngestThread, &threads[i]);
+    }
+
+    while (1) {
+        sleep(showTable ? 1 : COLLECTOR_REPORT_INTERVAL);
+
+        if (showTable) {
+            list.mCount = 0;
+            forEachRecord(addRecordToList, &list);
+            qsort(list.mRecords, list.mCount, sizeof(struct ResultsShmRecord), compareRecords);
+
+            if (shown > 0) {
+                backupCursor(stdout, shown);
+            }
+            displayRecords(list.mRecords, list.mCount);
+            fflush(stdout);
+            shown = list.mCount;
+        } else {
+            uint64_t resultCount = 0;
+            uint64_t missingCount = 0;
+            uint64_t resentCount = 0;
+            for (int i = 0; i < threadCount; i++) {
+                resultCount += atomic_load_explicit(&threads[i].mResultCount, memory_order_relaxed);
+                missingCount += atomic_load_explicit(&threads[i].mMissingCount,
+                        memory_order_relaxed);
+                resentCount += atomic_load_explicit(&threads[i].mResentCount,
+                        memory_order_relaxed);
+            }
+            // Ingest threads add agents under the lock.
+            pthread_mutex_lock(&AGENTS_LOCK);
+            int agentCount = AGENT_COUNT;
+            pthread_mutex_unlock(&AGENTS_LOCK);
+            double now = getMonotonicTime();
+            fprintf(stderr, "%d agents, %.0f results/s, %llu batches missing, %llu resent\n",
+                    agentCount, (resultCount - lastResultCount)/(now - lastReportTime),
+                    (unsigned long long) missingCount, (unsigned long long) resentCount);
+            lastResultCount = resultCount;
+            lastReportTime = now;
+        }
+    }
+#else
+    fprintf(stderr, "The collector needs epoll (Linux).\n");
+    exit(1);
+#endif
+}
+
+// An agent simulated by the load generator.
+struct LoadAgent {
+    int mFd;
+    struct SendQueue mInput;
+    struct SendQueue mOutput;
+
+    // Next batch's sequence number, and the last one acknowledged.
+    uint64_t mNextSequence;
+    uint64_t mAckedSequence;
+
+    // Time of the last batch, which the next one is sent relative to.
+    int64_t mLastSentTime;
+
+    // Send times of outstanding batches, by sequence number.
+    double mSendTimes[LOAD_MAX_OUTSTANDING];
+};
+
+// What the load generator measures between reports.
+struct LoadStats {
+    uint64_t mBatchCount;
+    double *mLatencies;
+    int mLatencyCount;
+    int mLatencyCapacity;
+};
+
+// Record acknowledgements from the collector. Callback for forEachMessage().
+int handleLoadAck(struct MessageReader *r, void *data) {
+    void **context = (void **) data;
+    struct LoadAgent *agent = (struct LoadAgent *) context[0];
+    struct LoadStats *stats = (struct LoadStats *) context[1];
+
+    if (readU8(r) != AGENT_ACK) {
+        return 0;
+    }
+    uint64_t sequence = readVarint(r);
+    if (r->mError) {
+        return 0;
+    }
+
+    double now = getMonotonicTime();
+    for (uint64_t s = agent->mAckedSequence + 1; s <= sequence; s++) {
+        if (stats->mLatencyCount == stats->mLatencyCapacity) {
+            stats->mLatencyCapacity = stats->mLatencyCapacity == 0 ? 1024 : stats->mLatencyCapacity*2;
+            stats->mLatencies = (double *) realloc(stats->mLatencies,
+                    stats->mLatencyCapacity*sizeof(double));
+        }
+        stats->mLatencies[stats->mLatencyCount++] = now - agent->mSendTimes[s % LOAD_MAX_OUTSTANDING];
+        stats->mBatchCount++;
+    }
+    if (sequence > agent->mAckedSequence) {
+        agent->mAckedSequence = sequence;
+    }
+
+    return 1;
+}
+
+// Pretend to be "agentCount" agents with "targetCount" tests each, all
+// sending "rate" batches a second to the collector at "address" (host:port),
+// and report the collector's throughput and acknowledgement latency.
+void runLoadGenerator(char const *address, int agentCount, int targetCount, double rate) {
+    char const *colon = strrchr(address, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "Collector address must be host:port\n");
+        exit(1);
+    }
+    char *host = strndup(address, colon - address);
+
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &addresses) != 0) {
+        fprintf(stderr, "Can't resolve %s\n", host);
+        exit(1);
+    }
+
+    // Same made-up results every tick, so encode them once.
+    struct SendQueue results = { NULL, 0, 0, 0 };
+    queueVarint(&results, targetCount);
+    for (int i = 0; i < targetCount; i++) {
+        int success = rand() % 50 != 0;
+        queueVarint(&results, i == 0 ? 0 : 1);
+        queueU8(&results, success ? SUCCESS_CHAR : FAIL_CHAR);
+        if (success) {
+            queueVarint(&results, 5000 + rand() % 50000);
+        }
+    }
+
+    struct LoadAgent *agents = (struct LoadAgent *) calloc(agentCount, sizeof(struct LoadAgent));
+    struct pollfd *fds = (struct pollfd *) calloc(agentCount, sizeof(struct pollfd));
+    int64_t session = getWallClockMs();
+    for (int i = 0; i < agentCount; i++) {
+        struct LoadAgent *agent = &agents[i];
+
+        agent->mFd = socket(addresses->ai_family, SOCK_STREAM, 0);
+        if (agent->mFd == -1 ||
+                connect(agent->mFd, addresses->ai_addr, addresses->ai_addrlen) == -1) {
+
+            perror(address);
+            exit(1);
+        }
+        setNonBlocking(agent->mFd);
+        agent->mNextSequence = 1;
+
+        char name[32];
+        snprintf(name, sizeof(name), "load%d", i);
+        size_t start = beginMessage(&agent->mOutput, AGENT_HELLO);
+        queueVarint(&agent->mOutput, AGENT_PROTOCOL_VERSION);
+        queueVarString(&agent->mOutput, name);
+        queueVarint(&agent->mOutput, session);
+        queueVarint(&agent->mOutput, targetCount);
+        for (int t = 0; t < targetCount; t++) {
+            char target[32];
+            snprintf(target, sizeof(target), "10.%d.%d.%d", t >> 16, (t >> 8) & 0xFF, t & 0xFF);
+            queueU8(&agent->mOutput, PING);
+            queueVarString(&agent->mOutput, target);
+        }
+        endMessage(&agent->mOutput, start);
+    }
+    freeaddrinfo(addresses);
+    free(host);
+
+    struct LoadStats stats = { 0, NULL, 0, 0 };
+    double interval = 1/rate;
+    double nextSend = getMonotonicTime();
+    double lastReport = nextSend;
+    uint64_t skipped = 0;
+
+    while (1) {
+        double now = getMonotonicTime();
+
+        // Every agent sends a batch each interval.
+        if (now >= nextSend) {
+            int64_t time = getWallClockMs();
+            for (int i = 0; i < agentCount; i++) {
+                struct LoadAgent *agent = &agents[i];
+
+                if (agent->mNextSequence - agent->mAckedSequence > LOAD_MAX_OUTSTANDING) {
+                    skipped++;
+                    continue;
+                }
+
+                size_t start = beginMessage(&agent->mOutput, AGENT_BATCH);
+                queueVarint(&agent->mOutput, agent->mNextSequence);
+                queueSignedVarint(&agent->mOutput, time - agent->mLastSentTime);
+                queueBytes(&agent->mOutput, results.mData, results.mLength);
+                endMessage(&agent->mOutput, start);
+                agent->mLastSentTime = time;
+                agent->mSendTimes[agent->mNextSequence % LOAD_MAX_OUTSTANDING] = now;
+                agent->mNextSequence++;
+            }
+            nextSend += interval;
+            if (nextSend < now) {
+                // Can't keep up, don't try to catch up.
+                nextSend = now + interval;
+            }
+        }
+
+        if (now - lastReport >= 1) {
+            qsort(stats.mLatencies, stats.mLatencyCount, sizeof(double), compareDoubles);
+            printf("%.0f batches/s, %.0f results/s, ack latency p50 %.2f ms, p99 %.2f ms, "
+                    "%llu batches skipped\n",
+                    stats.mBatchCount/(now - lastReport),
+                    stats.mBatchCount*(double) targetCount/(now - lastReport),
+                    stats.mLatencyCount == 0 ? 0 : stats.mLatencies[stats.mLatencyCount/2]*1000,
+                    stats.mLatencyCount == 0 ? 0 :
+                        stats.mLatencies[stats.mLatencyCount*99/100]*1000,
+                    (unsigned long long) skipped);
+            fflush(stdout);
+            stats.mBatchCount = 0;
+            stats.mLatencyCount = 0;
+            skipped = 0;
+            lastReport = now;
+        }
+
+        for (int i = 0; i < agentCount; i++) {
+            fds[i].fd = agents[i].mFd;
+            fds[i].events = agents[i].mOutput.mLength > 0 ? POLLIN | POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+        double wait = nextSend - getMonotonicTime();
+        if (poll(fds, agentCount, wait > 0 ? (int) (wait*1000) + 1 : 0) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        for (int i = 0; i < agentCount; i++) {
+            struct LoadAgent *agent = &agents[i];
+            void *context[2] = { agent, &stats };
+
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    (!readAvailable(agent->mFd, &agent->mInput) ||
+                     !forEachMessage(&agent->mInput, AGENT_MESSAGE_MAX, handleLoadAck, context))) {
+
+                fprintf(stderr, "Collector closed the connection.\n");
+                exit(1);
+            }
+            if ((fds[i].revents & POLLOUT) && sendQueued(agent->mFd, &agent->mOutput) == -1) {
+                perror("write");
+                exit(1);
+            }
+        }
+    }
+}
+
+// A log being merged, with a buffered window of it.
+struct MergeInput {
+    int mFd;
+
+    // Decompressor for a compressed segment, else NULL.
+    gzFile mGz;
+
+    // Records before this time are left out.
+    int64_t mFrom;
+
+    // Name to tag its records with (the file name without directories).
+    char const *mName;
+
+    // Where the next read() starts, for read-ahead hints.
+    off_t mOffset;
+    int mEof;
+
+    // Buffered bytes mData[mStart..mLength), and the current record, which
+    // starts at mData[mStart] and has mRecordLength bytes including the
+    // newline.
+    char *mData;
+    int mStart;
+    int mLength;
+    int mRecordLength;
+
+    // Time ("t" field) of the current record.
+    int64_t mTime;
+};
+
+// Whether merge input "a" should come out before "b": older records first,
+// and for the same time, earlier files first so the merge is stable.
+int isMergeInputBefore(struct MergeInput *a, struct MergeInput *b) {
+    return a->mTime < b->mTime || (a->mTime == b->mTime && a < b);
+}
+
+// Restore the heap property for the heap of "count" inputs, assuming
+// only the one at "index" may be too late for its position.
+void siftMergeHeap(struct MergeInput **heap, int count, int index) {
+    while (1) {
+        int smallest = index;
+        int left = 2*index + 1;
+        int right = left + 1;
+
+        if (left < count && isMergeInputBefore(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < count && isMergeInputBefore(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+
+        struct MergeInput *tmp = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = tmp;
+        index = smallest;
+    }
+}
+
+// Move the buffered rest of the input to the front and read as much as fits
+// after it, then ask the kernel to start reading the next buffer's worth.
+void fillMergeInput(struct MergeInput *input) {
+    memmove(input->mData, input->mData + input->mStart, input->mLength - input->mStart);
+    input->mLength -= input->mStart;
+    input->mStart = 0;
+
+    while (!input->mEof && input->mLength < MERGE_BUFFER_SIZE) {
+        ssize_t length = input->mGz != NULL ?
+            gzread(input->mGz, input->mData + input->mLength, MERGE_BUFFER_SIZE - input->mLength) :
+            read(input->mFd, input->mData + input->mLength, MERGE_BUFFER_SIZE - input->mLength);
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(input->mName);
+            exit(1);
+        }
+        if (length == 0) {
+            input->mEof = 1;
+        }
+        input->mLength += length;
+        input->mOffset += length;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    if (!input->mEof && input->mGz == NULL) {
+        posix_fadvise(input->mFd, input->mOffset, MERGE_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+// Go to the input's next record that starts with a "t" field, skipping and
+// counting in "skipped" any other lines. Returns whether there is one.
+int nextMergeRecord(struct MergeInput *input, uint64_t *skipped) {
+    input->mStart += input->mRecordLength;
+    input->mRecordLength = 0;
+
+    while (1) {
+        char *start = input->mData + input->mStart;
+        int available = input->mLength - input->mStart;
+        char *newline = (char *) memchr(start, '\n', available);
+
+        if (newline == NULL) {
+            if (!input->mEof && input->mStart > 0) {
+                fillMergeInput(input);
+                continue;
+            }
+            if (!input->mEof) {
+                // Line longer than the buffer. Drop what we have of it and
+                // the rest up to the next newline.
+                (*skipped)++;
+                input->mStart = input->mLength;
+                while (!input->mEof) {
+                    fillMergeInput(input);
+                    newline = (char *) memchr(input->mData, '\n', input->mLength);
+                    if (newline != NULL) {
+                        input->mStart = newline + 1 - input->mData;
+                        break;
+                    }
+                    input->mStart = input->mLength;
+                }
+                continue;
+            }
+            if (available == 0) {
+                return 0;
+            }
+            // Last line without a newline. The buffer has a spare byte at
+            // the end for one.
+            newline = start + available;
+            *newline = '\n';
+            input->mLength++;
+        }
+
+        int length = newline + 1 - start;
+        char *end;
+        if (length > 5 && memcmp(start, "{\"t\":", 5) == 0) {
+            input->mTime = strtoll(start + 5, &end, 10);
+            if (end != start + 5 && (*end == ',' || *end == '}')) {
+                if (input->mTime >= input->mFrom) {
+                    input->mRecordLength = length;
+                    return 1;
+                }
+                input->mStart += length;
+                continue;
+            }
+        }
+
+        (*skipped)++;
+        input->mStart += length;
+    }
+}
+
+// Find where in the compressed segment "path" to start reading to get the
+// records from time "from" on, using its index. Returns 0 without one.
+off_t findSegmentOffset(char const *path, int64_t from) {
+    char *indexPath;
+    if (asprintf(&indexPath, "%s.idx", path) == -1) {
+        perror("asprintf");
+        exit(1);
+    }
+
+    FILE *index = fopen(indexPath, "re");
+    free(indexPath);
+    if (index == NULL) {
+        return 0;
+    }
+
+    // Start at the last member that begins before "from". Records within a
+    // tick can be a little out of order, so allow for that.
+    long long offset;
+    long long time;
+    off_t start = 0;
+    while (fscanf(index, "%lld %lld", &offset, &time) == 2) {
+        if (time == -1 || time > from - PING_TIMEOUT*1000) {
+            break;
+        }
+        start = offset;
+    }
+    fclose(index);
+
+    return start;
+}
+
+// Open the log at "path" for merging, compressed if it ends in ".gz", and
+// skip ahead to time "from".
+void openMergeInput(struct MergeInput *input, char const *path, int64_t from) {
+    size_t pathLength = strlen(path);
+    char const *slash = strrchr(path, '/');
+
+    input->mFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (input->mFd == -1) {
+        perror(path);
+        exit(1);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(input->mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    input->mName = slash == NULL ? path : slash + 1;
+    input->mFrom = from;
+
+    if (pathLength > 3 && strcmp(path + pathLength - 3, ".gz") == 0) {
+        // Each member decompresses on its own, so skip whole ones.
+        input->mOffset = from > 0 ? findSegmentOffset(path, from) : 0;
+        if (lseek(input->mFd, input->mOffset, SEEK_SET) == -1) {
+            perror(path);
+            exit(1);
+        }
+        input->mGz = gzdopen(dup(input->mFd), "rb");
+        if (input->mGz == NULL) {
+            perror(path);
+            exit(1);
+        }
+        gzbuffer(input->mGz, MERGE_BUFFER_SIZE);
+    }
+
+    input->mData = (char *) malloc(MERGE_BUFFER_SIZE + 1);
+    fillMergeInput(input);
+}
+
+// Receives merged records, the "length" bytes at "record" (ending with a
+// newline), from "input". Called once more with a NULL input at the end.
+typedef void MergeHandler(struct MergeInput *input, char const *record, int length, void *data);
+
+// Write a merged record to the output buffer "data", tagged with a "log"
+// field naming the file it came from (unless it's already tagged from an
+// earlier merge).
+void writeMergedRecord(struct MergeInput *input, char const *record, int length, void *data) {
+    struct OutputBuffer *out = (struct OutputBuffer *) data;
+
+    if (input == NULL) {
+        flushOutput(out);
+        return;
+    }
+
+    if (out->mLength + length + MAX_RECORD_LENGTH > OUTPUT_BUFFER_SIZE) {
+        flushOutput(out);
+    }
+
+    char const *afterTime = record + 5;
+    while (*afterTime == '-' || (*afterTime >= '0' && *afterTime <= '9')) {
+        afterTime++;
+    }
+    if (record + length - afterTime < 7 || memcmp(afterTime, ",\"log\":", 7) != 0) {
+        writeBytes(out, record, afterTime - record);
+        writeString(out, ",\"log\":");
+        writeJsonString(out, input->mName);
+        writeBytes(out, afterTime, record + length - afterTime);
+    } else {
+        writeBytes(out, record, length);
+    }
+}
+
+// Merge the NDJSON logs at "paths" (e.g., from several agents' -j option,
+// plain or compressed by rotation) into one timeline ordered by their "t"
+// fields, from time "from" on, passing the records to "handler". Memory is
+// MERGE_BUFFER_SIZE per log however long the logs are. "verb" describes
+// what we're doing in the throughput report.
+void mergeLogs(char **paths, int count, int64_t from, char const *verb,
+        MergeHandler *handler, void *data) {
+
+    struct MergeInput *inputs = (struct MergeInput *) calloc(count, sizeof(struct MergeInput));
+    struct MergeInput **heap = (struct MergeInput **) malloc(count*sizeof(struct MergeInput *));
+    int heapCount = 0;
+    uint64_t recordCount = 0;
+    uint64_t byteCount = 0;
+    uint64_t skipped = 0;
+    double startTime = getMonotonicTime();
+
+    for (int i = 0; i < count; i++) {
+        struct MergeInput *input = &inputs[i];
+
+        openMergeInput(input, paths[i], from);
+        if (nextMergeRecord(input, &skipped)) {
+            heap[heapCount++] = input;
+        }
+    }
+    for (int i = heapCount/2 - 1; i >= 0; i--) {
+        siftMergeHeap(heap, heapCount, i);
+    }
+
+    while (heapCount > 0) {
+        struct MergeInput *input = heap[0];
+
+        handler(input, input->mData + input->mStart, input->mRecordLength, data);
+        recordCount++;
+        byteCount += input->mRecordLength;
+
+        if (nextMergeRecord(input, &skipped)) {
+            siftMergeHeap(heap, heapCount, 0);
+        } else {
+            heap[0] = heap[--heapCount];
+            siftMergeHeap(heap, heapCount, 0);
+        }
+    }
+    handler(NULL, NULL, 0, data);
+
+    double elapsed = getMonotonicTime() - startTime;
+    fprintf(stderr, "%s %llu records (%.1f MB) from %d logs in %.2f s: "
+            "%.0f records/s, %.1f MB/s, %llu lines skipped\n",
+            verb, (unsigned long long) recordCount, byteCount/1e6, count, elapsed,
+            recordCount/elapsed, byteCount/1e6/elapsed, (unsigned long long) skipped);
+
+    for (int i = 0; i < count; i++) {
+        if (inputs[i].mGz != NULL) {
+            gzclose(inputs[i].mGz);
+        }
+        close(inputs[i].mFd);
+        free(inputs[i].mData);
+    }
+    free(heap);
+    free(inputs);
+}
+
+// Most fields in any FlatBuffers table we build.
+#define FLAT_MAX_FIELDS 8
+
+// Builder of a FlatBuffer, the serialization of Arrow's metadata. Like the
+// official builders, it fills the buffer from the end backwards, so that
+// everything a table refers to is finished before the table is started.
+// Objects are identified by their offset from the end.
+struct FlatBuilder {
+    uint8_t *mData;
+    size_t mCapacity;
+    size_t mSize;
+    size_t mMinAlign;
+
+    // Table being built: where it started, and where each of its fields is.
+    size_t mTableStart;
+    size_t mFields[FLAT_MAX_FIELDS];
+    int mFieldCount;
+};
+
+// Make room for "length" more bytes in front of what's there.
+void flatGrow(struct FlatBuilder *b, size_t length) {
+    if (b->mSize + length > b->mCapacity) {
+        size_t capacity = (b->mSize + length)*2;
+        uint8_t *data = (uint8_t *) malloc(capacity);
+        memcpy(data + capacity - b->mSize, b->mData + b->mCapacity - b->mSize, b->mSize);
+        free(b->mData);
+        b->mData = data;
+        b->mCapacity = capacity;
+    }
+}
+
+// Add bytes in front of what's there.
+void flatPush(struct FlatBuilder *b, void const *data, size_t length) {
+    flatGrow(b, length);
+    b->mSize += length;
+    memcpy(b->mData + b->mCapacity - b->mSize, data, length);
+}
+
+// Add "length" zero bytes.
+void flatPad(struct FlatBuilder *b, size_t length) {
+    flatGrow(b, length);
+    b->mSize += length;
+    memset(b->mData + b->mCapacity - b->mSize, 0, length);
+}
+
+// Pad so that after "length" more bytes, we're aligned to "align".
+void flatPrep(struct FlatBuilder *b, size_t align, size_t length) {
+    if (align > b->mMinAlign) {
+        b->mMinAlign = align;
+    }
+    flatPad(b, -(b->mSize + length) & (align - 1));
+}
+
+// Add aligned scalars.
+void flatPushU8(struct FlatBuilder *b, uint8_t n) {
+    flatPush(b, &n, sizeof(n));
+}
+void flatPushU16(struct FlatBuilder *b, uint16_t n) {
+    flatPrep(b, sizeof(n), 0);
+    flatPush(b, &n, sizeof(n));
+}
+void flatPushU32(struct FlatBuilder *b, uint32_t n) {
+    flatPrep(b, sizeof(n), 0);
+    flatPush(b, &n, sizeof(n));
+}
+void flatPushU64(struct FlatBuilder *b, uint64_t n) {
+    flatPrep(b, sizeof(n), 0);
+    flatPush(b, &n, sizeof(n));
+}
+
+// Add a reference to the object at "offset".
+void flatPushOffset(struct FlatBuilder *b, size_t offset) {
+    flatPrep(b, 4, 0);
+    flatPushU32(b, b->mSize + 4 - offset);
+}
+
+// Add a string, returning its offset.
+size_t flatCreateString(struct FlatBuilder *b, char const *s) {
+    size_t length = strlen(s);
+
+    flatPrep(b, 4, length + 1);
+    flatPad(b, 1);
+    flatPush(b, s, length);
+    flatPushU32(b, length);
+
+    return b->mSize;
+}
+
+// Start a vector of "count" elements of "size" bytes. Push them last first,
+// then call flatEndVector().
+void flatStartVector(struct FlatBuilder *b, size_t size, int count, size_t align) {
+    flatPrep(b, 4, size*count);
+    flatPrep(b, align, size*count);
+}
+
+// Finish a vector, returning its offset.
+size_t flatEndVector(struct FlatBuilder *b, int count) {
+    flatPushU32(b, count);
+
+    return b->mSize;
+}
+
+// Start a table. Add its fields with the flatAdd functions, in any order.
+void flatStartTable(struct FlatBuilder *b) {
+    b->mTableStart = b->mSize;
+    b->mFieldCount = 0;
+    memset(b->mFields, 0, sizeof(b->mFields));
+}
+
+// Note that field "slot" of the table is what we just pushed.
+void flatSetField(struct FlatBuilder *b, int slot) {
+    b->mFields[slot] = b->mSize;
+    if (slot >= b->mFieldCount) {
+        b->mFieldCount = slot + 1;
+    }
+}
+
+void flatAddU8(struct FlatBuilder *b, int slot, uint8_t n) {
+    flatPushU8(b, n);
+    flatSetField(b, slot);
+}
+void flatAddU16(struct FlatBuilder *b, int slot, uint16_t n) {
+    flatPushU16(b, n);
+    flatSetField(b, slot);
+}
+void flatAddU32(struct FlatBuilder *b, int slot, uint32_t n) {
+    flatPushU32(b, n);
+    flatSetField(b, slot);
+}
+void flatAddU64(struct FlatBuilder *b, int slot, uint64_t n) {
+    flatPushU64(b, n);
+    flatSetField(b, slot);
+}
+void flatAddOffset(struct FlatBuilder *b, int slot, size_t offset) {
+    flatPushOffset(b, offset);
+    flatSetField(b, slot);
+}
+
+// Finish a table with its vtable in front of it, returning its offset.
+size_t flatEndTable(struct FlatBuilder *b) {
+    // Offset to the vtable, filled in below.
+    flatPushU32(b, 0);
+    size_t table = b->mSize;
+
+    for (int i = b->mFieldCount - 1; i >= 0; i--) {
+        flatPushU16(b, b->mFields[i] == 0 ? 0 : table - b->mFields[i]);
+    }
+    flatPushU16(b, table - b->mTableStart);
+    flatPushU16(b, 4 + 2*b->mFieldCount);
+
+    int32_t vtable = b->mSize - table;
+    memcpy(b->mData + b->mCapacity - table, &vtable, sizeof(vtable));
+
+    return table;
+}
+
+// Finish the buffer with "root" as its root table. It's then the last
+// mSize bytes of mData.
+void flatFinish(struct FlatBuilder *b, size_t root) {
+    flatPrep(b, b->mMinAlign, 4);
+    flatPushOffset(b, root);
+}
+
+// Empty the builder for another buffer.
+void flatReset(struct FlatBuilder *b) {
+    b->mSize = 0;
+    b->mMinAlign = 1;
+}
+
+// Get the finished buffer.
+uint8_t *flatGetData(struct FlatBuilder *b) {
+    return b->mData + b->mCapacity - b->mSize;
+}
+
+// Values from Arrow's Schema.fbs and Message.fbs.
+enum {
+    ARROW_METADATA_V5 = 4,
+
+    ARROW_TYPE_INT = 2,
+    ARROW_TYPE_FLOATING_POINT = 3,
+    ARROW_TYPE_UTF8 = 5,
+    ARROW_TYPE_TIMESTAMP = 10,
+    ARROW_TYPE_RUN_END_ENCODED = 22,
+
+    ARROW_PRECISION_DOUBLE = 2,
+    ARROW_TIME_UNIT_MILLISECOND = 1,
+
+    ARROW_HEADER_SCHEMA = 1,
+    ARROW_HEADER_DICTIONARY_BATCH = 2,
+    ARROW_HEADER_RECORD_BATCH = 3,
+};
+
+// Rows per record batch of an export.
+#define EXPORT_BATCH_ROWS 65536
+
+// Most buffers in a message body.
+#define ARROW_MAX_BUFFERS 24
+
+// Columns of an export, in schema order. Result is run-end encoded, and log,
+// type, target and from are dictionary encoded with the dictionaries below.
+enum ExportColumn {
+    EXPORT_TIME,
+    EXPORT_LOG,
+    EXPORT_TYPE,
+    EXPORT_TARGET,
+    EXPORT_RESULT,
+    EXPORT_RTT,
+    EXPORT_FROM,
+    EXPORT_OFFSET,
+    EXPORT_DELAY,
+};
+
+// Dictionaries of an export, by Arrow dictionary ID, and one for result
+// names that's only used in memory.
+enum ExportDictionaryId {
+    EXPORT_DICTIONARY_LOG,
+    EXPORT_DICTIONARY_TYPE,
+    EXPORT_DICTIONARY_TARGET,
+    EXPORT_DICTIONARY_FROM,
+    EXPORT_DICTIONARY_RESULT,
+    EXPORT_DICTIONARY_COUNT,
+};
+#define EXPORT_FILE_DICTIONARY_COUNT EXPORT_DICTIONARY_RESULT
+
+// Distinct strings of a column, indexed by a hash table.
+struct ExportDictionary {
+    char **mValues;
+    int mCount;
+
+    // Values already written to the file, and whether we've written any
+    // batch of this dictionary (later ones are deltas).
+    int mWritten;
+    int mStarted;
+
+    // Open addressing, with value index + 1 or 0 for empty.
+    int *mSlots;
+    int mSlotCount;
+};
+
+// Position of a message in an Arrow file, for the footer.
+struct ArrowBlock {
+    int64_t mOffset;
+    int32_t mMetadataLength;
+    int64_t mBodyLength;
+};
+
+// Body of an Arrow message under construction: the buffers it's made of.
+struct ArrowBody {
+    int mCount;
+    void const *mData[ARROW_MAX_BUFFERS];
+    int64_t mLength[ARROW_MAX_BUFFERS];
+};
+
+// A nullable column of doubles.
+struct ExportDoubles {
+    double *mValues;
+    uint8_t *mValid;
+    int mNullCount;
+};
+
+// Export of records to an Arrow IPC file, a batch of rows at a time.
+struct ColumnarExport {
+    int mFd;
+    int64_t mOffset;
+    struct FlatBuilder mBuilder;
+
+    struct ExportDictionary mDictionaries[EXPORT_DICTIONARY_COUNT];
+
+    // Messages written, for the footer.
+    struct ArrowBlock *mDictionaryBlocks;
+    int mDictionaryBlockCount;
+    struct ArrowBlock *mBatchBlocks;
+    int mBatchBlockCount;
+
+    // Columns of the current batch. Results are runs of the same result
+    // (as an index into its dictionary) that end at mRunEnds.
+    int mRowCount;
+    int64_t *mTimes;
+    int32_t *mLogs;
+    int32_t *mTypes;
+    int32_t *mTargets;
+    int32_t *mFroms;
+    uint8_t *mFromValid;
+    int mFromNullCount;
+    struct ExportDoubles mRtts;
+    struct ExportDoubles mOffsets;
+    struct ExportDoubles mDelays;
+    int32_t *mRunEnds;
+    int32_t *mRunValues;
+    int mRunCount;
+};
+
+// Get the index of "value" (of "length" bytes) in the dictionary, adding it
+// if it's new.
+int lookupExportDictionary(struct ExportDictionary *dictionary, char const *value, int length) {
+    if ((dictionary->mCount + 1)*2 > dictionary->mSlotCount) {
+        int slotCount = dictionary->mSlotCount == 0 ? 64 : dictionary->mSlotCount*2;
+        free(dictionary->mSlots);
+        dictionary->mSlots = (int *) calloc(slotCount, sizeof(int));
+        dictionary->mSlotCount = slotCount;
+        dictionary->mValues = (char **) realloc(dictionary->mValues, slotCount*sizeof(char *));
+
+        for (int i = 0; i < dictionary->mCount; i++) {
+            char const *s = dictionary->mValues[i];
+            uint64_t hash = 14695981039346656037ull;
+            for (; *s != '\0'; s++) {
+                hash = (hash ^ (uint8_t) *s)*1099511628211ull;
+            }
+            int slot = hash & (slotCount - 1);
+            while (dictionary->mSlots[slot] != 0) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            dictionary->mSlots[slot] = i + 1;
+        }
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t) value[i])*1099511628211ull;
+    }
+    int slot = hash & (dictionary->mSlotCount - 1);
+    while (dictionary->mSlots[slot] != 0) {
+        char const *existing = dictionary->mValues[dictionary->mSlots[slot] - 1];
+        if (strncmp(existing, value, length) == 0 && existing[length] == '\0') {
+            return dictionary->mSlots[slot] - 1;
+        }
+        slot = (slot + 1) & (dictionary->mSlotCount - 1);
+    }
+
+    dictionary->mValues[dictionary->mCount] = strndup(value, length);
+    dictionary->mSlots[slot] = ++dictionary->mCount;
+
+    return dictionary->mCount - 1;
+}
+
+// Write an encapsulated Arrow message: the finished FlatBuffer in the
+// builder, then the buffers of "body". Returns its block.
+struct ArrowBlock writeArrowMessage(struct ColumnarExport *export, struct ArrowBody *body) {
+    static char const ZEROS[8] = { 0 };
+    struct FlatBuilder *b = &export->mBuilder;
+    struct ArrowBlock block;
+
+    // Continuation marker, then the metadata length, padded so the body is
+    // 8-byte aligned.
+    int32_t metadataLength = (b->mSize + 7)/8*8;
+    uint32_t prefix[2] = { 0xFFFFFFFF, metadataLength };
+    writeFully(export->mFd, (char const *) prefix, sizeof(prefix));
+    writeFully(export->mFd, (char const *) flatGetData(b), b->mSize);
+    writeFully(export->mFd, ZEROS, metadataLength - b->mSize);
+
+    block.mOffset = export->mOffset;
+    block.mMetadataLength = sizeof(prefix) + metadataLength;
+    block.mBodyLength = 0;
+    for (int i = 0; body != NULL && i < body->mCount; i++) {
+        int64_t padded = (body->mLength[i] + 7)/8*8;
+        writeFully(export->mFd, (char const *) body->mData[i], body->mLength[i]);
+        writeFully(export->mFd, ZEROS, padded - body->mLength[i]);
+        block.mBodyLength += padded;
+    }
+    export->mOffset += block.mMetadataLength + block.mBodyLength;
+
+    return block;
+}
+
+// Add a buffer to a message body.
+void addArrowBuffer(struct ArrowBody *body, void const *data, int64_t length) {
+    body->mData[body->mCount] = data;
+    body->mLength[body->mCount] = length;
+    body->mCount++;
+}
+
+// Total length of a body, with padding.
+int64_t getArrowBodyLength(struct ArrowBody *body) {
+    int64_t length = 0;
+
+    for (int i = 0; i < body->mCount; i++) {
+        length += (body->mLength[i] + 7)/8*8;
+    }
+
+    return length;
+}
+
+// Build a RecordBatch table with "nodes" (length, null count pairs) and the
+// buffers of "body". Returns its offset.
+size_t buildArrowRecordBatch(struct FlatBuilder *b, int64_t length,
+        int64_t nodes[][2], int nodeCount, struct ArrowBody *body) {
+
+    flatStartVector(b, 16, body->mCount, 8);
+    int64_t offset = getArrowBodyLength(body);
+    for (int i = body->mCount - 1; i >= 0; i--) {
+        offset -= (body->mLength[i] + 7)/8*8;
+        flatPushU64(b, body->mLength[i]);
+        flatPushU64(b, offset);
+    }
+    size_t buffers = flatEndVector(b, body->mCount);
+
+    flatStartVector(b, 16, nodeCount, 8);
+    for (int i = nodeCount - 1; i >= 0; i--) {
+        flatPushU64(b, nodes[i][1]);
+        flatPushU64(b, nodes[i][0]);
+    }
+    size_t nodeVector = flatEndVector(b, nodeCount);
+
+    flatStartTable(b);
+    flatAddU64(b, 0, length);
+    flatAddOffset(b, 1, nodeVector);
+    flatAddOffset(b, 2, buffers);
+
+    return flatEndTable(b);
+}
+
+// Finish a Message table around "header" and the buffer.
+void finishArrowMessage(struct FlatBuilder *b, int headerType, size_t header, int64_t bodyLength) {
+    flatStartTable(b);
+    flatAddU64(b, 3, bodyLength);
+    flatAddOffset(b, 2, header);
+    flatAddU16(b, 0, ARROW_METADATA_V5);
+    flatAddU8(b, 1, headerType);
+    flatFinish(b, flatEndTable(b));
+}
+
+// Build an Int type table.
+size_t buildArrowIntType(struct FlatBuilder *b, int bitWidth) {
+    flatStartTable(b);
+    flatAddU32(b, 0, bitWidth);
+    flatAddU8(b, 1, 1);
+
+    return flatEndTable(b);
+}
+
+// Build a table with no fields, as for types without parameters.
+size_t buildEmptyTable(struct FlatBuilder *b) {
+    flatStartTable(b);
+
+    return flatEndTable(b);
+}
+
+// Build a Field table. "dictionaryId" is -1 if it's not dictionary encoded.
+size_t buildArrowField(struct FlatBuilder *b, char const *name, int nullable,
+        int typeType, size_t type, int dictionaryId, size_t *children, int childCount) {
+
+    size_t nameOffset = flatCreateString(b, name);
+
+    size_t dictionary = 0;
+    if (dictionaryId >= 0) {
+        size_t indexType = buildArrowIntType(b, 32);
+        flatStartTable(b);
+        flatAddU64(b, 0, dictionaryId);
+        flatAddOffset(b, 1, indexType);
+        dictionary = flatEndTable(b);
+    }
+
+    // Readers insist on a vector of children, even an empty one.
+    flatStartVector(b, 4, childCount, 4);
+    for (int i = childCount - 1; i >= 0; i--) {
+        flatPushOffset(b, children[i]);
+    }
+    size_t childVector = flatEndVector(b, childCount);
+
+    flatStartTable(b);
+    flatAddOffset(b, 0, nameOffset);
+    flatAddOffset(b, 3, type);
+    if (dictionary != 0) {
+        flatAddOffset(b, 4, dictionary);
+    }
+    flatAddOffset(b, 5, childVector);
+    flatAddU8(b, 1, nullable);
+    flatAddU8(b, 2, typeType);
+
+    return flatEndTable(b);
+}
+
+// Build the Schema table of an export.
+size_t buildExportSchema(struct FlatBuilder *b) {
+    size_t fields[EXPORT_DELAY + 1];
+
+    size_t timezone = flatCreateString(b, "UTC");
+    flatStartTable(b);
+    flatAddOffset(b, 1, timezone);
+    flatAddU16(b, 0, ARROW_TIME_UNIT_MILLISECOND);
+    fields[EXPORT_TIME] = buildArrowField(b, "time", 0, ARROW_TYPE_TIMESTAMP,
+            flatEndTable(b), -1, NULL, 0);
+
+    fields[EXPORT_LOG] = buildArrowField(b, "log", 0, ARROW_TYPE_UTF8,
+            buildEmptyTable(b), EXPORT_DICTIONARY_LOG, NULL, 0);
+    fields[EXPORT_TYPE] = buildArrowField(b, "type", 0, ARROW_TYPE_UTF8,
+            buildEmptyTable(b), EXPORT_DICTIONARY_TYPE, NULL, 0);
+    fields[EXPORT_TARGET] = buildArrowField(b, "target", 0, ARROW_TYPE_UTF8,
+            buildEmptyTable(b), EXPORT_DICTIONARY_TARGET, NULL, 0);
+
+    size_t runChildren[2];
+    runChildren[0] = buildArrowField(b, "run_ends", 0, ARROW_TYPE_INT,
+            buildArrowIntType(b, 32), -1, NULL, 0);
+    runChildren[1] = buildArrowField(b, "values", 1, ARROW_TYPE_UTF8,
+            buildEmptyTable(b), -1, NULL, 0);
+    fields[EXPORT_RESULT] = buildArrowField(b, "result", 0, ARROW_TYPE_RUN_END_ENCODED,
+            buildEmptyTable(b), -1, runChildren, 2);
+
+    char const *doubleNames[] = { "rtt", "offset", "delay" };
+    int doubleColumns[] = { EXPORT_RTT, EXPORT_OFFSET, EXPORT_DELAY };
+    for (int i = 0; i < 3; i++) {
+        flatStartTable(b);
+        flatAddU16(b, 0, ARROW_PRECISION_DOUBLE);
+        fields[doubleColumns[i]] = buildArrowField(b, doubleNames[i], 1,
+                ARROW_TYPE_FLOATING_POINT, flatEndTable(b), -1, NULL, 0);
+    }
+
+    fields[EXPORT_FROM] = buildArrowField(b, "from", 1, ARROW_TYPE_UTF8,
+            buildEmptyTable(b), EXPORT_DICTIONARY_FROM, NULL, 0);
+
+    flatStartVector(b, 4, EXPORT_DELAY + 1, 4);
+    for (int i = EXPORT_DELAY; i >= 0; i--) {
+        flatPushOffset(b, fields[i]);
+    }
+    size_t fieldVector = flatEndVector(b, EXPORT_DELAY + 1);
+
+    flatStartTable(b);
+    flatAddOffset(b, 1, fieldVector);
+
+    return flatEndTable(b);
+}
+
+// Add a block to a list of them.
+void addArrowBlock(struct ArrowBlock **blocks, int *count, struct ArrowBlock block) {
+    *blocks = (struct ArrowBlock *) realloc(*blocks, (*count + 1)*sizeof(struct ArrowBlock));
+    (*blocks)[(*count)++] = block;
+}
+
+// Fill "body" with the offsets and characters of "count" strings, as for a
+// UTF-8 array after an empty validity buffer. The caller frees "*offsets"
+// and "*chars".
+void addUtf8Buffers(struct ArrowBody *body, char **values, int count,
+        int32_t **offsets, char **chars) {
+
+    int32_t length = 0;
+    for (int i = 0; i < count; i++) {
+        length += strlen(values[i]);
+    }
+
+    *offsets = (int32_t *) malloc((count + 1)*sizeof(int32_t));
+    *chars = (char *) malloc(length + 1);
+    (*offsets)[0] = 0;
+    for (int i = 0; i < count; i++) {
+        int valueLength = strlen(values[i]);
+        memcpy(*chars + (*offsets)[i], values[i], valueLength);
+        (*offsets)[i + 1] = (*offsets)[i] + valueLength;
+    }
+
+    addArrowBuffer(body, NULL, 0);
+    addArrowBuffer(body, *offsets, (count + 1)*sizeof(int32_t));
+    addArrowBuffer(body, *chars, length);
+}
+
+// Write the values the dictionary got since it was last written, as a delta
+// if it's been written before.
+void writeExportDictionary(struct ColumnarExport *export, int id) {
+    struct ExportDictionary *dictionary = &export->mDictionaries[id];
+    struct FlatBuilder *b = &export->mBuilder;
+    struct ArrowBody body = { 0 };
+    int count = dictionary->mCount - dictionary->mWritten;
+    int32_t *offsets;
+    char *chars;
+
+    addUtf8Buffers(&body, dictionary->mValues + dictionary->mWritten, count, &offsets, &chars);
+    int64_t nodes[1][2] = { { count, 0 } };
+
+    flatReset(b);
+    size_t data = buildArrowRecordBatch(b, count, nodes, 1, &body);
+    flatStartTable(b);
+    flatAddU64(b, 0, id);
+    flatAddOffset(b, 1, data);
+    flatAddU8(b, 2, dictionary->mStarted);
+    finishArrowMessage(b, ARROW_HEADER_DICTIONARY_BATCH, flatEndTable(b),
+            getArrowBodyLength(&body));
+
+    addArrowBlock(&export->mDictionaryBlocks, &export->mDictionaryBlockCount,
+            writeArrowMessage(export, &body));
+    dictionary->mWritten = dictionary->mCount;
+    dictionary->mStarted = 1;
+
+    free(offsets);
+    free(chars);
+}
+
+// Write the rows collected so far as a record batch, after any dictionary
+// values they introduced.
+void writeExportBatch(struct ColumnarExport *export) {
+    for (int id = 0; id < EXPORT_FILE_DICTIONARY_COUNT; id++) {
+        struct ExportDictionary *dictionary = &export->mDictionaries[id];
+        if (!dictionary->mStarted || dictionary->mWritten < dictionary->mCount) {
+            writeExportDictionary(export, id);
+        }
+    }
+
+    int rows = export->mRowCount;
+    struct ArrowBody body = { 0 };
+    int64_t nodes[EXPORT_DELAY + 3][2];
+    int nodeCount = 0;
+    struct ExportDoubles *doubles[] = { &export->mRtts, &export->mOffsets, &export->mDelays };
+
+    // Run values are result names.
+    char **runValues = (char **) malloc((export->mRunCount + 1)*sizeof(char *));
+    for (int i = 0; i < export->mRunCount; i++) {
+        runValues[i] = export->mDictionaries[EXPORT_DICTIONARY_RESULT].mValues[export->mRunValues[i]];
+    }
+    int32_t *runOffsets;
+    char *runChars;
+
+    for (int column = 0; column <= EXPORT_DELAY; column++) {
+        switch (column) {
+            case EXPORT_TIME:
+                addArrowBuffer(&body, NULL, 0);
+                addArrowBuffer(&body, export->mTimes, rows*sizeof(int64_t));
+                nodes[nodeCount][0] = rows;
+                nodes[nodeCount++][1] = 0;
+                break;
+
+            case EXPORT_LOG:
+            case EXPORT_TYPE:
+            case EXPORT_TARGET: {
+                int32_t *indices = column == EXPORT_LOG ? export->mLogs :
+                    column == EXPORT_TYPE ? export->mTypes : export->mTargets;
+                addArrowBuffer(&body, NULL, 0);
+                addArrowBuffer(&body, indices, rows*sizeof(int32_t));
+                nodes[nodeCount][0] = rows;
+                nodes[nodeCount++][1] = 0;
+                break;
+            }
+
+            case EXPORT_RESULT:
+                // The run-end encoded array has no buffers of its own, only
+                // its two children.
+                nodes[nodeCount][0] = rows;
+                nodes[nodeCount++][1] = 0;
+                addArrowBuffer(&body, NULL, 0);
+                addArrowBuffer(&body, export->mRunEnds, export->mRunCount*sizeof(int32_t));
+                nodes[nodeCount][0] = export->mRunCount;
+                nodes[nodeCount++][1] = 0;
+                addUtf8Buffers(&body, runValues, export->mRunCount, &runOffsets, &runChars);
+                nodes[nodeCount][0] = export->mRunCount;
+                nodes[nodeCount++][1] = 0;
+                break;
+
+            case EXPORT_FROM:
+                addArrowBuffer(&body, export->mFromValid,
+                        export->mFromNullCount == 0 ? 0 : (rows + 7)/8);
+                addArrowBuffer(&body, export->mFroms, rows*sizeof(int32_t));
+                nodes[nodeCount][0] = rows;
+                nodes[nodeCount++][1] = export->mFromNullCount;
+                break;
+
+            default: {
+                struct ExportDoubles *d = doubles[column == EXPORT_RTT ? 0 :
+                    column == EXPORT_OFFSET ? 1 : 2];
+                addArrowBuffer(&body, d->mValid, d->mNullCount == 0 ? 0 : (rows + 7)/8);
+                addArrowBuffer(&body, d->mValues, rows*sizeof(double));
+                nodes[nodeCount][0] = rows;
+                nodes[nodeCount++][1] = d->mNullCount;
+                break;
+            }
+        }
+    }
+
+    struct FlatBuilder *b = &export->mBuilder;
+    flatReset(b);
+    size_t batch = buildArrowRecordBatch(b, rows, nodes, nodeCount, &body);
+    finishArrowMessage(b, ARROW_HEADER_RECORD_BATCH, batch, getArrowBodyLength(&body));
+    addArrowBlock(&export->mBatchBlocks, &export->mBatchBlockCount,
+            writeArrowMessage(export, &body));
+
+    free(runValues);
+    free(runOffsets);
+    free(runChars);
+
+    export->mRowCount = 0;
+    export->mRunCount = 0;
+    export->mFromNullCount = 0;
+    for (int i = 0; i < 3; i++) {
+        doubles[i]->mNullCount = 0;
+    }
+}
+
+// Create an export to the Arrow IPC file at "path".
+struct ColumnarExport *openColumnarExport(char const *path) {
+    struct ColumnarExport *export = (struct ColumnarExport *) calloc(1, sizeof(struct ColumnarExport));
+
+    export->mFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (export->mFd == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    export->mTimes = (int64_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int64_t));
+    export->mLogs = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    export->mTypes = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    export->mTargets = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    export->mFroms = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    export->mFromValid = (uint8_t *) calloc(EXPORT_BATCH_ROWS/8, 1);
+    export->mRunEnds = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    export->mRunValues = (int32_t *) malloc(EXPORT_BATCH_ROWS*sizeof(int32_t));
+    struct ExportDoubles *doubles[] = { &export->mRtts, &export->mOffsets, &export->mDelays };
+    for (int i = 0; i < 3; i++) {
+        doubles[i]->mValues = (double *) malloc(EXPORT_BATCH_ROWS*sizeof(double));
+        doubles[i]->mValid = (uint8_t *) calloc(EXPORT_BATCH_ROWS/8, 1);
+    }
+
+    // Magic, padded to 8 bytes, then the schema.
+    writeFully(export->mFd, "ARROW1\0\0", 8);
+    export->mOffset = 8;
+
+    struct FlatBuilder *b = &export->mBuilder;
+    flatReset(b);
+    finishArrowMessage(b, ARROW_HEADER_SCHEMA, buildExportSchema(b), 0);
+    writeArrowMessage(export, NULL);
+
+    return export;
+}
+
+// Finish the file with the footer that indexes its messages.
+void closeColumnarExport(struct ColumnarExport *export) {
+    if (export->mRowCount > 0 || export->mBatchBlockCount == 0) {
+        writeExportBatch(export);
+    }
+
+    // End of stream.
+    uint32_t eos[2] = { 0xFFFFFFFF, 0 };
+    writeFully(export->mFd, (char const *) eos, sizeof(eos));
+
+    struct FlatBuilder *b = &export->mBuilder;
+    flatReset(b);
+    size_t schema = buildExportSchema(b);
+
+    size_t vectors[2];
+    for (int v = 0; v < 2; v++) {
+        struct ArrowBlock *blocks = v == 0 ? export->mDictionaryBlocks : export->mBatchBlocks;
+        int count = v == 0 ? export->mDictionaryBlockCount : export->mBatchBlockCount;
+
+        flatStartVector(b, 24, count, 8);
+        for (int i = count - 1; i >= 0; i--) {
+            flatPushU64(b, blocks[i].mBodyLength);
+            flatPad(b, 4);
+            flatPushU32(b, blocks[i].mMetadataLength);
+            flatPushU64(b, blocks[i].mOffset);
+        }
+        vectors[v] = flatEndVector(b, count);
+    }
+
+    flatStartTable(b);
+    flatAddOffset(b, 1, schema);
+    flatAddOffset(b, 2, vectors[0]);
+    flatAddOffset(b, 3, vectors[1]);
+    flatAddU16(b, 0, ARROW_METADATA_V5);
+    flatFinish(b, flatEndTable(b));
+
+    int32_t footerLength = b->mSize;
+    writeFully(export->mFd, (char const *) flatGetData(b), b->mSize);
+    writeFully(export->mFd, (char const *) &footerLength, sizeof(footerLength));
+    writeFully(export->mFd, "ARROW1", 6);
+
+    if (close(export->mFd) == -1) {
+        perror("close");
+        exit(1);
+    }
+}
+
+// Value of the four hex digits at "s", or -1 if they aren't.
+int parseHex4(char const *s) {
+    int n = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' :
+            c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit == -1) {
+            return -1;
+        }
+        n = n*16 + digit;
+    }
+
+    return n;
+}
+
+// Encode the code point "c" as UTF-8 into "out". Returns the number of bytes.
+int encodeUtf8(uint32_t c, char *out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+// Get the next "key":value pair of the JSON object at "*p", advancing past
+// it. String values are unescaped into "value" (of "size" bytes), others
+// copied as they are. Returns 0 at the end of the object.
+int nextJsonField(char const **p, char const **key, int *keyLength, char *value, int size) {
+    char const *s = *p;
+
+    while (*s == '{' || *s == ',' || *s == ' ') {
+        s++;
+    }
+    if (*s != '"') {
+        return 0;
+    }
+    *key = ++s;
+    while (*s != '"' && *s != '\n') {
+        s++;
+    }
+    *keyLength = s - *key;
+    if (*s == '"') {
+        s++;
+    }
+    if (*s == ':') {
+        s++;
+    }
+
+    int length = 0;
+    if (*s == '"') {
+        for (s++; *s != '"' && *s != '\n'; s++) {
+            char bytes[4] = { *s };
+            int count = 1;
+            int code;
+            if (*s == '\\' && s[1] == 'u' && (code = parseHex4(s + 2)) != -1) {
+                s += 5;
+                if (code >= 0xD800 && code < 0xDC00) {
+                    // High surrogate, which should be followed by a low one.
+                    int low;
+                    if (s[1] == '\\' && s[2] == 'u' && (low = parseHex4(s + 3)) >= 0xDC00 &&
+                            low < 0xE000) {
+
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        s += 6;
+                    } else {
+                        code = 0xFFFD;
+                    }
+                } else if (code >= 0xDC00 && code < 0xE000) {
+                    code = 0xFFFD;
+                }
+                count = encodeUtf8(code, bytes);
+            } else if (*s == '\\' && s[1] != '\n') {
+                char c = *++s;
+                bytes[0] = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' :
+                    c == 'b' ? '\b' : c == 'f' ? '\f' : c;
+            }
+
+            // Only whole characters.
+            if (length + count < size) {
+                memcpy(value + length, bytes, count);
+                length += count;
+            }
+        }
+        if (*s == '"') {
+            s++;
+        }
+    } else {
+        for (; *s != ',' && *s != '}' && *s != '\n'; s++) {
+            if (length < size - 1) {
+                value[length++] = *s;
+            }
+        }
+    }
+    value[length] = '\0';
+
+    *p = s;
+
+    return 1;
+}
+
+// Add a merged record to the export "data". Records without a time, type or
+// target are left out.
+void exportRecord(struct MergeInput *input, char const *record, int length, void *data) {
+    struct ColumnarExport *export = (struct ColumnarExport *) data;
+
+    if (input == NULL) {
+        closeColumnarExport(export);
+        return;
+    }
+
+    int row = export->mRowCount;
+    struct ExportDictionary *dictionaries = export->mDictionaries;
+    struct ExportDoubles *doubles[] = { &export->mRtts, &export->mOffsets, &export->mDelays };
+    char const *key;
+    int keyLength;
+    char value[MAX_RECORD_LENGTH];
+    int haveType = 0;
+    int haveTarget = 0;
+    int result = -1;
+
+    // Start the row out null, since the bitmaps still have the last batch's.
+    uint8_t bit = 1 << (row%8);
+    export->mLogs[row] = -1;
+    export->mFroms[row] = 0;
+    export->mFromValid[row/8] &= ~bit;
+    for (int i = 0; i < 3; i++) {
+        doubles[i]->mValues[row] = 0;
+        doubles[i]->mValid[row/8] &= ~bit;
+    }
+
+    while (nextJsonField(&record, &key, &keyLength, value, sizeof(value))) {
+        if (keyLength == 1 && key[0] == 't') {
+            export->mTimes[row] = strtoll(value, NULL, 10);
+        } else if (keyLength == 3 && memcmp(key, "log", 3) == 0) {
+            export->mLogs[row] = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_LOG],
+                    value, strlen(value));
+        } else if (keyLength == 4 && memcmp(key, "type", 4) == 0) {
+            export->mTypes[row] = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_TYPE],
+                    value, strlen(value));
+            haveType = 1;
+        } else if (keyLength == 6 && memcmp(key, "target", 6) == 0) {
+            export->mTargets[row] = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_TARGET],
+                    value, strlen(value));
+            haveTarget = 1;
+        } else if (keyLength == 6 && memcmp(key, "result", 6) == 0) {
+            result = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_RESULT],
+                    value, strlen(value));
+        } else if (keyLength == 4 && memcmp(key, "from", 4) == 0) {
+            export->mFroms[row] = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_FROM],
+                    value, strlen(value));
+            export->mFromValid[row/8] |= bit;
+        } else {
+            int d = keyLength == 3 && memcmp(key, "rtt", 3) == 0 ? 0 :
+                keyLength == 6 && memcmp(key, "offset", 6) == 0 ? 1 :
+                keyLength == 5 && memcmp(key, "delay", 5) == 0 ? 2 : -1;
+            if (d != -1) {
+                doubles[d]->mValues[row] = strtod(value, NULL);
+                doubles[d]->mValid[row/8] |= bit;
+            }
+        }
+    }
+    if (!haveType || !haveTarget || result == -1) {
+        return;
+    }
+
+    // Untagged records are from the log the merge read them from.
+    if (export->mLogs[row] == -1) {
+        export->mLogs[row] = lookupExportDictionary(&dictionaries[EXPORT_DICTIONARY_LOG],
+                input->mName, strlen(input->mName));
+    }
+    if ((export->mFromValid[row/8] & bit) == 0) {
+        export->mFromNullCount++;
+    }
+    for (int i = 0; i < 3; i++) {
+        if ((doubles[i]->mValid[row/8] & bit) == 0) {
+            doubles[i]->mNullCount++;
+        }
+    }
+
+    // Extend the last run or start a new one.
+    if (export->mRunCount > 0 && export->mRunValues[export->mRunCount - 1] == result) {
+        export->mRunEnds[export->mRunCount - 1]++;
+    } else {
+        export->mRunValues[export->mRunCount] = result;
+        export->mRunEnds[export->mRunCount] = row + 1;
+        export->mRunCount++;
+    }
+
+    if (++export->mRowCount == EXPORT_BATCH_ROWS) {
+        writeExportBatch(export);
+    }
+}
+
+// Parse a rotation policy "size[,age[,keep]]" such as "64M,1d,30" into
+// "rotation". Size takes a K, M or G suffix and age s, m, h or d (default
+// seconds); 0 means no limit. Returns whether it's valid.
+int parseRotation(char const *spec, struct Rotation *rotation) {
+    char *end;
+
+    memset(rotation, 0, sizeof(*rotation));
+
+    rotation->mMaxSize = strtoll(spec, &end, 10);
+    switch (*end) {
+        case 'G': rotation->mMaxSize *= 1024;   // Fall through.
+        case 'M': rotation->mMaxSize *= 1024;   // Fall through.
+        case 'K': rotation->mMaxSize *= 1024; end++; break;
+    }
+    if (*end == ',') {
+        rotation->mMaxAge = strtod(end + 1, &end);
+        switch (*end) {
+            case 'd': rotation->mMaxAge *= 24;  // Fall through.
+            case 'h': rotation->mMaxAge *= 60;  // Fall through.
+            case 'm': rotation->mMaxAge *= 60;  // Fall through.
+            case 's': end++; break;
+        }
+    }
+    if (*end == ',') {
+        rotation->mKeep = strtol(end + 1, &end, 10);
+    }
+
+    return *end == '\0' && rotation->mMaxSize >= 0 && rotation->mMaxAge >= 0 &&
+        rotation->mKeep >= 0 && (rotation->mMaxSize > 0 || rotation->mMaxAge > 0);
+}
+
+// Parse "metric[,count]" for the worst-N view. Returns whether it's valid.
+int parseRanking(char const *spec, enum RankMetric *metric, int *count) {
+    char name[16];
+    int length = 0;
+
+    *count = 30;
+    if (sscanf(spec, "%15[a-z]%n", name, &length) != 1 ||
+            (spec[length] != '\0' && sscanf(spec + length, ",%d", count) != 1) ||
+            *count <= 0) {
+
+        return 0;
+    }
+
+    if (strcmp(name, "loss") == 0) {
+        *metric = RANK_LOSS;
+    } else if (strcmp(name, "rtt") == 0) {
+        *metric = RANK_RTT;
+    } else if (strcmp(name, "outage") == 0) {
+        *metric = RANK_OUTAGE;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Print command-line usage and exit.
+void usage(char const *program) {
+    fprintf(stderr, "Usage: %s [-m port] [-j file] [-s name] [-d socket] [-c socket]\n"
+            "           [-a host:port [-n name]]\n", program);
+    fprintf(stderr, "       %s -v socket\n", program);
+    fprintf(stderr, "       %s -c socket query|probe|pause|resume|collapse|expand|bench pattern\n", program);
+    fprintf(stderr, "       %s -C port [-T threads]\n", program);
+    fprintf(stderr, "       %s -a host:port -G agents,targets[,rate]\n", program);
+    fprintf(stderr, "       %s -N targets[,name=value...][,virtual] [-m port] [-j file] ...\n", program);
+    fprintf(stderr, "       %s -M [-F time] [-j file] log...\n", program);
+    fprintf(stderr, "       %s -X file [-F time] log...\n", program);
+    fprintf(stderr, "    -m port     Serve OpenMetrics (Prometheus) on http://*:port/metrics\n");
+    fprintf(stderr, "                and a live dashboard on http://*:port/\n");
+    fprintf(stderr, "    -w metric[,count]\n");
+    fprintf(stderr, "                Show only the count (default 30) worst tests by loss,\n");
+    fprintf(stderr, "                rtt (99th percentile) or outage (length)\n");
+    fprintf(stderr, "    -g          Show the table by group, with a summary row per group\n");
+    fprintf(stderr, "    -L mode     Show round-trip times instead of results, as bar heights\n");
+    fprintf(stderr, "                (spark) or colors (heat)\n");
+    fprintf(stderr, "    -I          Show the program's own timings under the table (or press i)\n");
+    fprintf(stderr, "    -j file     Append a JSON record per result to file (- for stdout)\n");
+    fprintf(stderr, "    -B policy   When the disk can't keep up with -j, drop the oldest records\n");
+    fprintf(stderr, "                (drop, the default) or make probing wait (block)\n");
+    fprintf(stderr, "    -R size[,age[,keep]]\n");
+    fprintf(stderr, "                Start a new -j file when it reaches size (e.g., 64M) or age\n");
+    fprintf(stderr, "                (e.g., 1d), compress the old one, and keep keep of them\n");
+    fprintf(stderr, "    -S file     Keep each test's history and statistics in file across restarts\n");
+    fprintf(stderr, "    -s name     Publish results in shared memory segment name (e.g., /network_diagnosis)\n");
+    fprintf(stderr, "    -d socket   Run in the background, serving viewers on Unix socket\n");
+    fprintf(stderr, "    -v socket   View the results of a background instance\n");
+    fprintf(stderr, "    -c socket   Serve control requests on Unix socket, or with a command,\n");
+    fprintf(stderr, "                make one; pattern is an address, a type of test, a group, or *\n");
+    fprintf(stderr, "    -a host:port  Stream results to the collector at host:port\n");
+    fprintf(stderr, "    -n name     Name to give the collector (default host name)\n");
+    fprintf(stderr, "    -C port     Collect results from agents on TCP port and show them all\n");
+    fprintf(stderr, "    -T threads  Threads reading from agents (default one per CPU)\n");
+    fprintf(stderr, "    -G agents,targets[,rate]\n");
+    fprintf(stderr, "                Load the collector with simulated agents sending rate\n");
+    fprintf(stderr, "                batches a second (default 1), and report its throughput\n");
+    fprintf(stderr, "    -N targets[,name=value...][,virtual]\n");
+    fprintf(stderr, "                Probe targets on a simulated network and report how the\n");
+    fprintf(stderr, "                loop keeps up; names are rtt (median ms), jitter (sigma\n");
+    fprintf(stderr, "                of log RTT), loss (%%), outage (%% chance:seconds), ticks\n");
+    fprintf(stderr, "                (to run, 0 for ever) and seed; virtual runs on a virtual\n");
+    fprintf(stderr, "                clock as fast as it can, the same way every time\n");
+    fprintf(stderr, "    -M          Merge the JSON logs (from -j) in time order to stdout or -j file\n");
+    fprintf(stderr, "    -F time     Merge only records from time (ms since the epoch) on\n");
+    fprintf(stderr, "    -X file     Export the merged JSON logs to file in Arrow IPC format\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int metricsPort = 0;
+    char *resultsPath = NULL;
+    char *shmName = NULL;
+    char *checkpointPath = NULL;
+    char *daemonPath = NULL;
+    char *viewerPath = NULL;
+    char *controlPath = NULL;
+    char *collectorAddress = NULL;
+    char *agentName = NULL;
+    int collectorPort = 0;
+    int threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    char *loadSpec = NULL;
+    char *simulationSpec = NULL;
+    int merge = 0;
+    int64_t mergeFrom = 0;
+    char *exportPath = NULL;
+    int blockWhenFull = 0;
+    struct Rotation rotation;
+    int rotating = 0;
+    int ranking = 0;
+    int grouped = 0;
+    enum LatencyView latencyView = LATENCY_NONE;
+    enum RankMetric rankMetric = RANK_LOSS;
+    int worstCount = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:gL:Ij:B:R:S:s:d:v:c:a:n:C:T:G:N:MF:X:")) != -1) {
+        switch (opt) {
+            case 'm':
+                metricsPort = atoi(optarg);
+                break;
+
+            case 'j':
+                resultsPath = optarg;
+                break;
+
+            case 'B':
+                if (strcmp(optarg, "block") == 0) {
+                    blockWhenFull = 1;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    blockWhenFull = 0;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+
+            case 'R':
+                if (!parseRotation(optarg, &rotation)) {
+                    usage(argv[0]);
+                }
+                rotating = 1;
+                break;
+
+            case 'S':
+                checkpointPath = optarg;
+                break;
+
+            case 's':
+                shmName = optarg;
+                break;
+
+            case 'd':
+                daemonPath = optarg;
+                break;
+
+            case 'v':
+                viewerPath = optarg;
+                break;
+
+            case 'c':
+                controlPath = optarg;
+                break;
+
+            case 'a':
+                collectorAddress = optarg;
+                break;
+
+            case 'n':
+                agentName = optarg;
+                break;
+
+            case 'C':
+                collectorPort = atoi(optarg);
+                break;
+
+            case 'T':
+                threadCount = atoi(optarg);
+                break;
+
+            case 'G':
+                loadSpec = optarg;
+                break;
+
+            case 'N':
+                simulationSpec = optarg;
+                break;
+
+            case 'M':
+                merge = 1;
+                break;
+
+            case 'F':
+                mergeFrom = strtoll(optarg, NULL, 10);
+                break;
+
+            case 'X':
+                exportPath = optarg;
+                break;
+
+            case 'w':
+                if (!parseRanking(optarg, &rankMetric, &worstCount)) {
+                    usage(argv[0]);
+                }
+                ranking = 1;
+                break;
+
+            case 'g':
+                grouped = 1;
+                break;
+
+            case 'I':
+                SELF_STATS.mShown = 1;
+                break;
+
+            case 'L':
+                if (strcmp(optarg, "spark") == 0) {
+                    latencyView = LATENCY_SPARK;
+                } else if (strcmp(optarg, "heat") == 0) {
+                    latencyView = LATENCY_HEAT;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (controlPath != NULL && optind + 2 == argc) {
+        return runControlCommand(controlPath, argv[optind], argv[optind + 1]);
+    }
+    if (exportPath != NULL) {
+        if (optind == argc) {
+            usage(argv[0]);
+        }
+        mergeLogs(argv + optind, argc - optind, mergeFrom, "Exported", exportRecord,
+                openColumnarExport(exportPath));
+        return 0;
+    }
+    if (merge) {
+        if (optind == argc) {
+            usage(argv[0]);
+        }
+        mergeLogs(argv + optind, argc - optind, mergeFrom, "Merged", writeMergedRecord,
+                openOutput(resultsPath == NULL ? "-" : resultsPath));
+        return 0;
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    if (viewerPath != NULL) {
+        runViewer(viewerPath);
+        return 0;
+    }
+
+    // Clients that hang up shouldn't kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (collectorPort != 0) {
+        runCollector(collectorPort, threadCount > 0 ? threadCount : 1, isatty(STDOUT_FILENO));
+        return 0;
+    }
+
+    if (loadSpec != NULL) {
+        int agentCount = 0;
+        int targetCount = 0;
+        double rate = 1;
+        if (collectorAddress == NULL ||
+                sscanf(loadSpec, "%d,%d,%lf", &agentCount, &targetCount, &rate) < 2 ||
+                agentCount <= 0 || targetCount <= 0 || rate <= 0) {
+
+            usage(argv[0]);
+        }
+        runLoadGenerator(collectorAddress, agentCount, targetCount, rate);
+        return 0;
+    }
+
+    if (simulationSpec != NULL) {
+        int targetCount = 0;
+        SIM_NETWORK = (struct SimNetwork *) calloc(1, sizeof(struct SimNetwork));
+        if (!parseSimulation(simulationSpec, SIM_NETWORK, &targetCount)) {
+            usage(argv[0]);
+        }
+        startSimulation(SIM_NETWORK, targetCount);
+    }
+
+    int maxWidth = getMaxWidth(TESTS, TEST_COUNT);
+
+    initializeTests(TESTS, TEST_COUNT);
+
+    if (checkpointPath != NULL) {
+        openCheckpoint(checkpointPath, TESTS, TEST_COUNT);
+    }
+
+    if (latencyView != LATENCY_NONE) {
+        startLatencyView(latencyView, TESTS, TEST_COUNT);
+    }
+
+    if (ranking) {
+        RANKING = startRanking(rankMetric, worstCount, TESTS, TEST_COUNT);
+    } else if (grouped) {
+        int groupWidth = startGroups(TESTS, TEST_COUNT);
+        if (groupWidth > maxWidth) {
+            maxWidth = groupWidth;
+        }
+    }
+
+    if (metricsPort != 0) {
+        startHttpServer(metricsPort);
+    }
+
+    if (resultsPath != NULL) {
+        if (rotating && strcmp(resultsPath, "-") == 0) {
+            fprintf(stderr, "Can't rotate standard output\n");
+            exit(1);
+        }
+        RESULTS_OUTPUT = openOutput(resultsPath);
+    }
+
+    if (shmName != NULL) {
+        createResultsShm(shmName, TESTS, TEST_COUNT);
+    }
+
+    if (controlPath != NULL) {
+        startUnixServer(controlPath, acceptControlClients);
+    }
+
+    if (collectorAddress != NULL) {
+        startAgent(collectorAddress, agentName);
+    }
+
+    // Detach after everything that could fail, so errors go to the terminal.
+    if (daemonPath != NULL) {
+        startUnixServer(daemonPath, acceptViewers);
+        detach();
+    }
+
+    // Threads don't survive detaching.
+    if (RESULTS_OUTPUT != NULL) {
+        startDiskWriter(RESULTS_OUTPUT, blockWhenFull, resultsPath, rotating ? &rotation : NULL);
+    }
+
+    // Only draw the table on a terminal that we're not also writing records
+    // to, or simulation reports.
+    int showTable = isatty(STDOUT_FILENO) && SIM_NETWORK == NULL &&
+        (RESULTS_OUTPUT == NULL || RESULTS_OUTPUT->mFd != STDOUT_FILENO);
+    // Otherwise, with standard output going nowhere else, log result changes
+    // to it as plain text.
+    int logChanges = !isatty(STDOUT_FILENO) && SIM_NETWORK == NULL &&
+        daemonPath == NULL && (RESULTS_OUTPUT == NULL || RESULTS_OUTPUT->mFd != STDOUT_FILENO);
+    struct TestTable table = { TESTS, TEST_COUNT, maxWidth, GROUPS != NULL, NULL };
+    if (RANKING != NULL) {
+        findWorstTests(RANKING);
+        table.mRows = RANKING->mWorst;
+        table.mCount = RANKING->mWorstCount;
+    }
+    if (showTable) {
+        startRenderer(&VIEWPORT, &table);
+        if (startKeyboard(&VIEWPORT)) {
+            watchFd(STDIN_FILENO, POLLIN, handleKeyboard, RENDERER);
+        }
+    }
+
+    if (SIM_NETWORK != NULL) {
+        SIM_NETWORK->mReportCpuTime = getCpuTime();
+    }
+
+    int tick = 0;
+    while (1) {
+        double tickStart = getMonotonicTime();
+        double deadline = tickStart + 1;
+        SELF_STATS.mSpawnTime = 0;
+        spawnTests(TESTS, TEST_COUNT);
+        while (getMonotonicTime() < deadline) {
+            waitForResults(TESTS, TEST_COUNT, deadline);
+            if (RENDERER != NULL) {
+                renderFrame(RENDERER);
+            }
+        }
+        checkResults(TESTS, TEST_COUNT);
+        if (GROUPS != NULL) {
+            recordGroupResults();
+        }
+        if (RESULTS_SHM != NULL) {
+            publishResults(RESULTS_SHM, TESTS, TEST_COUNT);
+        }
+        broadcastTick(TESTS, TEST_COUNT);
+        broadcastDashboard(TESTS, TEST_COUNT);
+        expireHttpClients();
+        if (AGENT_LINK != NULL) {
+            sendAgentBatch(AGENT_LINK, TESTS, TEST_COUNT);
+        }
+        tick++;
+        if (CHECKPOINT != NULL && tick % CHECKPOINT_INTERVAL == 0) {
+            writeCheckpoint(CHECKPOINT, TESTS, TEST_COUNT);
+        }
+        if (logChanges) {
+            printResultChanges(stdout, TESTS, TEST_COUNT, tick == 1);
+        }
+        finishTickStats(&SELF_STATS, TESTS, TEST_COUNT, tickStart);
+        if (SIM_NETWORK != NULL) {
+            int done = SELF_STATS.mTickCount == SIM_NETWORK->mTickLimit;
+            int interval = SIM_NETWORK->mVirtualClock ?
+                SIM_VIRTUAL_REPORT_INTERVAL : SIM_REPORT_INTERVAL;
+            if (done || SELF_STATS.mTickCount % interval == 0) {
+                reportSimulation(SIM_NETWORK, &SELF_STATS, TEST_COUNT);
+            }
+            if (done) {
+                return 0;
+            }
+        }
+        if (RENDERER != NULL) {
+            if (RANKING != NULL) {
+                findWorstTests(RANKING);
+                table.mCount = RANKING->mWorstCount;
+            }
+            requestFrame(RENDERER);
+            renderFrame(RENDERER);
+        }
     }
 
     return 0;
@@ -0,0 +1,58 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Prints a snapshot of the results that network_diagnosis publishes in
+// shared memory (its -s option). Also an example of using results_shm.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "results_shm.h"
+
+int main(int argc, char *argv[]) {
+    char const *name = argc > 1 ? argv[1] : "/network_diagnosis";
+
+    struct ResultsShm *shm = resultsShmOpen(name);
+    if (shm == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    int count = resultsShmCount(shm);
+    for (int i = 0; i < count; i++) {
+        struct ResultsShmRecord record;
+
+        resultsShmRead(shm, i, &record);
+
+        // Oldest to newest of the history we have.
+        char history[RESULTS_SHM_HISTORY + 1];
+        int length = 0;
+        uint64_t first = record.mTickCount > RESULTS_SHM_HISTORY ?
+            record.mTickCount - RESULTS_SHM_HISTORY : 0;
+        for (uint64_t t = first; t < record.mTickCount; t++) {
+            history[length++] = record.mHistory[t % RESULTS_SHM_HISTORY];
+        }
+        history[length] = '\0';
+
+        printf("%s %s: %s success=%llu failure=%llu rtt=%.6f\n",
+                record.mType, record.mAddress, history,
+                (unsigned long long) record.mSuccessCount,
+                (unsigned long long) record.mFailureCount,
+                record.mLastRtt);
+    }
+
+    resultsShmClose(shm);
+
+    return 0;
+}
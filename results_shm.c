@@ -0,0 +1,106 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reader side of the shared memory segment described in results_shm.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "results_shm.h"
+
+struct ResultsShm {
+    struct ResultsShmHeader *mHeader;
+    size_t mSize;
+};
+
+struct ResultsShm *resultsShmOpen(char const *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Make sure it's a layout we understand and that it's all there.
+    struct ResultsShmHeader *header = (struct ResultsShmHeader *) p;
+    if (size < sizeof(struct ResultsShmHeader) ||
+            header->mMagic != RESULTS_SHM_MAGIC ||
+            header->mVersion != RESULTS_SHM_VERSION ||
+            header->mRecordSize != sizeof(struct ResultsShmRecord) ||
+            size < sizeof(struct ResultsShmHeader) +
+                (size_t) header->mRecordCount*sizeof(struct ResultsShmRecord)) {
+
+        munmap(p, size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    struct ResultsShm *shm = (struct ResultsShm *) malloc(sizeof(struct ResultsShm));
+    shm->mHeader = header;
+    shm->mSize = size;
+
+    return shm;
+}
+
+int resultsShmCount(struct ResultsShm *shm) {
+    return shm->mHeader->mRecordCount;
+}
+
+int64_t resultsShmUpdateTime(struct ResultsShm *shm) {
+    return atomic_load_explicit(&shm->mHeader->mUpdateTime, memory_order_acquire);
+}
+
+void resultsShmReadRecord(struct ResultsShmRecord *shared, struct ResultsShmRecord *record) {
+    while (1) {
+        uint32_t before = atomic_load_explicit(&shared->mSequence, memory_order_acquire);
+        if (before % 2 == 1) {
+            // Being written.
+            continue;
+        }
+
+        memcpy(record, shared, sizeof(*record));
+
+        // Don't let the copy move past the second read of the sequence.
+        atomic_thread_fence(memory_order_acquire);
+        uint32_t after = atomic_load_explicit(&shared->mSequence, memory_order_relaxed);
+        if (before == after) {
+            return;
+        }
+    }
+}
+
+void resultsShmRead(struct ResultsShm *shm, int index, struct ResultsShmRecord *record) {
+    resultsShmReadRecord(&shm->mHeader->mRecords[index], record);
+}
+
+void resultsShmClose(struct ResultsShm *shm) {
+    munmap(shm->mHeader, shm->mSize);
+    free(shm);
+}
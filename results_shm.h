@@ -0,0 +1,121 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Layout of the POSIX shared memory segment in which network_diagnosis
+// publishes the current state of each test (see its -s option), and a small
+// library for reading it.
+//
+// The segment is a header followed by one fixed-size record per test. Each
+// record is protected by a sequence lock: the writer makes the sequence odd
+// while it's changing the record and even when it's done, so readers copy the
+// record and retry if the sequence was odd or changed during the copy. Readers
+// never block the writer and never make system calls.
+
+#ifndef RESULTS_SHM_H
+#define RESULTS_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// "NDSM", and the version of the layout below.
+#define RESULTS_SHM_MAGIC 0x4E44534D
+#define RESULTS_SHM_VERSION 2
+
+// Number of recent per-tick results kept in each record.
+#define RESULTS_SHM_HISTORY 64
+
+// State of one test.
+struct ResultsShmRecord {
+    // Sequence lock, odd while the writer is changing the record.
+    _Atomic uint32_t mSequence;
+
+    // Kind of test ("Ping", "DNS", ...) and its target.
+    char mType[8];
+    char mAddress[48];
+
+    // Router that reported the most recent ICMP error, or empty.
+    char mErrorFrom[16];
+
+    // Number of probes that got a reply and that failed.
+    uint64_t mSuccessCount;
+    uint64_t mFailureCount;
+
+    // Round-trip time in seconds of the most recent reply.
+    double mLastRtt;
+
+    // Number of ticks recorded so far. The result of tick "t" (one of the
+    // characters shown in the table) is in mHistory[t % RESULTS_SHM_HISTORY]
+    // for the last RESULTS_SHM_HISTORY ticks.
+    uint64_t mTickCount;
+    char mHistory[RESULTS_SHM_HISTORY];
+
+    // Wall-clock time in milliseconds since the Unix epoch of the most recent
+    // tick in mHistory, or 0 before the first.
+    int64_t mTickTime;
+};
+
+// Start of the segment.
+struct ResultsShmHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mRecordSize;
+    uint32_t mRecordCount;
+
+    // Wall-clock time in milliseconds since the Unix epoch of the last update.
+    _Atomic int64_t mUpdateTime;
+
+    struct ResultsShmRecord mRecords[];
+};
+
+// Start changing a record. Only one thread may write a record at a time.
+static inline void resultsShmBeginWrite(struct ResultsShmRecord *record) {
+    uint32_t sequence = atomic_load_explicit(&record->mSequence, memory_order_relaxed);
+
+    // Odd while we're changing it. The fence keeps the changes from becoming
+    // visible before the sequence does.
+    atomic_store_explicit(&record->mSequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// Finish changing a record.
+static inline void resultsShmEndWrite(struct ResultsShmRecord *record) {
+    uint32_t sequence = atomic_load_explicit(&record->mSequence, memory_order_relaxed);
+
+    atomic_store_explicit(&record->mSequence, sequence + 1, memory_order_release);
+}
+
+// Copy a consistent snapshot of "shared" into "record". Works on any record,
+// in the segment or not.
+void resultsShmReadRecord(struct ResultsShmRecord *shared, struct ResultsShmRecord *record);
+
+// Mapping of a segment by a reader.
+struct ResultsShm;
+
+// Map the segment "name" (e.g., "/network_diagnosis") read-only. Returns NULL
+// and sets errno on failure, with EPROTO if it's not a segment we understand.
+struct ResultsShm *resultsShmOpen(char const *name);
+
+// Number of records in the segment.
+int resultsShmCount(struct ResultsShm *shm);
+
+// Wall-clock time in milliseconds since the Unix epoch of the last update.
+int64_t resultsShmUpdateTime(struct ResultsShm *shm);
+
+// Copy a consistent snapshot of record "index" into "record".
+void resultsShmRead(struct ResultsShm *shm, int index, struct ResultsShmRecord *record);
+
+// Unmap the segment.
+void resultsShmClose(struct ResultsShm *shm);
+
+#endif // RESULTS_SHM_H
@@ -0,0 +1,252 @@
+// Copyright 2017 Lawrence Kesteloot
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stress test of the shared memory segment (see results_shm.h). A writer
+// publishes ticks as fast as it can with network_diagnosis.c's own
+// createResultsShm() and publishResults(), while readers, some using
+// results_shm.h directly and some running results_dump, check that every
+// record they see is whole. The writer keeps the fields of each record in a
+// fixed relation to its tick count, so a torn read breaks the relation. Run
+// with "make test".
+
+#define main networkDiagnosisMain
+#include "network_diagnosis.c"
+#undef main
+
+// Number of records, and seconds to write them for.
+#define SHM_TEST_RECORDS 500
+#define SHM_TEST_SECONDS 3
+
+// Number of readers of each kind.
+#define SHM_TEST_READERS 2
+
+// Result character of tick "t".
+char getTickChar(uint64_t t) {
+    return 'A' + t % 26;
+}
+
+// Check one record read from the segment, returning an error message or NULL.
+char const *checkRecord(struct ResultsShmRecord *record, int index) {
+    char address[48];
+
+    snprintf(address, sizeof(address), "10.0.%d.%d", index >> 8, index & 0xFF);
+    if (record->mSequence % 2 != 0) {
+        return "odd sequence";
+    }
+    if (strcmp(record->mType, "DNS") != 0 || strcmp(record->mAddress, address) != 0) {
+        return "wrong type or address";
+    }
+    if (record->mTickCount == 0) {
+        return NULL;
+    }
+
+    uint64_t tick = record->mTickCount - 1;
+    if (record->mSuccessCount != tick ||
+            record->mFailureCount != 2*tick ||
+            record->mLastRtt != tick*0.001 ||
+            record->mHistory[tick % RESULTS_SHM_HISTORY] != getTickChar(tick)) {
+
+        return "torn record";
+    }
+
+    return NULL;
+}
+
+// Publish ticks until "deadline". Returns the number of ticks.
+uint64_t runWriter(char const *name, double deadline) {
+    struct Test *tests = (struct Test *) calloc(SHM_TEST_RECORDS, sizeof(struct Test));
+
+    for (int i = 0; i < SHM_TEST_RECORDS; i++) {
+        tests[i].mTestType = DNS;
+        asprintf(&tests[i].mAddress, "10.0.%d.%d", i >> 8, i & 0xFF);
+        startHistory(&tests[i].mResults);
+    }
+    createResultsShm(name, tests, SHM_TEST_RECORDS);
+
+    uint64_t tick = 0;
+    while (getMonotonicTime() < deadline) {
+        for (int i = 0; i < SHM_TEST_RECORDS; i++) {
+            struct Test *test = &tests[i];
+
+            test->mSuccessCount = tick;
+            test->mFailureCount = 2*tick;
+            test->mLastRtt = tick*0.001;
+            addToHistory(&test->mResults, getTickChar(tick));
+        }
+        publishResults(RESULTS_SHM, tests, SHM_TEST_RECORDS);
+        tick++;
+    }
+
+    return tick;
+}
+
+// Read every record through results_shm.h until "deadline". Returns the
+// number of records read.
+uint64_t runDirectReader(char const *name, double deadline) {
+    struct ResultsShm *shm;
+    uint64_t reads = 0;
+
+    // Wait for the writer to create the segment.
+    while ((shm = resultsShmOpen(name)) == NULL) {
+        usleep(1000);
+    }
+    if (resultsShmCount(shm) != SHM_TEST_RECORDS) {
+        fprintf(stderr, "Segment has %d records\n", resultsShmCount(shm));
+        exit(1);
+    }
+
+    while (getMonotonicTime() < deadline) {
+        for (int i = 0; i < SHM_TEST_RECORDS; i++) {
+            struct ResultsShmRecord record;
+
+            resultsShmRead(shm, i, &record);
+            char const *error = checkRecord(&record, i);
+            if (error != NULL) {
+                fprintf(stderr, "Record %d: %s\n", i, error);
+                exit(1);
+            }
+            reads++;
+        }
+    }
+    resultsShmClose(shm);
+
+    return reads;
+}
+
+// Run results_dump until "deadline", checking each line it prints. Returns
+// the number of lines.
+uint64_t runDumpReader(char const *name, double deadline) {
+    char command[256];
+    uint64_t reads = 0;
+
+    // Wait for the writer to create the segment.
+    struct ResultsShm *shm;
+    while ((shm = resultsShmOpen(name)) == NULL) {
+        usleep(1000);
+    }
+    resultsShmClose(shm);
+
+    snprintf(command, sizeof(command), "./results_dump %s", name);
+    while (getMonotonicTime() < deadline) {
+        FILE *f = popen(command, "r");
+        if (f == NULL) {
+            perror("popen");
+            exit(1);
+        }
+
+        char line[256];
+        int index = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            struct ResultsShmRecord record;
+            char history[RESULTS_SHM_HISTORY + 1];
+            unsigned long long success;
+            unsigned long long failure;
+
+            // The history is empty before the first tick.
+            memset(&record, 0, sizeof(record));
+            history[0] = '\0';
+            if (sscanf(line, "%7s %47[^:]: %64s success=%llu failure=%llu rtt=%lf",
+                        record.mType, record.mAddress, history,
+                        &success, &failure, &record.mLastRtt) != 6 &&
+                    sscanf(line, "%7s %47[^:]:  success=%llu failure=%llu rtt=%lf",
+                        record.mType, record.mAddress,
+                        &success, &failure, &record.mLastRtt) != 5) {
+
+                fprintf(stderr, "Can't parse results_dump line: %s", line);
+                exit(1);
+            }
+
+            // Rebuild the record's tick count and history from the line. The
+            // RTT is printed rounded, so compare it loosely.
+            int length = strlen(history);
+            record.mSuccessCount = success;
+            record.mFailureCount = failure;
+            record.mTickCount = length > 0 ? success + 1 : 0;
+            for (int i = 0; i < length; i++) {
+                uint64_t t = record.mTickCount - length + i;
+                record.mHistory[t % RESULTS_SHM_HISTORY] = history[i];
+                if (history[i] != getTickChar(t)) {
+                    fprintf(stderr, "Record %d: wrong history %s\n", index, history);
+                    exit(1);
+                }
+            }
+            if (fabs(record.mLastRtt - success*0.001) > 1e-6) {
+                fprintf(stderr, "Record %d: torn record\n", index);
+                exit(1);
+            }
+            record.mLastRtt = record.mTickCount > 0 ? (record.mTickCount - 1)*0.001 : 0;
+            char const *error = checkRecord(&record, index);
+            if (error != NULL) {
+                fprintf(stderr, "Record %d: %s\n", index, error);
+                exit(1);
+            }
+            index++;
+            reads++;
+        }
+        if (pclose(f) != 0 || index != SHM_TEST_RECORDS) {
+            fprintf(stderr, "results_dump failed after %d records\n", index);
+            exit(1);
+        }
+    }
+
+    return reads;
+}
+
+int main(int argc, char *argv[]) {
+    // Still needed by removeResultsShm() after main() returns.
+    static char name[64];
+    pid_t readers[2*SHM_TEST_READERS];
+
+    snprintf(name, sizeof(name), "/network_diagnosis_test.%d", (int) getpid());
+    double deadline = getMonotonicTime() + SHM_TEST_SECONDS;
+
+    for (int i = 0; i < 2*SHM_TEST_READERS; i++) {
+        readers[i] = fork();
+        if (readers[i] == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (readers[i] == 0) {
+            int direct = i < SHM_TEST_READERS;
+            uint64_t reads = direct ?
+                runDirectReader(name, deadline) : runDumpReader(name, deadline);
+            printf("%s reader %d: %llu records\n",
+                    direct ? "results_shm.h" : "results_dump", i, (unsigned long long) reads);
+            exit(0);
+        }
+    }
+
+    uint64_t ticks = runWriter(name, deadline);
+    printf("writer: %llu ticks of %d records\n", (unsigned long long) ticks, SHM_TEST_RECORDS);
+
+    int failed = 0;
+    for (int i = 0; i < 2*SHM_TEST_READERS; i++) {
+        int status;
+
+        if (waitpid(readers[i], &status, 0) == -1) {
+            perror("waitpid");
+            exit(1);
+        }
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+
+    // The segment is removed when we exit, like network_diagnosis does.
+    if (failed) {
+        fprintf(stderr, "FAIL\n");
+        exit(1);
+    }
+    printf("PASS\n");
+
+    return 0;
+}
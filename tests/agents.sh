@@ -0,0 +1,65 @@
+#!/bin/sh
+# Many agents against a collector over loopback: a load generator pretending
+# to be AGENTS agents with TARGETS tests each, plus real agents probing a
+# simulated network. Checks that the collector counts all the agents and
+# applies all of their results. Then restarts the collector while the real
+# agents keep running, and checks that they resend what the first collector
+# didn't acknowledge, with no batch missing or applied twice.
+
+AGENTS=200
+TARGETS=100
+REAL_AGENTS=3
+REAL_TARGETS=10
+DOWN=10
+PORT=17070
+ND=./network_diagnosis
+LOG=$(mktemp)
+
+trap 'kill $LOAD $REAL $COLLECTOR 2>/dev/null; rm -f $LOG' EXIT
+
+# Wait for the collector's report number $1 (it reports every ten seconds).
+waitForReport() {
+    while [ $(wc -l < $LOG) -lt $1 ]; do
+        if ! kill -0 $COLLECTOR 2>/dev/null; then
+            cat $LOG
+            echo FAIL
+            exit 1
+        fi
+        sleep 1
+    done
+    tail -1 $LOG
+}
+
+$ND -C $PORT -T 2 > /dev/null 2> $LOG &
+COLLECTOR=$!
+sleep 1
+$ND -a 127.0.0.1:$PORT -G $AGENTS,$TARGETS > /dev/null &
+LOAD=$!
+REAL=
+for i in $(seq $REAL_AGENTS); do
+    $ND -a localhost:$PORT -n real$i -N $REAL_TARGETS > /dev/null &
+    REAL="$REAL $!"
+done
+
+# Use the second report, after everyone has connected.
+waitForReport 2 | awk -v agents=$((AGENTS + REAL_AGENTS)) -v results=$((AGENTS*TARGETS)) '
+    { print }
+    $1 != agents || $3 < results*0.9 || $5 != 0 || $8 != 0 { print "FAIL"; exit 1 }
+    { print "PASS" }' || exit 1
+
+# The load generator gives up when the collector goes away, the real agents
+# keep their batches until a collector acknowledges them.
+kill -9 $COLLECTOR $LOAD
+wait $COLLECTOR $LOAD 2>/dev/null
+sleep $DOWN
+: > $LOG
+$ND -C $PORT -T 2 > /dev/null 2> $LOG &
+COLLECTOR=$!
+
+# The first report covers the batches from while the collector was down as
+# well as its ten seconds, those that were lost would make it short.
+waitForReport 1 | awk -v agents=$REAL_AGENTS \
+        -v results=$((REAL_AGENTS*REAL_TARGETS*(DOWN + 10)/10)) '
+    { print }
+    $1 != agents || $3 < results*0.85 || $5 != 0 || $8 != 0 { print "FAIL"; exit 1 }
+    { print "PASS" }'
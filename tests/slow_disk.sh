@@ -0,0 +1,59 @@
+#!/bin/sh
+# JSON records into a FIFO that is read at about 40 KB/s, far slower than the
+# records come, as on a dying SD card. With -B drop, checks that the ticks
+# still come once a second and that the records that didn't fit are counted
+# as dropped. The ticks of this many simulated targets run a little over a
+# second anyway, doing the work at the end of each, so we check that they
+# don't get any longer rather than that none are late. Then does the same
+# with records into /dev/full, as on a full disk, where every write fails:
+# probing must carry on and count them all as dropped.
+
+TARGETS=10000
+SECONDS_TO_RUN=12
+PORT=19109
+ND=./network_diagnosis
+DIR=$(mktemp -d)
+
+trap 'kill $ND_PID $READER 2>/dev/null; rm -rf $DIR' EXIT
+
+mkfifo $DIR/records
+(while dd bs=4k count=1 status=none; do sleep 0.1; done < $DIR/records > /dev/null) &
+READER=$!
+$ND -N $TARGETS -j $DIR/records -B drop -m $PORT > /dev/null &
+ND_PID=$!
+
+sleep $SECONDS_TO_RUN
+curl -s -m 5 http://127.0.0.1:$PORT/metrics > $DIR/metrics
+grep -E '^network_diagnosis_(self_ticks_total|self_tick_seconds|records_total)' $DIR/metrics
+
+awk -v seconds=$SECONDS_TO_RUN '
+    /^network_diagnosis_self_ticks_total/ { ticks = $2 }
+    /^network_diagnosis_self_tick_seconds/ { tick = $2 }
+    /^network_diagnosis_records_total\{result="dropped"\}/ { dropped = $2 }
+    END {
+        if (ticks < seconds - 3 || tick > 1.25 || dropped == 0) {
+            print "FAIL"
+            exit 1
+        }
+    }' $DIR/metrics || exit 1
+kill $ND_PID
+wait $ND_PID
+
+$ND -N 100 -j /dev/full -m $PORT > /dev/null 2> /dev/null &
+ND_PID=$!
+
+sleep 5
+curl -s -m 5 http://127.0.0.1:$PORT/metrics > $DIR/metrics
+grep -E '^network_diagnosis_(self_ticks_total|records_total)' $DIR/metrics
+
+awk '
+    /^network_diagnosis_self_ticks_total/ { ticks = $2 }
+    /^network_diagnosis_records_total\{result="written"\}/ { written = $2 }
+    /^network_diagnosis_records_total\{result="dropped"\}/ { dropped = $2 }
+    END {
+        if (ticks < 3 || written != 0 || dropped == 0) {
+            print "FAIL"
+            exit 1
+        }
+        print "PASS"
+    }' $DIR/metrics